@@ -0,0 +1,479 @@
+// Per-stage microbenchmark for the parts of the module that don't depend on
+// V8: decoding, compositing, encoding and the streaming blend pipeline. The
+// corpus is generated on the fly, so runs are reproducible across machines.
+//
+//   build/default/bench [--sizes=256,1024] [--layers=1,4,12]
+//                       [--stages=decode,composite,overlay,encode,blend]
+//                       [--min-time=0.2] [--max-memory=512]
+//
+// Prints one JSON document with a result per case to stdout and progress to
+// stderr.
+
+#include <sys/time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+
+#include <string>
+#include <vector>
+
+#include "reader.h"
+#include "composite.h"
+#include "encoder.h"
+#include "pool.h"
+
+// Counts heap allocations made through operator new.
+static volatile uint64_t heapAllocations = 0;
+
+void* operator new(size_t size) {
+    __sync_add_and_fetch(&heapAllocations, 1);
+    void* data = malloc(size ? size : 1);
+    if (data == NULL) throw std::bad_alloc();
+    return data;
+}
+
+void operator delete(void* data) throw() {
+    free(data);
+}
+
+// Compresses the bands of large PNGs on one short-lived thread per band, in
+// place of the module's worker pool.
+class ThreadEncodeExecutor : public EncodeExecutor {
+public:
+    int threads() {
+        long count = sysconf(_SC_NPROCESSORS_ONLN);
+        return count > 0 ? count : 1;
+    }
+
+    bool submit(void (*task)(void* data), void* data) {
+        Task* job = new Task();
+        job->task = task;
+        job->data = data;
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, run, job) != 0) {
+            delete job;
+            return false;
+        }
+        pthread_detach(thread);
+        return true;
+    }
+
+protected:
+    struct Task {
+        void (*task)(void* data);
+        void* data;
+    };
+
+    static void* run(void* data) {
+        Task* job = static_cast<Task*>(data);
+        job->task(job->data);
+        delete job;
+        return NULL;
+    }
+};
+
+enum Kind {
+    KIND_PALETTE,
+    KIND_RGB,
+    // Varying alpha everywhere.
+    KIND_DENSE,
+    // Mostly transparent, with a few opaque blocks.
+    KIND_SPARSE,
+    KIND_JPEG
+};
+
+static const char* const kindNames[] = { "palette", "rgb", "dense", "sparse", "jpeg" };
+
+struct Settings {
+    std::vector<unsigned long> sizes;
+    std::vector<int> layers;
+    std::string stages;
+    double minTime;
+    size_t maxMemory;
+};
+
+struct Result {
+    double seconds;
+    uint64_t iterations;
+    uint64_t heap;
+    uint64_t pool;
+};
+
+static double now() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static inline unsigned int noise(unsigned long x, unsigned long y, unsigned int seed) {
+    unsigned int h = (x * 374761393u) ^ (y * 668265263u) ^ (seed * 2246822519u);
+    h = (h ^ (h >> 13)) * 1274126177u;
+    return h ^ (h >> 16);
+}
+
+// Straight alpha ABGR pixels, different for every seed.
+static void generate(Kind kind, unsigned long size, unsigned int seed, unsigned int* pixels) {
+    for (unsigned long y = 0; y < size; y++) {
+        for (unsigned long x = 0; x < size; x++) {
+            unsigned int r = (x + seed * 37) & 0xFF;
+            unsigned int g = (y * 2 + seed * 11) & 0xFF;
+            unsigned int b = ((x ^ y) + (noise(x, y, seed) & 7)) & 0xFF;
+            unsigned int a = 0xFF;
+            switch (kind) {
+                case KIND_PALETTE: {
+                    unsigned int index = (x / 16 + y / 16 + seed) % 64;
+                    r = index * 4;
+                    g = 255 - index * 4;
+                    b = (index * 37) & 0xFF;
+                    break;
+                }
+                case KIND_DENSE:
+                    a = 0x80 + ((x * y + seed) & 0x7F);
+                    break;
+                case KIND_SPARSE:
+                    if ((x / 32 + y / 32 + seed) % 7 != 0) r = g = b = a = 0;
+                    break;
+                default:
+                    break;
+            }
+            pixels[y * size + x] = (a << 24) | (b << 16) | (g << 8) | r;
+        }
+    }
+}
+
+class StringOutput : public EncodeOutput {
+public:
+    void write(const char* data, size_t length) { buffer.append(data, length); }
+    void reserve(size_t length) { buffer.reserve(length); }
+    std::string buffer;
+};
+
+class NullOutput : public EncodeOutput {
+public:
+    NullOutput() : length(0) {}
+    void write(const char* data, size_t size) { length += size; }
+    size_t length;
+};
+
+// Encodes a generated image in the format the benchmarks decode.
+static std::string encodeCorpus(Kind kind, unsigned long size, unsigned int seed) {
+    unsigned int* pixels = (unsigned int*)malloc(size * size * 4);
+    generate(kind, size, seed, pixels);
+
+    EncodeOptions options;
+    if (kind == KIND_PALETTE) options.color = COLOR_PALETTE;
+    if (kind == KIND_JPEG) options.type = TYPE_JPEG;
+    bool alpha = kind == KIND_DENSE || kind == KIND_SPARSE;
+
+    StringOutput output;
+    encodeImage((const unsigned char*)pixels, size, size, size * 4, alpha, options, &output);
+    free(pixels);
+    return output.buffer;
+}
+
+// Runs `fn` until `minTime` has passed, at least twice.
+template <class Fn>
+static Result measure(Fn& fn, double minTime) {
+    // Warm up the buffer pool and caches.
+    fn();
+
+    Result result = { 0, 0, 0, 0 };
+    uint64_t heap = heapAllocations;
+    BufferPool::Stats pool = BufferPool::stats();
+    double start = now();
+    do {
+        fn();
+        result.iterations++;
+        result.seconds = now() - start;
+    } while (result.seconds < minTime || result.iterations < 2);
+
+    result.heap = heapAllocations - heap;
+    result.pool = BufferPool::stats().allocations - pool.allocations;
+    return result;
+}
+
+static bool first = true;
+
+// `pixels` is the number of output pixels and `bytes` the amount of data
+// processed per iteration.
+static void report(const char* stage, const char* kind, unsigned long size, int layers,
+                   const char* variant, const Result& result, double pixels, double bytes) {
+    double perIteration = result.seconds / result.iterations;
+    double nsPerPixel = perIteration * 1e9 / pixels;
+    double mbPerSecond = bytes / perIteration / (1024 * 1024);
+
+    fprintf(stderr, "%-9s %-8s %5lu px %2d layers %-10s %8.2f ns/px %9.1f MB/s\n",
+            stage, kind, size, layers, variant, nsPerPixel, mbPerSecond);
+
+    printf("%s\n    { \"stage\": \"%s\", \"kind\": \"%s\", \"size\": %lu, \"layers\": %d, "
+           "\"variant\": \"%s\", \"iterations\": %llu, \"nsPerPixel\": %.3f, "
+           "\"mbPerSecond\": %.2f, \"heapAllocations\": %.2f, \"poolAllocations\": %.2f }",
+           first ? "" : ",", stage, kind, size, layers, variant,
+           (unsigned long long)result.iterations, nsPerPixel, mbPerSecond,
+           (double)result.heap / result.iterations, (double)result.pool / result.iterations);
+    first = false;
+}
+
+struct DecodeStage {
+    const std::string* data;
+    int scale;
+    unsigned int* pixels;
+
+    void operator()() {
+        ImageReader* reader = ImageReader::create(data->data(), data->size(), scale);
+        reader->decode((unsigned char*)pixels, true);
+        delete reader;
+    }
+};
+
+static void benchDecode(const Settings& settings, unsigned long size) {
+    for (int kind = KIND_PALETTE; kind <= KIND_JPEG; kind++) {
+        std::string data = encodeCorpus((Kind)kind, size, 1);
+        int maxScale = kind == KIND_JPEG ? 8 : 1;
+        for (int scale = 1; scale <= maxScale; scale *= 2) {
+            unsigned long scaled = (size + scale - 1) / scale;
+            unsigned int* pixels = (unsigned int*)malloc(scaled * scaled * 4);
+            DecodeStage stage = { &data, scale, pixels };
+            Result result = measure(stage, settings.minTime);
+
+            char variant[16];
+            snprintf(variant, sizeof(variant), "1/%d", scale);
+            report("decode", kindNames[kind], size, 1, variant, result,
+                   (double)scaled * scaled, (double)scaled * scaled * 4);
+            free(pixels);
+        }
+    }
+}
+
+// Composites decoded layers from the top down one row at a time, skipping
+// lower layers once a row is opaque, like blend() does. `rows` holds the
+// premultiplied result and the premultiplied row of the current layer.
+struct CompositeStage {
+    std::vector<unsigned int*>* layers;
+    unsigned long size;
+    unsigned int* rows;
+
+    void operator()() {
+        unsigned int* row = rows + size;
+        for (unsigned long y = 0; y < size; y++) {
+            premultiply(rows, (*layers)[0] + y * size, size);
+            for (size_t i = 1; i < layers->size() && !compositeOpaque(rows, size); i++) {
+                premultiply(row, (*layers)[i] + y * size, size);
+                compositePremultiplied(rows, rows, row, size);
+            }
+            unpremultiply(rows, rows, size);
+        }
+    }
+};
+
+// Composites whole surfaces like Image#overlay does.
+struct OverlayStage {
+    std::vector<unsigned int*>* layers;
+    unsigned long size;
+    unsigned int* surface;
+
+    void operator()() {
+        size_t count = layers->size();
+        memcpy(surface, (*layers)[count - 1], size * size * 4);
+        for (size_t i = count - 1; i-- > 0;) {
+            composite(surface, (*layers)[i], surface, size * size);
+        }
+    }
+};
+
+static void benchComposite(const Settings& settings, unsigned long size, bool overlay) {
+    static const Kind kinds[] = { KIND_DENSE, KIND_SPARSE };
+    for (int k = 0; k < 2; k++) {
+        for (size_t l = 0; l < settings.layers.size(); l++) {
+            int count = settings.layers[l];
+            if ((size_t)(count + 1) * size * size * 4 > settings.maxMemory) continue;
+
+            std::vector<unsigned int*> layers;
+            for (int i = 0; i < count; i++) {
+                layers.push_back((unsigned int*)malloc(size * size * 4));
+                generate(kinds[k], size, i + 1, layers.back());
+            }
+
+            Result result;
+            if (overlay) {
+                OverlayStage stage = { &layers, size, (unsigned int*)malloc(size * size * 4) };
+                result = measure(stage, settings.minTime);
+                free(stage.surface);
+            } else {
+                CompositeStage stage = { &layers, size, (unsigned int*)malloc(2 * size * 4) };
+                result = measure(stage, settings.minTime);
+                free(stage.rows);
+            }
+            report(overlay ? "overlay" : "composite", kindNames[kinds[k]], size, count,
+                   compositeImplementation(), result, (double)size * size,
+                   (double)size * size * 4 * count);
+
+            for (int i = 0; i < count; i++) free(layers[i]);
+        }
+    }
+}
+
+struct EncodeStage {
+    const unsigned int* pixels;
+    unsigned long size;
+    bool alpha;
+    EncodeOptions options;
+    size_t length;
+
+    void operator()() {
+        NullOutput output;
+        encodeImage((const unsigned char*)pixels, size, size, size * 4, alpha, options, &output);
+        length = output.length;
+    }
+};
+
+static void benchEncode(const Settings& settings, unsigned long size) {
+    struct Variant {
+        const char* name;
+        EncodeType type;
+        EncodeColor color;
+        int level;
+    };
+    static const Variant variants[] = {
+        { "default", TYPE_PNG, COLOR_SOURCE, 1 },
+        { "level6", TYPE_PNG, COLOR_SOURCE, 6 },
+        { "auto", TYPE_PNG, COLOR_AUTO, 1 },
+        { "palette", TYPE_PNG, COLOR_PALETTE, 1 },
+        { "jpeg", TYPE_JPEG, COLOR_SOURCE, 1 }
+    };
+
+    unsigned int* pixels = (unsigned int*)malloc(size * size * 4);
+    for (int kind = KIND_PALETTE; kind <= KIND_SPARSE; kind++) {
+        generate((Kind)kind, size, 1, pixels);
+        bool alpha = kind == KIND_DENSE || kind == KIND_SPARSE;
+        for (size_t v = 0; v < sizeof(variants) / sizeof(variants[0]); v++) {
+            EncodeStage stage = { pixels, size, alpha, EncodeOptions(), 0 };
+            stage.options.type = variants[v].type;
+            stage.options.color = variants[v].color;
+            stage.options.level = variants[v].level;
+            Result result = measure(stage, settings.minTime);
+            report("encode", kindNames[kind], size, 1, variants[v].name, result,
+                   (double)size * size, (double)size * size * 4);
+        }
+    }
+    free(pixels);
+}
+
+// Decodes the layers in lockstep, composites each row and streams it to the
+// PNG encoder; the single threaded path of blend().
+struct BlendStage {
+    std::vector<std::string>* layers;
+    unsigned long size;
+    unsigned int* rows;
+
+    void operator()() {
+        size_t count = layers->size();
+        std::vector<ImageReader*> readers;
+        for (size_t i = count; i-- > 0;) {
+            readers.push_back(ImageReader::create((*layers)[i].data(), (*layers)[i].size()));
+        }
+        std::vector<bool> started(count, false);
+
+        NullOutput output;
+        RowEncoder encoder(size, size, true, EncodeOptions(), &output);
+        readers[0]->begin(true);
+        for (unsigned long y = 0; y < size; y++) {
+            readers[0]->readRow((unsigned char*)rows);
+            premultiply(rows, rows, size);
+            for (size_t i = 1; i < count && !compositeOpaque(rows, size); i++) {
+                if (!started[i]) {
+                    readers[i]->begin(true);
+                    started[i] = true;
+                }
+                unsigned int* row = rows + i * size;
+                readers[i]->skipTo(y);
+                readers[i]->readRow((unsigned char*)row);
+                premultiply(row, row, size);
+                compositePremultiplied(rows, rows, row, size);
+            }
+            unpremultiply(rows, rows, size);
+            encoder.write(rows);
+        }
+        encoder.finish();
+
+        for (size_t i = 0; i < count; i++) delete readers[i];
+    }
+};
+
+static void benchBlend(const Settings& settings, unsigned long size) {
+    static const Kind kinds[] = { KIND_DENSE, KIND_SPARSE };
+    for (int k = 0; k < 2; k++) {
+        for (size_t l = 0; l < settings.layers.size(); l++) {
+            int count = settings.layers[l];
+            if ((size_t)count * size * size * 4 > settings.maxMemory) continue;
+
+            std::vector<std::string> layers;
+            for (int i = 0; i < count; i++) {
+                layers.push_back(encodeCorpus(kinds[k], size, i + 1));
+            }
+            BlendStage stage = { &layers, size, (unsigned int*)malloc(count * size * 4) };
+            Result result = measure(stage, settings.minTime);
+            report("blend", kindNames[kinds[k]], size, count, "stream", result,
+                   (double)size * size, (double)size * size * 4 * count);
+            free(stage.rows);
+        }
+    }
+}
+
+template <class T>
+static std::vector<T> parseList(const char* value) {
+    std::vector<T> result;
+    while (*value) {
+        char* end;
+        result.push_back((T)strtoul(value, &end, 10));
+        value = *end ? end + 1 : end;
+    }
+    return result;
+}
+
+int main(int argc, char** argv) {
+    Settings settings;
+    settings.sizes = parseList<unsigned long>("256,1024,4096");
+    settings.layers = parseList<int>("1,2,4,8,12");
+    settings.stages = "decode,composite,overlay,encode,blend";
+    settings.minTime = 0.2;
+    settings.maxMemory = 512 * 1024 * 1024;
+
+    static ThreadEncodeExecutor executor;
+    encodeSetExecutor(&executor);
+
+    for (int i = 1; i < argc; i++) {
+        const char* arg = argv[i];
+        if (strncmp(arg, "--sizes=", 8) == 0) {
+            settings.sizes = parseList<unsigned long>(arg + 8);
+        } else if (strncmp(arg, "--layers=", 9) == 0) {
+            settings.layers = parseList<int>(arg + 9);
+        } else if (strncmp(arg, "--stages=", 9) == 0) {
+            settings.stages = arg + 9;
+        } else if (strncmp(arg, "--min-time=", 11) == 0) {
+            settings.minTime = atof(arg + 11);
+        } else if (strncmp(arg, "--max-memory=", 13) == 0) {
+            settings.maxMemory = (size_t)atol(arg + 13) * 1024 * 1024;
+        } else {
+            fprintf(stderr, "Unknown argument %s\n", arg);
+            return 1;
+        }
+    }
+
+    printf("{\n  \"libpng\": \"%s\",\n  \"composite\": \"%s\",\n  \"results\": [",
+           PNG_LIBPNG_VER_STRING, compositeImplementation());
+    for (size_t i = 0; i < settings.sizes.size(); i++) {
+        unsigned long size = settings.sizes[i];
+        if (settings.stages.find("decode") != std::string::npos) benchDecode(settings, size);
+        if (settings.stages.find("composite") != std::string::npos) benchComposite(settings, size, false);
+        if (settings.stages.find("overlay") != std::string::npos) benchComposite(settings, size, true);
+        if (settings.stages.find("encode") != std::string::npos) benchEncode(settings, size);
+        if (settings.stages.find("blend") != std::string::npos) benchBlend(settings, size);
+    }
+    printf("\n  ]\n}\n");
+    return 0;
+}
@@ -0,0 +1,223 @@
+// Load benchmark: keeps a fixed number of requests in flight per scenario and
+// concurrency level and records latency percentiles, event loop lag, RSS and
+// the time jobs wait for a worker thread.
+//
+//   node bench3.js [--concurrency=1,10,50] [--requests=500]
+//                  [--scenarios=blend,blend-nocache,chain,canvas]
+//                  [--out=bench3.json]
+//
+// The canvas scenario is the node-canvas baseline from bench0.js and is
+// skipped when canvas isn't installed. Results are written as JSON.
+
+var fs = require('fs');
+var img = require('./');
+
+var settings = {
+    concurrency: [ 1, 10, 50 ],
+    requests: 500,
+    scenarios: [ 'blend', 'blend-nocache', 'chain', 'canvas' ],
+    out: 'bench3.json'
+};
+
+process.argv.slice(2).forEach(function(arg) {
+    var match = arg.match(/^--([a-z]+)=(.*)$/);
+    if (!match || !(match[1] in settings)) {
+        console.warn('Unknown argument %s', arg);
+        process.exit(1);
+    }
+    var value = match[2];
+    if (match[1] === 'concurrency' || match[1] === 'scenarios') {
+        value = value.split(',');
+        if (match[1] === 'concurrency') value = value.map(Number);
+    } else if (match[1] === 'requests') {
+        value = Number(value);
+    }
+    settings[match[1]] = value;
+});
+
+var images = [
+    fs.readFileSync('test/fixture/1.png'),
+    fs.readFileSync('test/fixture/2.png'),
+    fs.readFileSync('test/fixture/3.png'),
+    fs.readFileSync('test/fixture/4.png'),
+    fs.readFileSync('test/fixture/5.png')
+];
+
+// Milliseconds, with sub-millisecond resolution where available.
+function now() {
+    if (process.hrtime) {
+        var time = process.hrtime();
+        return time[0] * 1e3 + time[1] / 1e6;
+    }
+    return Date.now();
+}
+
+var Canvas;
+try { Canvas = require('canvas'); } catch (err) {}
+
+var scenarios = {
+    'blend': function(done) {
+        img.blend(images, done);
+    },
+    'blend-nocache': function(done) {
+        img.blend(images, { cache: false }, done);
+    },
+    'chain': function(done) {
+        img.fromBuffer(images[0])
+            .overlay(images[1])
+            .overlay(images[2])
+            .overlay(images[3])
+            .overlay(images[4])
+            .asPNG({}, done);
+    },
+    'canvas': Canvas && function(done) {
+        var loaded = [];
+        var remaining = images.length;
+        images.forEach(function(tile, j) {
+            var image = new Canvas.Image();
+            image.onload = function() {
+                loaded[j] = image;
+                if (--remaining) return;
+
+                var canvas = new Canvas(256, 256);
+                var ctx = canvas.getContext('2d');
+                loaded.forEach(function(image) {
+                    ctx.drawImage(image, 0, 0);
+                });
+                canvas.toBuffer(done);
+            };
+            image.src = tile;
+        });
+    }
+};
+
+function percentile(sorted, p) {
+    if (!sorted.length) return 0;
+    var index = Math.min(sorted.length - 1, Math.ceil(sorted.length * p / 100) - 1);
+    return sorted[Math.max(0, index)];
+}
+
+function summarize(values) {
+    var sorted = values.slice().sort(function(a, b) { return a - b; });
+    var sum = 0;
+    sorted.forEach(function(value) { sum += value; });
+    return {
+        mean: sorted.length ? sum / sorted.length : 0,
+        p50: percentile(sorted, 50),
+        p90: percentile(sorted, 90),
+        p99: percentile(sorted, 99),
+        p999: percentile(sorted, 99.9),
+        max: sorted.length ? sorted[sorted.length - 1] : 0
+    };
+}
+
+// Counts per power of two bucket: the key is the upper bound in milliseconds.
+function histogram(values) {
+    var buckets = {};
+    values.forEach(function(value) {
+        var bound = 0.125;
+        while (bound < value) bound *= 2;
+        buckets[bound] = (buckets[bound] || 0) + 1;
+    });
+    return buckets;
+}
+
+function run(name, concurrency, callback) {
+    var fn = scenarios[name];
+    var latencies = [];
+    var lags = [];
+    var rss = 0;
+    var errors = 0;
+    var started = 0;
+    var finished = 0;
+
+    // A timer that fires late measures how long the event loop was blocked.
+    var interval = 10;
+    var expected = now() + interval;
+    var timer = setInterval(function() {
+        var time = now();
+        lags.push(Math.max(0, time - expected));
+        expected = time + interval;
+        rss = Math.max(rss, process.memoryUsage().rss);
+    }, interval);
+
+    var workers = img.workerStats();
+    var start = now();
+
+    function next() {
+        if (started >= settings.requests) return;
+        started++;
+        var begin = now();
+        fn(function(err) {
+            latencies.push(now() - begin);
+            if (err) errors++;
+            if (++finished === settings.requests) return end();
+            next();
+        });
+    }
+
+    function end() {
+        var elapsed = now() - start;
+        clearInterval(timer);
+        rss = Math.max(rss, process.memoryUsage().rss);
+
+        var after = img.workerStats();
+        var jobs = after.completed - workers.completed;
+        var result = {
+            scenario: name,
+            concurrency: concurrency,
+            requests: settings.requests,
+            errors: errors,
+            perSecond: settings.requests / (elapsed / 1000),
+            latency: summarize(latencies),
+            histogram: histogram(latencies),
+            eventLoopLag: summarize(lags),
+            rss: rss,
+            // Average wait for a worker thread per job; only img's own jobs.
+            queueTime: jobs ? (after.queueTime - workers.queueTime) / jobs : 0
+        };
+
+        console.warn('%s x%d: %d/s, p50 %sms, p99 %sms, lag p99 %sms, queue %sms, rss %dMB',
+            name, concurrency, Math.round(result.perSecond),
+            result.latency.p50.toFixed(2), result.latency.p99.toFixed(2),
+            result.eventLoopLag.p99.toFixed(2), result.queueTime.toFixed(2),
+            Math.round(rss / 1024 / 1024));
+        callback(result);
+    }
+
+    for (var i = 0; i < concurrency; i++) next();
+}
+
+var cases = [];
+settings.scenarios.forEach(function(name) {
+    if (!(name in scenarios)) {
+        console.warn('Unknown scenario %s', name);
+        process.exit(1);
+    } else if (!scenarios[name]) {
+        console.warn('Skipping %s, which is not installed', name);
+        return;
+    }
+    settings.concurrency.forEach(function(concurrency) {
+        cases.push([ name, concurrency ]);
+    });
+});
+
+var results = [];
+(function nextCase() {
+    if (!cases.length) {
+        fs.writeFileSync(settings.out, JSON.stringify({
+            node: process.version,
+            libpng: img.libpng,
+            simd: img.simd,
+            threads: img.workerStats().threads,
+            results: results
+        }, null, 2));
+        console.warn('Results written to %s', settings.out);
+        return;
+    }
+    var next = cases.shift();
+    run(next[0], next[1], function(result) {
+        results.push(result);
+        nextCase();
+    });
+})();
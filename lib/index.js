@@ -1,6 +1,7 @@
 var img = module.exports = exports = require('../build/default/img');
 var Buffer = require('buffer').Buffer;
 var fs = require('fs');
+var Stream = require('stream').Stream;
 
 img.fromBuffer = function(buffer, callback) {
     return new img.Image().load(buffer, callback);
@@ -10,6 +11,10 @@ img.Image.prototype.toString = function() {
     return '[Image ' + this.width + 'x' + this.height + ']';
 };
 
+// Images accept encoded data through write() and end(), so streams can be
+// piped into them.
+img.Image.prototype.writable = true;
+
 // Move to C++ land?
 var overlay = img.Image.prototype.overlay;
 img.Image.prototype.overlay = function(image) {
@@ -23,3 +28,98 @@ img.Image.prototype.overlay = function(image) {
 
     return overlay.apply(this, arguments);
 };
+
+// Readable stream of encoded data. `start` is called with the `ondata` and
+// completion callbacks for the native call. Pausing the stream pauses the
+// native side, which buffers the encoder's output up to the `maxBuffered`
+// option and fails the stream beyond that. Chunks that still arrive while
+// the stream is paused are held back until it is resumed.
+function EncodeStream(start) {
+    Stream.call(this);
+    this.readable = true;
+    this.paused = false;
+    this.ended = false;
+    this.pending = [];
+    // Native side, passed along with the chunks.
+    this.source = null;
+
+    var stream = this;
+    try {
+        start(function(chunk, source) {
+            stream.source = source;
+            if (!stream.readable) {
+                source.destroy();
+                return false;
+            }
+            if (stream.paused) stream.pending.push(chunk);
+            else stream.emit('data', chunk);
+            // false pauses the native side until source.resume().
+            return !stream.paused;
+        }, function(err) {
+            if (err) return stream.fail(err);
+            stream.ended = true;
+            if (!stream.paused) stream.finish();
+        });
+    } catch (err) {
+        stream.fail(err);
+    }
+}
+require('util').inherits(EncodeStream, Stream);
+
+EncodeStream.prototype.pause = function() {
+    this.paused = true;
+};
+
+EncodeStream.prototype.resume = function() {
+    this.paused = false;
+    while (!this.paused && this.pending.length) {
+        this.emit('data', this.pending.shift());
+    }
+    if (this.paused) return;
+    if (this.ended) this.finish();
+    else if (this.source) this.source.resume();
+};
+
+// Drops the output of an encoder whose stream nobody reads any more.
+EncodeStream.prototype.destroy = function() {
+    this.readable = false;
+    this.pending = [];
+    if (this.source) this.source.destroy();
+};
+
+// Invalid arguments are reported before the caller had a chance to listen.
+EncodeStream.prototype.fail = function(err) {
+    var stream = this;
+    this.readable = false;
+    process.nextTick(function() { stream.emit('error', err); });
+};
+
+EncodeStream.prototype.finish = function() {
+    if (!this.readable) return;
+    this.readable = false;
+    this.emit('end');
+};
+
+// img.createBlendStream(buffers, [options]) blends like img.blend() and
+// emits the encoded image in chunks as it is compressed.
+img.createBlendStream = function(buffers, options) {
+    return new EncodeStream(function(ondata, callback) {
+        var settings = { ondata: ondata };
+        for (var key in options) {
+            if (key !== 'ondata') settings[key] = options[key];
+        }
+        img.blend(buffers, settings, callback);
+    });
+};
+
+// image.createPNGStream([options]) is image.asPNG() as a readable stream.
+img.Image.prototype.createPNGStream = function(options) {
+    var image = this;
+    return new EncodeStream(function(ondata, callback) {
+        var settings = { ondata: ondata };
+        for (var key in options) {
+            if (key !== 'ondata') settings[key] = options[key];
+        }
+        image.asPNG(settings, callback);
+    });
+};
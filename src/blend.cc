@@ -5,32 +5,113 @@
 
 #include "blend.h"
 #include "reader.h"
+#include "header.h"
+#include "composite.h"
+#include "uniform.h"
+#include "surface.h"
+#include "pool.h"
+#include "workers.h"
+#include "metrics.h"
+#include "decoder.h"
+#include "cache.h"
+#include "encoder.h"
+#include "options.h"
+#include "stream.h"
+#include "slice.h"
 #include "macros.h"
 
 typedef std::pair<char*, size_t> PNGBuffer;
 typedef std::vector<PNGBuffer> PNGBuffers;
 typedef Persistent<Object> PersistentObject;
 typedef std::vector<PersistentObject> PersistentObjects;
+typedef std::vector<ImageReader*> ImageReaders;
 
-struct BlendBaton {
+// Where a layer is placed on the result. Layers without a position have the
+// size of the result; positioned ones can have any size and are clipped.
+struct LayerPosition {
+    bool positioned;
+    int x;
+    int y;
+};
+typedef std::vector<LayerPosition> LayerPositions;
+
+// Blends with at least this many layers that need decoding decode them in
+// parallel.
+static const size_t PARALLEL_DECODE_LAYERS = 3;
+
+// Decoded layers, keyed by the contents of the encoded buffer.
+static LRUCache<Surface> layerCache;
+// Encoded results, keyed by the contents of all layers.
+static LRUCache<EncodedImage> resultCache;
+
+// Collects the results of a blendMany() call.
+struct BlendBatch {
+    Persistent<Function> callback;
+    Persistent<Array> results;
+    Persistent<Value> error;
+    // Jobs that haven't completed yet.
+    uint32_t pending;
+
+    BlendBatch(Handle<Function> cb, uint32_t length) : pending(length) {
+        callback = Persistent<Function>::New(cb);
+        results = Persistent<Array>::New(Array::New(length));
+    }
+    ~BlendBatch() {
+        callback.Dispose();
+        results.Dispose();
+        error.Dispose();
+    }
+};
+
+struct BlendBaton : public EncodeOutput {
     Persistent<Function> callback;
     PersistentObjects references;
     PNGBuffers buffers;
+    // Downscaling factor for JPEG layers, 1 for all others.
+    std::vector<int> scales;
+    LayerPositions positions;
+    // Size of the result, from the layers that aren't positioned.
+    unsigned long width;
+    unsigned long height;
 
     bool error;
+    std::string message;
 
     char* result;
     size_t length;
     size_t max;
 
+    // Hashes of the buffers; only computed when a cache is enabled.
+    std::vector<uint64_t> hashes;
+    // Whether the layer and result caches may be used for this call.
+    bool cache;
+    EncodeOptions options;
+    WorkerPool::Priority priority;
+    // Set when the encoded data is passed on in chunks instead of `result`.
+    ChunkStream* stream;
+    // Tile size when the result is sliced into tiles, or 0. The blended
+    // pixels are kept in `surface` instead of being encoded.
+    unsigned long slice;
+    Surface* surface;
+
+    // Set for the jobs of a blendMany() call, which report to the batch
+    // instead of calling back.
+    BlendBatch* batch;
+    uint32_t index;
+
     BlendBaton(Handle<Function> cb)
-        : error(false), result(NULL), length(0), max(0) {
+        : width(0), height(0), error(false), result(NULL), length(0), max(0),
+          cache(true), priority(WorkerPool::INTERACTIVE),
+          stream(NULL), slice(0), surface(NULL),
+          batch(NULL), index(0) {
         ev_ref(EV_DEFAULT_UC);
         callback = Persistent<Function>::New(cb);
     }
-    void add(Handle<Object> buffer) {
+    void add(Handle<Object> buffer, int scale, const LayerPosition& position) {
         references.push_back(Persistent<Object>::New(buffer));
         buffers.push_back(std::make_pair<char*, size_t>(Buffer::Data(buffer), Buffer::Length(buffer)));
+        scales.push_back(scale);
+        positions.push_back(position);
     }
     ~BlendBaton() {
         ev_unref(EV_DEFAULT_UC);
@@ -42,11 +123,23 @@ struct BlendBaton {
         for (; cur < end; cur++) (*cur).Dispose();
 
         if (result) {
-            free(result);
+            BufferPool::release(result);
+        }
+        delete stream;
+        if (surface) {
+            surface->unref();
         }
 
         callback.Dispose();
     }
+
+    // Appends encoded PNG data to `result`.
+    void write(const char* data, size_t size);
+    // Sets `result` to a copy of `size` bytes at `data`. Results are handed
+    // to JavaScript as is, so they never share memory with the inputs or
+    // the result cache.
+    void copy(const char* data, size_t size);
+    void reserve(size_t size);
 };
 
 Handle<Value> ThrowOrCall(Handle<Function> callback, const char* message) {
@@ -59,212 +152,1035 @@ Handle<Value> ThrowOrCall(Handle<Function> callback, const char* message) {
     }
 }
 
+// Reads the optional options object and callback that follow the first
+// argument. Returns an exception to throw when the callback is invalid.
+Handle<Value> Blend_Arguments(const Arguments& args, Local<Object>& options,
+                              Local<Function>& callback) {
+    int argc = args.Length();
+    if (argc > 1 && args[1]->IsObject() && !args[1]->IsFunction()) {
+        options = args[1]->ToObject();
+    }
+
+    int cb = options.IsEmpty() ? 1 : 2;
+    if (argc > cb && !args[cb]->IsUndefined()) {
+        if (!args[cb]->IsFunction()) {
+            return ThrowException(Exception::TypeError(
+                String::New("Callback must be a function")));
+        }
+        callback = Local<Function>::Cast(args[cb]);
+    }
+    return Handle<Value>();
+}
+
+// Layers are Buffers or { buffer: Buffer, scale: n, x: n, y: n } objects,
+// where a scale of 2, 4 or 8 decodes a JPEG at that fraction of its size,
+// and x and y place a layer of any size at that offset. Returns an error
+// message for anything else.
+const char* Blend_Layer(Handle<Value> value, Local<Object>& buffer, int& scale,
+                        LayerPosition& position) {
+    scale = 1;
+    position.positioned = false;
+    position.x = position.y = 0;
+    if (Buffer::HasInstance(value)) {
+        buffer = value->ToObject();
+        return NULL;
+    }
+
+    if (!value->IsObject()) return "All elements must be Buffers.";
+    Local<Object> layer = value->ToObject();
+    Local<Value> data = layer->Get(String::NewSymbol("buffer"));
+    if (!Buffer::HasInstance(data)) return "All elements must be Buffers.";
+    buffer = data->ToObject();
+
+    Local<Value> factor = layer->Get(String::NewSymbol("scale"));
+    if (!factor->IsUndefined()) {
+        scale = factor->IsInt32() ? factor->Int32Value() : 0;
+        if (scale != 1 && scale != 2 && scale != 4 && scale != 8) {
+            return "scale must be 1, 2, 4 or 8";
+        }
+    }
+
+    Local<Value> x = layer->Get(String::NewSymbol("x"));
+    Local<Value> y = layer->Get(String::NewSymbol("y"));
+    if (!x->IsUndefined() || !y->IsUndefined()) {
+        if ((!x->IsUndefined() && !x->IsInt32()) || (!y->IsUndefined() && !y->IsInt32())) {
+            return "x and y must be integers";
+        }
+        position.positioned = true;
+        position.x = x->Int32Value();
+        position.y = y->Int32Value();
+    }
+    return NULL;
+}
+
+// Checks that `value` is a non-empty array of layers. Returns an error
+// message otherwise.
+const char* Blend_CheckBuffers(Handle<Value> value) {
+    if (!value->IsArray()) {
+        return "First argument must be an array of Buffers.";
+    }
+    Handle<Array> buffers = Handle<Array>::Cast(value);
+
+    uint32_t length = buffers->Length();
+    if (length < 1) {
+        return "First argument must contain at least one Buffer.";
+    }
+
+    for (uint32_t i = 0; i < length; i++) {
+        Local<Object> buffer;
+        int scale;
+        LayerPosition position;
+        const char* message = Blend_Layer(buffers->Get(i), buffer, scale, position);
+        if (message != NULL) return message;
+    }
+    return NULL;
+}
+
+// Reads the headers of all layers, so that unknown formats and mismatched
+// sizes are rejected before anything is decoded, and sets the size of the
+// result. Returns an error message or NULL.
+const char* Blend_CheckHeaders(BlendBaton* baton) {
+    unsigned long& width = baton->width;
+    unsigned long& height = baton->height;
+    for (size_t i = 0; i < baton->buffers.size(); i++) {
+        ImageHeader header;
+        if (!header.read(baton->buffers[i].first, baton->buffers[i].second)) {
+            return "Unknown image format";
+        }
+
+        int scale = baton->scales[i];
+        if (scale != 1 && header.format != ImageHeader::FORMAT_JPEG) {
+            return "Only JPEG layers can be scaled";
+        } else if (!ImageHeader::allowed(header.scaledWidth(scale), header.scaledHeight(scale))) {
+            return "Image is too large";
+        }
+
+        if (baton->positions[i].positioned) {
+            continue;
+        } else if (width == 0) {
+            width = header.scaledWidth(scale);
+            height = header.scaledHeight(scale);
+        } else if (header.scaledWidth(scale) != width || header.scaledHeight(scale) != height) {
+            return "Image dimensions don't match";
+        }
+    }
+
+    if (width == 0) return "At least one layer must not be positioned";
+    return NULL;
+}
+
+void Blend_AddBuffers(BlendBaton* baton, Handle<Value> value) {
+    Handle<Array> buffers = Handle<Array>::Cast(value);
+    uint32_t length = buffers->Length();
+    for (uint32_t i = 0; i < length; i++) {
+        Local<Object> buffer;
+        int scale;
+        LayerPosition position;
+        Blend_Layer(buffers->Get(i), buffer, scale, position);
+        baton->add(buffer, scale, position);
+    }
+}
+
+// Reads the blend options into `baton`. Returns false and sets `error` when
+// an option is invalid.
+bool Blend_Options(Handle<Object> options, BlendBaton* baton, std::string& error) {
+    Local<Value> cache = options->Get(String::NewSymbol("cache"));
+    if (!cache->IsUndefined()) baton->cache = cache->BooleanValue();
+
+    Local<Value> priority = options->Get(String::NewSymbol("priority"));
+    if (!priority->IsUndefined()) {
+        String::AsciiValue name(priority);
+        if (strcmp(*name, "interactive") == 0) {
+            baton->priority = WorkerPool::INTERACTIVE;
+        } else if (strcmp(*name, "background") == 0) {
+            baton->priority = WorkerPool::BACKGROUND;
+        } else {
+            error = "priority must be 'interactive' or 'background'";
+            return false;
+        }
+    }
+
+    return ParseEncodeOptions(options, baton->options, error);
+}
+
 Handle<Value> Blend(const Arguments& args) {
     HandleScope scope;
 
-    OPTIONAL_ARGUMENT_FUNCTION(1, callback);
+    // The options object is optional.
+    Local<Object> options;
+    Local<Function> callback;
+    Handle<Value> exception = Blend_Arguments(args, options, callback);
+    if (!exception.IsEmpty()) return exception;
 
-    if (args.Length() < 1 || !args[0]->IsArray()) {
-        return ThrowOrCall(callback, "First argument must be an array of Buffers.");
+    const char* message = Blend_CheckBuffers(args[0]);
+    if (message != NULL) {
+        return ThrowOrCall(callback, message);
     }
-    Local<Array> buffers = Local<Array>::Cast(args[0]);
 
-    uint32_t length = buffers->Length();
+    BlendBaton* baton = new BlendBaton(callback);
+    Blend_AddBuffers(baton, args[0]);
 
+    if (!options.IsEmpty()) {
+        std::string error;
+        if (!Blend_Options(options, baton, error)) {
+            delete baton;
+            return ThrowOrCall(callback, error.c_str());
+        }
+    }
+
+    if (!options.IsEmpty()) {
+        std::string error;
+        baton->stream = ChunkStream::Create(options, error);
+        if (!error.empty()) {
+            delete baton;
+            return ThrowOrCall(callback, error.c_str());
+        }
+
+        Local<Value> slice = options->Get(String::NewSymbol("slice"));
+        if (!slice->IsUndefined()) {
+            if (!slice->IsInt32() || slice->Int32Value() < 1) {
+                delete baton;
+                return ThrowOrCall(callback, "slice must be a positive integer");
+            } else if (baton->stream != NULL) {
+                delete baton;
+                return ThrowOrCall(callback, "slice can't be combined with ondata");
+            }
+            baton->slice = slice->Int32Value();
+        }
+    }
+
+    message = Blend_CheckHeaders(baton);
+    if (message != NULL) {
+        delete baton;
+        return ThrowOrCall(callback, message);
+    }
+
+    if (!WorkerPool::submit(EIO_Blend, EIO_AfterBlend, baton, baton->priority)) {
+        delete baton;
+        return ThrowOrCall(callback, "Too many queued jobs");
+    }
+    Metrics::begin();
+
+    return scope.Close(Undefined());
+}
+
+// img.blendMany([[buffers...], ...], [options], callback) blends every list
+// of buffers like blend() and calls back once with an array of the results.
+// The lists are validated up front and blended on the thread pool in
+// parallel. On failure, the error of the first failed list is passed along
+// with an `index` property, and the other results are still delivered.
+Handle<Value> BlendMany(const Arguments& args) {
+    HandleScope scope;
+
+    Local<Object> options;
+    Local<Function> callback;
+    Handle<Value> exception = Blend_Arguments(args, options, callback);
+    if (!exception.IsEmpty()) return exception;
+
+    if (args.Length() < 1 || !args[0]->IsArray()) {
+        return ThrowOrCall(callback, "First argument must be an array of arrays of Buffers.");
+    }
+    Local<Array> jobs = Local<Array>::Cast(args[0]);
+    uint32_t length = jobs->Length();
     if (length < 1) {
-        return ThrowOrCall(callback, "First argument must contain at least one Buffer.");
+        return ThrowOrCall(callback, "First argument must contain at least one array of Buffers.");
+    }
+    for (uint32_t i = 0; i < length; i++) {
+        const char* message = Blend_CheckBuffers(jobs->Get(i));
+        if (message != NULL) {
+            return ThrowOrCall(callback, message);
+        }
     }
 
-    BlendBaton* baton = new BlendBaton(callback);
+    // Parse the options once; every job gets a copy.
+    BlendBaton prototype((Handle<Function>()));
+    if (!options.IsEmpty()) {
+        std::string error;
+        if (!Blend_Options(options, &prototype, error)) {
+            return ThrowOrCall(callback, error.c_str());
+        }
+    }
+
+    // The batch is accepted or rejected as a whole, so the jobs below are
+    // queued regardless of the bound.
+    if (!WorkerPool::accepts(length)) {
+        return ThrowOrCall(callback, "Too many queued jobs");
+    }
+
+    BlendBatch* batch = new BlendBatch(callback, length);
     for (uint32_t i = 0; i < length; i++) {
-        if (!Buffer::HasInstance(buffers->Get(i))) {
-            delete baton;
-            return ThrowOrCall(callback, "All elements must be Buffers.");
-        } else {
-            baton->add(buffers->Get(i)->ToObject());
+        BlendBaton* baton = new BlendBaton(Handle<Function>());
+        baton->cache = prototype.cache;
+        baton->options = prototype.options;
+        baton->priority = prototype.priority;
+        baton->batch = batch;
+        baton->index = i;
+        Blend_AddBuffers(baton, jobs->Get(i));
+
+        // Invalid lists are reported along with the other results, without
+        // decoding anything.
+        const char* message = Blend_CheckHeaders(baton);
+        if (message != NULL) {
+            baton->error = true;
+            baton->message = message;
+        }
+        WorkerPool::submit(EIO_Blend, EIO_AfterBlend, baton, baton->priority, false);
+        Metrics::begin();
+    }
+
+    return scope.Close(Undefined());
+}
+
+Handle<Value> RegisterUniform(const Arguments& args) {
+    HandleScope scope;
+
+    if (args.Length() < 1 || !Buffer::HasInstance(args[0])) {
+        return ThrowException(Exception::TypeError(
+            String::New("Buffer required as first argument")));
+    }
+
+    Local<Object> buffer = args[0]->ToObject();
+    bool uniform = UniformRegistry::add(Buffer::Data(buffer), Buffer::Length(buffer));
+    return scope.Close(Boolean::New(uniform));
+}
+
+// img.info(buffer) returns the format, size and color type of a PNG or JPEG
+// image, read from its header without decoding anything.
+Handle<Value> Info(const Arguments& args) {
+    HandleScope scope;
+
+    if (args.Length() < 1 || !Buffer::HasInstance(args[0])) {
+        return ThrowException(Exception::TypeError(
+            String::New("Buffer required as first argument")));
+    }
+
+    Local<Object> buffer = args[0]->ToObject();
+    ImageHeader header;
+    if (!header.read(Buffer::Data(buffer), Buffer::Length(buffer))) {
+        return ThrowException(Exception::TypeError(
+            String::New("Unknown image format")));
+    }
+
+    const char* color = "rgb";
+    if (header.format == ImageHeader::FORMAT_PNG) {
+        switch (header.color) {
+            case PNG_COLOR_TYPE_GRAY: color = "gray"; break;
+            case PNG_COLOR_TYPE_GRAY_ALPHA: color = "grayalpha"; break;
+            case PNG_COLOR_TYPE_PALETTE: color = "palette"; break;
+            case PNG_COLOR_TYPE_RGB_ALPHA: color = "rgba"; break;
         }
+    } else if (header.color == 1) {
+        color = "gray";
+    } else if (header.color == 4) {
+        color = "cmyk";
     }
 
-    eio_custom(EIO_Blend, EIO_PRI_DEFAULT, EIO_AfterBlend, baton);
+    Local<Object> result = Object::New();
+    result->Set(String::NewSymbol("format"),
+                String::New(header.format == ImageHeader::FORMAT_PNG ? "png" : "jpeg"));
+    result->Set(String::NewSymbol("width"), Number::New(header.width));
+    result->Set(String::NewSymbol("height"), Number::New(header.height));
+    result->Set(String::NewSymbol("depth"), Integer::New(header.depth));
+    result->Set(String::NewSymbol("color"), String::New(color));
+    result->Set(String::NewSymbol("alpha"), Boolean::New(header.alpha));
+    result->Set(String::NewSymbol("interlaced"), Boolean::New(header.interlaced));
+    if (header.colors > 0) {
+        result->Set(String::NewSymbol("colors"), Integer::New(header.colors));
+    }
+    return scope.Close(result);
+}
 
+template <class T>
+Handle<Value> SetCacheSize(const Arguments& args, LRUCache<T>& cache) {
+    HandleScope scope;
+
+    if (args.Length() < 1 || !args[0]->IsNumber() || args[0]->NumberValue() < 0) {
+        return ThrowException(Exception::TypeError(
+            String::New("Cache size in bytes required as first argument")));
+    }
+
+    cache.setCapacity((size_t)args[0]->NumberValue());
     return scope.Close(Undefined());
 }
 
-void Blend_writePNG(png_structp png_ptr, png_bytep data, png_size_t length) {
-    BlendBaton* baton = (BlendBaton*)png_get_io_ptr(png_ptr);
+template <class T>
+Handle<Value> CacheStats(LRUCache<T>& cache) {
+    HandleScope scope;
+
+    typename LRUCache<T>::Stats stats = cache.stats();
+    Local<Object> result = Object::New();
+    result->Set(String::NewSymbol("hits"), Number::New(stats.hits));
+    result->Set(String::NewSymbol("misses"), Number::New(stats.misses));
+    result->Set(String::NewSymbol("evictions"), Number::New(stats.evictions));
+    result->Set(String::NewSymbol("entries"), Number::New(stats.entries));
+    result->Set(String::NewSymbol("bytes"), Number::New(stats.bytes));
+    result->Set(String::NewSymbol("size"), Number::New(stats.capacity));
+    return scope.Close(result);
+}
+
+Handle<Value> SetLayerCacheSize(const Arguments& args) {
+    return SetCacheSize(args, layerCache);
+}
+
+Handle<Value> LayerCacheStats(const Arguments& args) {
+    return CacheStats(layerCache);
+}
+
+Handle<Value> SetResultCacheSize(const Arguments& args) {
+    return SetCacheSize(args, resultCache);
+}
+
+Handle<Value> ResultCacheStats(const Arguments& args) {
+    return CacheStats(resultCache);
+}
 
-    if (baton->result == NULL || baton->max < baton->length + length) {
-        int increase = baton->length ? 4 * length : 32768;
-        baton->result = (char*)realloc(baton->result, baton->max + increase);
-        baton->max += increase;
+// img.configureWorkers({ threads: n, maxQueue: n }) sizes the worker pool.
+// The thread count can only be changed before the first job; a maxQueue of
+// 0 means unbounded.
+Handle<Value> ConfigureWorkers(const Arguments& args) {
+    HandleScope scope;
+
+    if (args.Length() < 1 || !args[0]->IsObject()) {
+        return ThrowException(Exception::TypeError(
+            String::New("Options object required as first argument")));
+    }
+    Local<Object> options = args[0]->ToObject();
+
+    WorkerPool::Stats current = WorkerPool::stats();
+    int threads = 0;
+    size_t maxQueue = current.maxQueue;
+
+    Local<Value> value = options->Get(String::NewSymbol("threads"));
+    if (!value->IsUndefined()) {
+        if (!value->IsInt32() || value->Int32Value() < 1) {
+            return ThrowException(Exception::TypeError(
+                String::New("threads must be a positive integer")));
+        }
+        threads = value->Int32Value();
+    }
+
+    value = options->Get(String::NewSymbol("maxQueue"));
+    if (!value->IsUndefined()) {
+        if (!value->IsNumber() || value->NumberValue() < 0) {
+            return ThrowException(Exception::TypeError(
+                String::New("maxQueue must be a non-negative number")));
+        }
+        maxQueue = (size_t)value->NumberValue();
+    }
+
+    if (!WorkerPool::configure(threads, maxQueue)) {
+        return ThrowException(Exception::Error(
+            String::New("Worker threads are already running")));
+    }
+    return scope.Close(Undefined());
+}
+
+Handle<Value> WorkerStats(const Arguments& args) {
+    HandleScope scope;
+
+    WorkerPool::Stats stats = WorkerPool::stats();
+    Local<Object> result = Object::New();
+    result->Set(String::NewSymbol("threads"), Number::New(stats.threads));
+    result->Set(String::NewSymbol("maxQueue"), Number::New(stats.maxQueue));
+    result->Set(String::NewSymbol("queued"), Number::New(stats.queued));
+    result->Set(String::NewSymbol("running"), Number::New(stats.running));
+    result->Set(String::NewSymbol("completed"), Number::New(stats.completed));
+    result->Set(String::NewSymbol("rejected"), Number::New(stats.rejected));
+    result->Set(String::NewSymbol("stolen"), Number::New(stats.stolen));
+    // Milliseconds.
+    result->Set(String::NewSymbol("queueTime"), Number::New(stats.waited / 1000.0));
+    return scope.Close(result);
+}
+
+// img.setMaxPixels(n) sets the largest image, in pixels, that is decoded or
+// created. Larger images fail before any memory is allocated for them.
+Handle<Value> SetMaxPixels(const Arguments& args) {
+    HandleScope scope;
+
+    if (args.Length() < 1 || !args[0]->IsNumber() || args[0]->NumberValue() < 1) {
+        return ThrowException(Exception::TypeError(
+            String::New("Pixel count required as first argument")));
     }
 
-    // TODO: implement OOM check
-    assert(baton->result);
+    ImageHeader::maxPixels = (uint64_t)args[0]->NumberValue();
+    return scope.Close(Undefined());
+}
+
+Handle<Value> SetBufferPoolSize(const Arguments& args) {
+    HandleScope scope;
 
-    memcpy(baton->result + baton->length, data, length);
-    baton->length += length;
+    if (args.Length() < 1 || !args[0]->IsNumber() || args[0]->NumberValue() < 0) {
+        return ThrowException(Exception::TypeError(
+            String::New("Pool size in bytes required as first argument")));
+    }
+
+    BufferPool::setCapacity((size_t)args[0]->NumberValue());
+    return scope.Close(Undefined());
 }
 
+Handle<Value> BufferPoolStats(const Arguments& args) {
+    HandleScope scope;
+
+    BufferPool::Stats stats = BufferPool::stats();
+    Local<Object> result = Object::New();
+    result->Set(String::NewSymbol("allocations"), Number::New(stats.allocations));
+    result->Set(String::NewSymbol("reuses"), Number::New(stats.reuses));
+    result->Set(String::NewSymbol("releases"), Number::New(stats.releases));
+    result->Set(String::NewSymbol("discards"), Number::New(stats.discards));
+    result->Set(String::NewSymbol("buffers"), Number::New(stats.buffers));
+    result->Set(String::NewSymbol("bytes"), Number::New(stats.bytes));
+    result->Set(String::NewSymbol("size"), Number::New(stats.capacity));
+    return scope.Close(result);
+}
 
-void Blend_Encode(unsigned const char* source, BlendBaton* baton,
-        unsigned long width, unsigned long height, bool alpha) {
-    png_structp png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
-    png_infop info_ptr = png_create_info_struct(png_ptr);
+// img.stats({ reset: true }) returns where blends and image operations
+// spent their time, in milliseconds per stage, along with bytes and pixels
+// processed and operation counts. With `reset`, counting starts over after
+// reading.
+Handle<Value> ModuleStats(const Arguments& args) {
+    HandleScope scope;
 
-    png_set_compression_level(png_ptr, Z_BEST_SPEED);
-    png_set_compression_buffer_size(png_ptr, 32768);
+    bool reset = false;
+    if (args.Length() > 0 && args[0]->IsObject()) {
+        reset = args[0]->ToObject()->Get(String::NewSymbol("reset"))->BooleanValue();
+    }
 
-    png_set_IHDR(png_ptr, info_ptr, width, height, 8,
-                 alpha ? PNG_COLOR_TYPE_RGB_ALPHA : PNG_COLOR_TYPE_RGB,
-                 PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT,
-                 PNG_FILTER_TYPE_DEFAULT);
+    Metrics::Totals totals = Metrics::totals();
+    if (reset) Metrics::reset();
 
-    png_set_write_fn(png_ptr, (png_voidp)baton, Blend_writePNG, NULL);
-    png_write_info(png_ptr, info_ptr);
+    static const char* const stages[] = { "queue", "decode", "composite", "resample", "encode" };
+    static const char* const counters[] = {
+        "bytesIn", "bytesOut", "pixels", "blends", "loads", "overlays", "encodes"
+    };
 
-    if (!alpha) {
-        png_set_filler(png_ptr, 0, PNG_FILLER_AFTER);
+    Local<Object> result = Object::New();
+    for (int i = 0; i < Metrics::STAGES; i++) {
+        Local<Object> stage = Object::New();
+        stage->Set(String::NewSymbol("count"), Number::New(totals.calls[i]));
+        stage->Set(String::NewSymbol("time"), Number::New(totals.time[i] / 1e6));
+        result->Set(String::NewSymbol(stages[i]), stage);
+    }
+    for (int i = 0; i < Metrics::COUNTERS; i++) {
+        result->Set(String::NewSymbol(counters[i]), Number::New(totals.counters[i]));
     }
+    result->Set(String::NewSymbol("inFlight"), Number::New(totals.inFlight));
+    return scope.Close(result);
+}
+
+void BlendBaton::reserve(size_t size) {
+    if (stream != NULL) return;
+    char* grown = (char*)BufferPool::grow(result, length, size);
+    if (grown == NULL) return;
+    result = grown;
+    max = BufferPool::capacity(result);
+}
 
-    png_bytep row_pointers[height];
-    for (unsigned i = 0; i < height; i++) {
-        row_pointers[i] = (unsigned char*)(source + (4 * width * i));
+void BlendBaton::write(const char* data, size_t size) {
+    if (stream != NULL) {
+        stream->write(data, size);
+        return;
+    }
+    if (failed) return;
+    if (max < length + size) {
+        reserve(length + size > 2 * max ? length + size : 2 * max);
+        if (max < length + size) reserve(length + size);
+        if (max < length + size) {
+            failed = true;
+            return;
+        }
     }
 
-    // Write image data
-    png_write_image(png_ptr, row_pointers);
+    memcpy(result + length, data, size);
+    length += size;
+}
+
+void BlendBaton::copy(const char* data, size_t size) {
+    result = (char*)BufferPool::allocate(size);
+    if (result == NULL) {
+        error = true;
+        message = "Out of memory";
+        return;
+    }
+    memcpy(result, data, size);
+    length = size;
+    max = size;
+}
 
-    png_write_end(png_ptr, NULL);
-    png_destroy_write_struct(&png_ptr, &info_ptr);
+// Clips positioned layer `layer` against row `y` of a result `width` pixels
+// wide. Returns false when the layer doesn't cover the row; otherwise sets
+// the layer row and the columns of the result it covers.
+static inline bool Blend_Clip(const ImageReader* layer, const LayerPosition& position,
+        unsigned long y, unsigned long width, unsigned long& row,
+        unsigned long& left, unsigned long& right) {
+    long top = (long)y - position.y;
+    if (top < 0 || top >= (long)layer->height) return false;
+    long begin = position.x > 0 ? position.x : 0;
+    long end = (long)position.x + (long)layer->width;
+    if (end > (long)width) end = width;
+    if (end <= begin) return false;
+    row = top;
+    left = begin;
+    right = end;
+    return true;
 }
 
-inline void blendTopDown(unsigned int* images[], int size, unsigned long width, unsigned long height) {
-    size_t length = width * height;
-    for (long px = length - 1; px >= 0; px--) {
-        // Starting pixel
-        unsigned int abgr = images[0][px];
+// Decodes all layers in lockstep, one row at a time, composites each row and
+// hands it straight to the PNG writer. `layers` is ordered from the top down.
+// Rows are composited with premultiplied alpha and converted back just before
+// encoding. Paletted or automatic output and large images, which are compressed on
+// several threads, need all pixels before writing, so the rows are collected
+// in a full surface instead.
+void Blend_Encode(ImageReaders& layers, const LayerPositions& positions, BlendBaton* baton,
+        StageClock& clock, unsigned long width, unsigned long height, bool alpha) {
+    bool full = baton->slice > 0 || encodeNeedsImage(width, height, alpha, baton->options);
+    RowEncoder* encoder = NULL;
+    if (!full) {
+        encoder = new RowEncoder(width, height, alpha, baton->options, baton);
+        clock.lap(Metrics::ENCODE);
+    }
+
+    // Lower layers are only decoded as far as they are visible: once a row
+    // is opaque, the remaining layers skip it, and layers that are covered
+    // for the rest of the image are never advanced again.
+    size_t size = layers.size();
+    std::vector<bool> started(size, false);
+
+    // Positioned layers can be wider than the result.
+    unsigned long stride = width;
+    bool positioned = false;
+    for (size_t i = 0; i < size; i++) {
+        if (layers[i]->width > stride) stride = layers[i]->width;
+        positioned = positioned || positions[i].positioned;
+    }
+
+    // Deep stacks are decoded on several threads at once instead, so that
+    // the layers don't wait for one another. Each layer runs at most a
+    // window of rows ahead of the last row composited from it, so covered
+    // layers only decode a few rows they don't need. Only for layers of the
+    // result's size.
+    ParallelDecoder* decoder = NULL;
+    size_t decodable = 0;
+    for (size_t i = 0; i < size; i++) {
+        if (!layers[i]->uniform) decodable++;
+    }
+    int threads = WorkerPool::stats().threads;
+    if (decodable >= PARALLEL_DECODE_LAYERS && threads > 1 && !positioned) {
+        decoder = new ParallelDecoder(layers, width, height);
+        int helpers = decodable - 1 < (size_t)threads - 1 ? decodable - 1 : threads - 1;
+        decoder->start(helpers, baton->priority);
+    }
+
+    // One row per layer, and one that accumulates the composited result
+    // unless the result goes to a full surface.
+    unsigned int* rows = (unsigned int*)BufferPool::allocate((size + 1) * stride * 4);
+    Surface* surface = NULL;
+    if (full) {
+        surface = new Surface(width, height, alpha);
+    }
 
-        // Skip if topmost pixel is opaque.
-        if (abgr >= 0xFF000000) continue;
+    // Set when a layer turns out to be corrupt or memory runs out.
+    const char* failure = NULL;
+    if (rows == NULL || (surface != NULL && surface->pixels == NULL)) {
+        failure = "Out of memory";
+    }
 
-        for (int i = 1; i < size; i++) {
-            if (images[i][px] <= 0x00FFFFFF) {
-                // Lower pixel is fully transparent.
+    clock.lap(Metrics::DECODE);
+    for (unsigned long y = 0; y < height && failure == NULL; y++) {
+        unsigned int* result = full ? surface->pixels + y * width : rows + size * stride;
+        for (size_t i = 0; i < size && (i == 0 || !compositeOpaque(result, width)); i++) {
+            // Columns of the result the layer covers in this row.
+            unsigned long left = 0;
+            unsigned long right = width;
+            unsigned long row = y;
+            if (positions[i].positioned &&
+                !Blend_Clip(layers[i], positions[i], y, width, row, left, right)) {
+                if (i == 0) memset(result, 0, width * 4);
                 continue;
-            } else if (abgr <= 0x00FFFFFF) {
-                // Upper pixel is fully transparent.
-                abgr = images[i][px];
+            }
+
+            const unsigned int* pixels;
+            if (decoder != NULL) {
+                pixels = decoder->row(i, y);
+            } else {
+                if (!started[i]) {
+                    layers[i]->begin(true);
+                    started[i] = true;
+                }
+                layers[i]->skipTo(row);
+                // The top layer goes straight to the result when it covers it.
+                unsigned int* dst = i == 0 && !positions[i].positioned ? result : rows + i * stride;
+                layers[i]->readRow((unsigned char*)dst);
+                pixels = dst;
+            }
+            if (positions[i].positioned) pixels += (long)left - positions[i].x;
+            clock.lap(Metrics::DECODE);
+            if (layers[i]->error != NULL) {
+                failure = layers[i]->error;
+                break;
+            }
+
+            // Rows are premultiplied from here on; rows of the parallel
+            // decoder are shared, so they are converted into the layer's row.
+            if (i == 0) {
+                if (pixels != result && (left > 0 || right < width)) {
+                    memset(result, 0, width * 4);
+                }
+                premultiply(result + left, pixels, right - left);
             } else {
-                // Both pixels have transparency.
-                unsigned int rgba0 = images[i][px];
-                unsigned int rgba1 = abgr;
-
-                // From http://trac.mapnik.org/browser/trunk/include/mapnik/graphics.hpp#L337
-                unsigned a1 = (rgba1 >> 24) & 0xff;
-                unsigned r1 = rgba1 & 0xff;
-                unsigned g1 = (rgba1 >> 8 ) & 0xff;
-                unsigned b1 = (rgba1 >> 16) & 0xff;
-
-                unsigned a0 = (rgba0 >> 24) & 0xff;
-                unsigned r0 = (rgba0 & 0xff) * a0;
-                unsigned g0 = ((rgba0 >> 8 ) & 0xff) * a0;
-                unsigned b0 = ((rgba0 >> 16) & 0xff) * a0;
-
-                a0 = ((a1 + a0) << 8) - a0*a1;
-
-                r0 = ((((r1 << 8) - r0) * a1 + (r0 << 8)) / a0);
-                g0 = ((((g1 << 8) - g0) * a1 + (g0 << 8)) / a0);
-                b0 = ((((b1 << 8) - b0) * a1 + (b0 << 8)) / a0);
-                a0 = a0 >> 8;
-                abgr = (a0 << 24)| (b0 << 16) | (g0 << 8) | (r0);
+                unsigned int* converted = decoder != NULL ? rows + i * stride : (unsigned int*)pixels;
+                premultiply(converted, pixels, right - left);
+                compositePremultiplied(result + left, result + left, converted, right - left);
             }
-            if (abgr >= 0xFF000000) break;
+            clock.lap(Metrics::COMPOSITE);
         }
+        unpremultiply(result, result, width);
+        clock.lap(Metrics::COMPOSITE);
+        if (!full) {
+            encoder->write(result);
+            clock.lap(Metrics::ENCODE);
+        }
+    }
+
+    BufferPool::release(rows);
+    if (decoder != NULL) decoder->finish();
+    clock.lap(Metrics::DECODE);
+
+    if (failure != NULL) {
+        if (surface != NULL) surface->unref();
+        delete encoder;
+    } else if (baton->slice > 0) {
+        // Encoded tile by tile once the job is done.
+        baton->surface = surface;
+        return;
+    } else if (full) {
+        failure = encodeImage((unsigned char*)surface->pixels, width, height, width * 4,
+                              alpha, baton->options, baton);
+        surface->unref();
+    } else {
+        encoder->finish();
+        failure = encoder->error();
+        delete encoder;
+    }
+    clock.lap(Metrics::ENCODE);
 
-        // Merge pixel back.
-        images[0][px] = abgr;
+    if (failure != NULL) {
+        baton->error = true;
+        baton->message = failure;
     }
 }
 
-int EIO_Blend(eio_req *req) {
-    BlendBaton* baton = static_cast<BlendBaton*>(req->data);
+// Hashes all buffers once; the hashes key both the layer and result caches.
+// Scaled layers decode differently, so the scale seeds their hash.
+void Blend_Hash(BlendBaton* baton) {
+    if (!baton->hashes.empty()) return;
+    for (size_t i = 0; i < baton->buffers.size(); i++) {
+        uint64_t seed = baton->scales[i] > 1 ? baton->scales[i] : 0;
+        baton->hashes.push_back(hash64(baton->buffers[i].first, baton->buffers[i].second, seed));
+    }
+}
 
-    int total = baton->buffers.size();
-    int size = 0;
-    unsigned int* images[total];
-    memset(images, NULL, total);
+// The result cache compares the whole source on hits rather than trusting
+// its hash: the length, hash, scale and position of every layer and the
+// encoder options, followed by the bytes of every layer. Only the fixed size
+// prefix is hashed into the key.
+LRUCache<EncodedImage>::Key Blend_ResultKey(BlendBaton* baton, std::string& source) {
+    Blend_Hash(baton);
+    std::vector<uint64_t> parts;
+    size_t total = 0;
+    for (size_t i = 0; i < baton->buffers.size(); i++) {
+        const LayerPosition& position = baton->positions[i];
+        parts.push_back(baton->buffers[i].second);
+        parts.push_back(baton->hashes[i]);
+        parts.push_back((uint64_t)baton->scales[i] << 1 | position.positioned);
+        parts.push_back(((uint64_t)(uint32_t)position.x << 32) | (uint32_t)position.y);
+        total += baton->buffers[i].second;
+    }
+    const EncodeOptions& options = baton->options;
+    int fields[] = { options.color, options.colors, options.level, options.filter,
+                     options.strategy, options.type, options.quality };
+    parts.insert(parts.end(), fields, fields + sizeof(fields) / sizeof(fields[0]));
 
-    unsigned long width = 0;
-    unsigned long height = 0;
-    bool alpha = true;
+    size_t prefix = parts.size() * 8;
+    source.reserve(prefix + total);
+    source.assign((const char*)&parts[0], prefix);
+    for (size_t i = 0; i < baton->buffers.size(); i++) {
+        source.append(baton->buffers[i].first, baton->buffers[i].second);
+    }
+    return LRUCache<EncodedImage>::keyFor(source.data(), prefix);
+}
 
-    // Iterate from the last to first image.
+void Blend_Render(BlendBaton* baton) {
+    // Reading headers and filling the layer cache count as decoding.
+    StageClock clock;
+    ImageReaders layers;
+    LayerPositions positions;
+    size_t top = 0;
+    unsigned long width = baton->width;
+    unsigned long height = baton->height;
+
+    // Read the headers from the last to first image, stopping at the first
+    // opaque layer that covers the result since nothing below it is visible.
     PNGBuffers::reverse_iterator image = baton->buffers.rbegin();
     PNGBuffers::reverse_iterator end = baton->buffers.rend();
     for (; image < end; image++) {
-        ImageReader* layer = ImageReader::create((*image).first, (*image).second);
-
-        if (size == 0) {
-            width = layer->width;
-            height = layer->height;
-            if (!layer->alpha) {
-                baton->result = (*image).first;
-                baton->length = (*image).second;
-                delete layer;
-                break;
+        ImageReader* layer = NULL;
+        size_t index = baton->buffers.rend() - image - 1;
+        int scale = baton->scales[index];
+        const LayerPosition& position = baton->positions[index];
+
+        bool cached = baton->cache && layerCache.enabled();
+        LRUCache<Surface>::Key key;
+        uint64_t seed = scale > 1 ? scale : 0;
+        if (cached) {
+            Blend_Hash(baton);
+            key = LRUCache<Surface>::Key((*image).second, baton->hashes[index]);
+            Surface* surface = layerCache.get(key, (*image).first, (*image).second, seed);
+            if (surface != NULL) {
+                layer = new SurfaceImageReader(surface);
+                surface->unref();
+                cached = false;
             }
-        } else if (layer->width != width || layer->height != height) {
+        }
+        if (layer == NULL) {
+            layer = ImageReader::create((*image).first, (*image).second, scale);
+        }
+
+        if (layer == NULL) {
+            baton->error = true;
+            baton->message = "Unknown image format";
+            break;
+        } else if (layer->error != NULL) {
+            baton->error = true;
+            baton->message = layer->error;
+            delete layer;
+            break;
+        } else if (!position.positioned && (layer->width != width || layer->height != height)) {
             baton->error = true;
+            baton->message = "Image dimensions don't match";
             delete layer;
             break;
         }
 
-        images[size] = (unsigned int*)malloc(width * height * 4);
-        layer->decode((unsigned char*)images[size], true);
-        size++;
+        // Positioned layers that are entirely off the result don't show up.
+        bool outside = position.positioned &&
+            (position.x >= (long)width || position.y >= (long)height ||
+             position.x + (long)layer->width <= 0 || position.y + (long)layer->height <= 0);
+        if ((layer->uniform && layer->uniformColor == 0) || outside) {
+            // Fully transparent layers don't contribute anything.
+            delete layer;
+            continue;
+        }
 
-        if (!layer->alpha) {
-            // Skip decoding more layers.
-            alpha = false;
+        if (cached && !layer->uniform) {
+            // Decode the whole layer once so that later calls can reuse it.
+            Surface* surface = new Surface(layer->width, layer->height, layer->alpha);
+            if (surface->pixels != NULL) {
+                layer->decode((unsigned char*)surface->pixels, true);
+            }
+            if (surface->pixels == NULL || layer->error != NULL) {
+                baton->error = true;
+                baton->message = surface->pixels == NULL ? "Out of memory" : layer->error;
+                surface->unref();
+                delete layer;
+                break;
+            }
+            layerCache.put(key, surface, (*image).first, (*image).second, seed);
             delete layer;
-            break;
+            layer = new SurfaceImageReader(surface);
+            surface->unref();
+        }
+
+        if (layers.empty()) top = index;
+        layers.push_back(layer);
+        positions.push_back(position);
+        if (!layer->alpha && !position.positioned) break;
+    }
+
+    clock.lap(Metrics::DECODE);
+
+    if (!baton->error) {
+        Metrics::count(Metrics::PIXELS, (uint64_t)width * height);
+
+        // The shortcuts only apply to layers that cover the whole result.
+        bool uniform = true;
+        bool positioned = false;
+        for (size_t i = 0; i < layers.size(); i++) {
+            uniform = uniform && layers[i]->uniform;
+            positioned = positioned || positions[i].positioned;
+        }
+        // Uncovered parts of the result are transparent.
+        bool alpha = !layers.empty() && (layers.back()->alpha || positions.back().positioned);
+
+        // The shortcuts below don't re-encode, so they only apply when no
+        // encoding options were requested (or nothing is visible at all).
+        bool reencode = (!baton->options.defaults() || baton->slice > 0 || positioned) &&
+                        !layers.empty();
+        if (baton->slice > 0 && layers.empty()) {
+            // Nothing is visible; the tiles are all transparent.
+            baton->surface = new Surface(width, height, true);
+            if (baton->surface->pixels == NULL) {
+                baton->error = true;
+                baton->message = "Out of memory";
+            } else {
+                memset(baton->surface->pixels, 0, baton->surface->size());
+            }
+        } else if (reencode) {
+            Blend_Encode(layers, positions, baton, clock, width, height, alpha);
+        } else if (layers.size() == 1 && !layers[0]->alpha && baton->scales[top] == 1 &&
+                   baton->options.type == TYPE_PNG &&
+                   !ImageReader::isJPEG(baton->buffers[top].first, baton->buffers[top].second)) {
+            // The topmost visible image is an opaque PNG; return it unchanged.
+            baton->copy(baton->buffers[top].first, baton->buffers[top].second);
+        } else if (uniform) {
+            // Every layer is a single color, so the result is one as well.
+            unsigned int color = 0;
+            for (size_t i = layers.size(); i-- > 0;) {
+                color = compositePremultipliedPixel(premultiplyPixel(layers[i]->uniformColor), color);
+            }
+            color = unpremultiplyPixel(color);
+
+            std::string png;
+            UniformRegistry::encode(width, height, color, png);
+            baton->copy(png.data(), png.size());
+            clock.lap(Metrics::ENCODE);
+        } else {
+            Blend_Encode(layers, positions, baton, clock, width, height, alpha);
         }
+    }
 
-        delete layer;
+    for (size_t i = 0; i < layers.size(); i++) {
+        delete layers[i];
     }
+    clock.record();
+}
 
-    if (!baton->error && size) {
-        blendTopDown(images, size, width, height);
-        Blend_Encode((unsigned char*)images[0], baton, width, height, alpha);
+int EIO_Blend(eio_req *req) {
+    BlendBaton* baton = static_cast<BlendBaton*>(req->data);
+    if (baton->error) return 0;
+
+    Metrics::count(Metrics::BLENDS);
+    for (size_t i = 0; i < baton->buffers.size(); i++) {
+        Metrics::count(Metrics::BYTES_IN, baton->buffers[i].second);
     }
 
-    for (int i = 0; i < total; i++) {
-        if (images[i] != NULL) {
-            free(images[i]);
-            images[i] = NULL;
+    bool cached = baton->cache && resultCache.enabled() && baton->slice == 0;
+    LRUCache<EncodedImage>::Key key;
+    std::string source;
+    if (cached) {
+        key = Blend_ResultKey(baton, source);
+        EncodedImage* encoded = resultCache.get(key, source.data(), source.size());
+        if (encoded != NULL) {
+            baton->copy(encoded->data, encoded->length);
+            encoded->unref();
+            if (!baton->error) Metrics::count(Metrics::BYTES_OUT, baton->length);
+            return 0;
+        }
+    }
+
+    Blend_Render(baton);
+    if (baton->stream != NULL) {
+        baton->stream->flush();
+        if (!baton->error && baton->stream->error() != NULL) {
+            baton->error = true;
+            baton->message = baton->stream->error();
+        }
+    }
+    if (!baton->error) {
+        Metrics::count(Metrics::BYTES_OUT, baton->length +
+            (baton->stream != NULL ? baton->stream->length() : 0));
+    }
+
+    // Streamed results were never collected, so there's nothing to cache.
+    if (cached && !baton->error && baton->result != NULL) {
+        // The cache keeps its own copy; skip caching when there's no memory
+        // for one.
+        char* data = (char*)BufferPool::allocate(baton->length);
+        if (data != NULL) {
+            memcpy(data, baton->result, baton->length);
+            EncodedImage* encoded = new EncodedImage(data, baton->length);
+            resultCache.put(key, encoded, source.data(), source.size());
+            encoded->unref();
         }
     }
 
     return 0;
 }
 
+// Hands the result to JavaScript without copying it.
+Local<Value> Blend_Result(BlendBaton* baton) {
+    Buffer* buffer = Buffer::New(baton->result, baton->length,
+                                 BufferPool::releaseCallback, NULL);
+    baton->result = NULL;
+    return Local<Value>::New(buffer->handle_);
+}
+
+// Stores the result of a blendMany() job and calls back once all jobs of
+// the batch are done.
+void Blend_Collect(BlendBaton* baton) {
+    BlendBatch* batch = baton->batch;
+
+    if (!baton->error) {
+        batch->results->Set(baton->index, Blend_Result(baton));
+    } else if (batch->error.IsEmpty()) {
+        Local<Value> error = Exception::TypeError(String::New(baton->message.c_str()));
+        error->ToObject()->Set(String::NewSymbol("index"), Integer::New(baton->index));
+        batch->error = Persistent<Value>::New(error);
+    }
+
+    if (--batch->pending == 0) {
+        if (!batch->callback.IsEmpty()) {
+            Local<Value> argv[] = {
+                batch->error.IsEmpty() ? Local<Value>::New(Null()) : Local<Value>::New(batch->error),
+                Local<Value>::New(batch->results)
+            };
+            TRY_CATCH_CALL(Context::GetCurrent()->Global(), batch->callback, 2, argv);
+        }
+        delete batch;
+    }
+}
+
 int EIO_AfterBlend(eio_req *req) {
     HandleScope scope;
     BlendBaton* baton = static_cast<BlendBaton*>(req->data);
+    Metrics::end();
+
+    if (baton->batch != NULL) {
+        Blend_Collect(baton);
+        delete baton;
+        return 0;
+    }
+
+    if (baton->surface != NULL && !baton->error) {
+        // The tiles call back once they are encoded.
+        TileBatch* tiles = new TileBatch(baton->surface, baton->slice, baton->options,
+                                         baton->callback);
+        tiles->start(baton->priority);
+        delete baton;
+        return 0;
+    }
+
+    if (baton->stream != NULL && !baton->error) {
+        // Chunks the notifier hasn't passed on yet. Results that didn't go
+        // through the encoder, like cache hits, make up a single chunk.
+        baton->stream->close();
+        if (baton->stream->length() == 0) baton->stream->emit(Blend_Result(baton));
+    }
 
     if (!baton->callback.IsEmpty()) {
-        if (!baton->error) {
+        if (!baton->error && baton->stream != NULL) {
+            Local<Value> argv[] = { Local<Value>::New(Null()) };
+            TRY_CATCH_CALL(Context::GetCurrent()->Global(), baton->callback, 1, argv);
+        } else if (!baton->error) {
             Local<Value> argv[] = {
                 Local<Value>::New(Null()),
-                Local<Value>::New(Buffer::New(baton->result, baton->length)->handle_)
+                Blend_Result(baton)
             };
             TRY_CATCH_CALL(Context::GetCurrent()->Global(), baton->callback, 2, argv);
         } else {
             Local<Value> argv[] = {
-                Local<Value>::New(Exception::TypeError(String::New("Unspecified error")))
+                Local<Value>::New(Exception::TypeError(String::New(baton->message.c_str())))
             };
-            TRY_CATCH_CALL(Context::GetCurrent()->Global(), baton->callback, 2, argv);
+            TRY_CATCH_CALL(Context::GetCurrent()->Global(), baton->callback, 1, argv);
         }
     }
 
@@ -16,8 +16,28 @@
 using namespace v8;
 using namespace node;
 
+// Shared with the other module functions that take an options object and
+// a callback.
+Handle<Value> Blend_Arguments(const Arguments& args, Local<Object>& options,
+                              Local<Function>& callback);
+Handle<Value> ThrowOrCall(Handle<Function> callback, const char* message);
+
 Handle<Value> Blend(const Arguments& args);
+Handle<Value> BlendMany(const Arguments& args);
 int EIO_Blend(eio_req *req);
 int EIO_AfterBlend(eio_req *req);
 
+Handle<Value> Info(const Arguments& args);
+Handle<Value> RegisterUniform(const Arguments& args);
+Handle<Value> SetLayerCacheSize(const Arguments& args);
+Handle<Value> LayerCacheStats(const Arguments& args);
+Handle<Value> SetResultCacheSize(const Arguments& args);
+Handle<Value> ResultCacheStats(const Arguments& args);
+Handle<Value> ConfigureWorkers(const Arguments& args);
+Handle<Value> WorkerStats(const Arguments& args);
+Handle<Value> SetMaxPixels(const Arguments& args);
+Handle<Value> SetBufferPoolSize(const Arguments& args);
+Handle<Value> BufferPoolStats(const Arguments& args);
+Handle<Value> ModuleStats(const Arguments& args);
+
 #endif
\ No newline at end of file
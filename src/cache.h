@@ -0,0 +1,142 @@
+#ifndef NODE_IMG_SRC_CACHE_H
+#define NODE_IMG_SRC_CACHE_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include <cstring>
+#include <list>
+#include <map>
+#include <string>
+#include <utility>
+
+#include "hash.h"
+
+// Thread safe, byte bounded LRU cache keyed by the content of a buffer.
+// `Value` must be reference counted with ref()/unref() and report its memory
+// use through size(). The cache is disabled while its capacity is 0.
+//
+// The key only narrows the search down: entries keep a copy of the buffer
+// they were stored for (and the seed of its hash), and get() only returns
+// an entry whose buffer is identical, so hash collisions are misses. The
+// copies count towards the capacity.
+template <class Value>
+class LRUCache {
+public:
+    // Buffer length and hash of the contents.
+    typedef std::pair<size_t, uint64_t> Key;
+
+    struct Stats {
+        uint64_t hits;
+        uint64_t misses;
+        uint64_t evictions;
+        size_t entries;
+        size_t bytes;
+        size_t capacity;
+    };
+
+    LRUCache() : capacity(0), bytes(0), hits(0), misses(0), evictions(0) {
+        pthread_mutex_init(&mutex, NULL);
+    }
+    ~LRUCache() {
+        setCapacity(0);
+        pthread_mutex_destroy(&mutex);
+    }
+
+    static inline Key keyFor(const char* data, size_t length, uint64_t seed = 0) {
+        return Key(length, hash64(data, length, seed));
+    }
+
+    inline bool enabled() const { return capacity > 0; }
+
+    // Returns a new reference to the value cached for the `length` bytes at
+    // `source`, hashed with `seed` into `key`, or NULL.
+    Value* get(const Key& key, const char* source = NULL, size_t length = 0,
+               uint64_t seed = 0) {
+        Value* value = NULL;
+        pthread_mutex_lock(&mutex);
+        typename Index::iterator it = index.find(key);
+        if (it != index.end() && it->second->matches(source, length, seed)) {
+            // Move to the front of the recently used list.
+            entries.splice(entries.begin(), entries, it->second);
+            value = it->second->value;
+            value->ref();
+            hits++;
+        } else {
+            misses++;
+        }
+        pthread_mutex_unlock(&mutex);
+        return value;
+    }
+
+    // Adds a reference to `value` and stores it with a copy of its source,
+    // evicting the least recently used entries to stay within the capacity.
+    void put(const Key& key, Value* value, const char* source = NULL, size_t length = 0,
+             uint64_t seed = 0) {
+        pthread_mutex_lock(&mutex);
+        if (value->size() + length <= capacity && index.find(key) == index.end()) {
+            value->ref();
+            entries.push_front(Entry(key, value, source, length, seed));
+            index[key] = entries.begin();
+            bytes += entries.front().size();
+            evict();
+        }
+        pthread_mutex_unlock(&mutex);
+    }
+
+    void setCapacity(size_t size) {
+        pthread_mutex_lock(&mutex);
+        capacity = size;
+        evict();
+        pthread_mutex_unlock(&mutex);
+    }
+
+    Stats stats() {
+        pthread_mutex_lock(&mutex);
+        Stats result = { hits, misses, evictions, index.size(), bytes, capacity };
+        pthread_mutex_unlock(&mutex);
+        return result;
+    }
+
+protected:
+    struct Entry {
+        Key key;
+        Value* value;
+        std::string source;
+        uint64_t seed;
+
+        Entry(const Key& k, Value* v, const char* data, size_t length, uint64_t s)
+            : key(k), value(v), source(data, length), seed(s) {}
+
+        inline bool matches(const char* data, size_t length, uint64_t s) const {
+            return seed == s && source.size() == length &&
+                   (length == 0 || memcmp(source.data(), data, length) == 0);
+        }
+        inline size_t size() const { return value->size() + source.size(); }
+    };
+    typedef std::list<Entry> Entries;
+    typedef std::map<Key, typename Entries::iterator> Index;
+
+    void evict() {
+        while (bytes > capacity && !entries.empty()) {
+            Entry& entry = entries.back();
+            Value* value = entry.value;
+            bytes -= entry.size();
+            index.erase(entry.key);
+            entries.pop_back();
+            value->unref();
+            evictions++;
+        }
+    }
+
+    pthread_mutex_t mutex;
+    Entries entries;
+    Index index;
+    size_t capacity;
+    size_t bytes;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+};
+
+#endif
@@ -0,0 +1,536 @@
+#include <cstdlib>
+#include <cstring>
+
+#include "composite.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define COMPOSITE_X86 1
+#include <immintrin.h>
+#endif
+
+void compositeScalar(unsigned int* dst, const unsigned int* top,
+                     const unsigned int* bottom, size_t length) {
+    for (size_t i = 0; i < length; i++) {
+        dst[i] = compositePixel(top[i], bottom[i]);
+    }
+}
+
+void compositePremultipliedScalar(unsigned int* dst, const unsigned int* top,
+                                  const unsigned int* bottom, size_t length) {
+    for (size_t i = 0; i < length; i++) {
+        dst[i] = compositePremultipliedPixel(top[i], bottom[i]);
+    }
+}
+
+void premultiplyScalar(unsigned int* dst, const unsigned int* src, size_t length) {
+    for (size_t i = 0; i < length; i++) {
+        dst[i] = premultiplyPixel(src[i]);
+    }
+}
+
+const unsigned int unpremultiplyTable[256] = {
+    0, 16711680, 8355840, 5570560, 4177920, 3342336, 2785280, 2387383,
+    2088960, 1856853, 1671168, 1519244, 1392640, 1285514, 1193691, 1114112,
+    1044480, 983040, 928427, 879562, 835584, 795794, 759622, 726595,
+    696320, 668467, 642757, 618951, 596846, 576265, 557056, 539086,
+    522240, 506415, 491520, 477477, 464213, 451667, 439781, 428505,
+    417792, 407602, 397897, 388644, 379811, 371371, 363297, 355568,
+    348160, 341055, 334234, 327680, 321378, 315315, 309476, 303849,
+    298423, 293187, 288132, 283249, 278528, 273962, 269543, 265265,
+    261120, 257103, 253207, 249428, 245760, 242198, 238738, 235376,
+    232107, 228927, 225834, 222822, 219891, 217035, 214252, 211540,
+    208896, 206317, 203801, 201346, 198949, 196608, 194322, 192088,
+    189905, 187772, 185685, 183645, 181649, 179695, 177784, 175912,
+    174080, 172285, 170527, 168805, 167117, 165462, 163840, 162249,
+    160689, 159159, 157657, 156184, 154738, 153318, 151924, 150556,
+    149211, 147891, 146594, 145319, 144066, 142835, 141624, 140434,
+    139264, 138113, 136981, 135867, 134772, 133693, 132632, 131588,
+    130560, 129548, 128551, 127570, 126604, 125652, 124714, 123790,
+    122880, 121983, 121099, 120228, 119369, 118523, 117688, 116865,
+    116053, 115253, 114464, 113685, 112917, 112159, 111411, 110673,
+    109945, 109227, 108517, 107817, 107126, 106444, 105770, 105105,
+    104448, 103799, 103159, 102526, 101900, 101283, 100673, 100070,
+    99474, 98886, 98304, 97729, 97161, 96599, 96044, 95495,
+    94953, 94416, 93886, 93361, 92843, 92330, 91822, 91321,
+    90824, 90333, 89848, 89367, 88892, 88422, 87956, 87496,
+    87040, 86589, 86143, 85701, 85264, 84831, 84402, 83978,
+    83558, 83143, 82731, 82324, 81920, 81520, 81125, 80733,
+    80345, 79960, 79579, 79202, 78829, 78459, 78092, 77729,
+    77369, 77012, 76659, 76309, 75962, 75618, 75278, 74940,
+    74606, 74274, 73945, 73620, 73297, 72977, 72659, 72345,
+    72033, 71724, 71417, 71114, 70812, 70513, 70217, 69923,
+    69632, 69343, 69057, 68772, 68490, 68211, 67934, 67659,
+    67386, 67115, 66847, 66580, 66316, 66054, 65794, 65536
+};
+
+void unpremultiplyScalar(unsigned int* dst, const unsigned int* src, size_t length) {
+    for (size_t i = 0; i < length; i++) {
+        dst[i] = unpremultiplyPixel(src[i]);
+    }
+}
+
+bool compositeOpaque(const unsigned int* pixels, size_t length) {
+    // Without an early exit so that the compiler can vectorize the loop.
+    unsigned int all = 0xFFFFFFFF;
+    for (size_t i = 0; i < length; i++) {
+        all &= pixels[i];
+    }
+    return all >= 0xFF000000;
+}
+
+#ifdef COMPOSITE_X86
+
+// The SIMD paths evaluate the exact integer formula of compositePixel() in
+// single precision: every intermediate is an integer below 2^24 and therefore
+// exact, and the correctly rounded quotient is at most one too large, which is
+// detected by multiplying back.
+
+__attribute__((target("sse2")))
+static inline __m128i divideSSE2(__m128 num, __m128 den) {
+    __m128i q = _mm_cvttps_epi32(_mm_div_ps(num, den));
+    __m128 over = _mm_cmpgt_ps(_mm_mul_ps(_mm_cvtepi32_ps(q), den), num);
+    return _mm_add_epi32(q, _mm_castps_si128(over));
+}
+
+__attribute__((target("sse2")))
+static inline __m128i selectSSE2(__m128i mask, __m128i a, __m128i b) {
+    return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b));
+}
+
+__attribute__((target("sse2")))
+static void compositeSSE2(unsigned int* dst, const unsigned int* top,
+                          const unsigned int* bottom, size_t length) {
+    const __m128i mask = _mm_set1_epi32(0xff);
+    const __m128i zero = _mm_setzero_si128();
+    const __m128 scale = _mm_set1_ps(256.0f);
+    const __m128 one = _mm_set1_ps(1.0f);
+
+    size_t i = 0;
+    for (; i + 4 <= length; i += 4) {
+        __m128i t = _mm_loadu_si128((const __m128i*)(top + i));
+        __m128i b = _mm_loadu_si128((const __m128i*)(bottom + i));
+        __m128i ta = _mm_srli_epi32(t, 24);
+        __m128i ba = _mm_srli_epi32(b, 24);
+
+        __m128i useBottom = _mm_cmpeq_epi32(ta, zero);
+        __m128i useTop = _mm_or_si128(_mm_cmpeq_epi32(ta, mask), _mm_cmpeq_epi32(ba, zero));
+        __m128i trivial = _mm_or_si128(useTop, useBottom);
+
+        if (_mm_movemask_epi8(trivial) != 0xFFFF) {
+            __m128 a1 = _mm_cvtepi32_ps(ta);
+            __m128 a0 = _mm_cvtepi32_ps(ba);
+            __m128 s = _mm_mul_ps(a1, scale);
+            __m128 inv = _mm_mul_ps(_mm_sub_ps(scale, a1), a0);
+            __m128 den = _mm_sub_ps(_mm_mul_ps(_mm_add_ps(a1, a0), scale), _mm_mul_ps(a0, a1));
+            den = _mm_max_ps(den, one);
+
+            __m128 r1 = _mm_cvtepi32_ps(_mm_and_si128(t, mask));
+            __m128 g1 = _mm_cvtepi32_ps(_mm_and_si128(_mm_srli_epi32(t, 8), mask));
+            __m128 b1 = _mm_cvtepi32_ps(_mm_and_si128(_mm_srli_epi32(t, 16), mask));
+            __m128 r0 = _mm_cvtepi32_ps(_mm_and_si128(b, mask));
+            __m128 g0 = _mm_cvtepi32_ps(_mm_and_si128(_mm_srli_epi32(b, 8), mask));
+            __m128 b0 = _mm_cvtepi32_ps(_mm_and_si128(_mm_srli_epi32(b, 16), mask));
+
+            __m128i r = divideSSE2(_mm_add_ps(_mm_mul_ps(r1, s), _mm_mul_ps(r0, inv)), den);
+            __m128i g = divideSSE2(_mm_add_ps(_mm_mul_ps(g1, s), _mm_mul_ps(g0, inv)), den);
+            __m128i bl = divideSSE2(_mm_add_ps(_mm_mul_ps(b1, s), _mm_mul_ps(b0, inv)), den);
+            __m128i a = _mm_srli_epi32(_mm_cvttps_epi32(den), 8);
+
+            __m128i result = _mm_or_si128(
+                _mm_or_si128(r, _mm_slli_epi32(g, 8)),
+                _mm_or_si128(_mm_slli_epi32(bl, 16), _mm_slli_epi32(a, 24)));
+            t = selectSSE2(useTop, t, result);
+        }
+
+        _mm_storeu_si128((__m128i*)(dst + i), selectSSE2(useBottom, b, t));
+    }
+
+    compositeScalar(dst + i, top + i, bottom + i, length - i);
+}
+
+__attribute__((target("ssse3")))
+static inline __m128 channelSSSE3(__m128i pixels, __m128i shuffle) {
+    return _mm_cvtepi32_ps(_mm_shuffle_epi8(pixels, shuffle));
+}
+
+__attribute__((target("ssse3")))
+static void compositeSSSE3(unsigned int* dst, const unsigned int* top,
+                           const unsigned int* bottom, size_t length) {
+    const __m128i mask = _mm_set1_epi32(0xff);
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i red = _mm_setr_epi8(0, -1, -1, -1, 4, -1, -1, -1, 8, -1, -1, -1, 12, -1, -1, -1);
+    const __m128i green = _mm_setr_epi8(1, -1, -1, -1, 5, -1, -1, -1, 9, -1, -1, -1, 13, -1, -1, -1);
+    const __m128i blue = _mm_setr_epi8(2, -1, -1, -1, 6, -1, -1, -1, 10, -1, -1, -1, 14, -1, -1, -1);
+    const __m128i interleave = _mm_setr_epi8(0, 4, 8, 12, 1, 5, 9, 13, 2, 6, 10, 14, 3, 7, 11, 15);
+    const __m128 scale = _mm_set1_ps(256.0f);
+    const __m128 one = _mm_set1_ps(1.0f);
+
+    size_t i = 0;
+    for (; i + 4 <= length; i += 4) {
+        __m128i t = _mm_loadu_si128((const __m128i*)(top + i));
+        __m128i b = _mm_loadu_si128((const __m128i*)(bottom + i));
+        __m128i ta = _mm_srli_epi32(t, 24);
+        __m128i ba = _mm_srli_epi32(b, 24);
+
+        __m128i useBottom = _mm_cmpeq_epi32(ta, zero);
+        __m128i useTop = _mm_or_si128(_mm_cmpeq_epi32(ta, mask), _mm_cmpeq_epi32(ba, zero));
+        __m128i trivial = _mm_or_si128(useTop, useBottom);
+
+        if (_mm_movemask_epi8(trivial) != 0xFFFF) {
+            __m128 a1 = _mm_cvtepi32_ps(ta);
+            __m128 a0 = _mm_cvtepi32_ps(ba);
+            __m128 s = _mm_mul_ps(a1, scale);
+            __m128 inv = _mm_mul_ps(_mm_sub_ps(scale, a1), a0);
+            __m128 den = _mm_sub_ps(_mm_mul_ps(_mm_add_ps(a1, a0), scale), _mm_mul_ps(a0, a1));
+            den = _mm_max_ps(den, one);
+
+            __m128i r = divideSSE2(_mm_add_ps(_mm_mul_ps(channelSSSE3(t, red), s),
+                                              _mm_mul_ps(channelSSSE3(b, red), inv)), den);
+            __m128i g = divideSSE2(_mm_add_ps(_mm_mul_ps(channelSSSE3(t, green), s),
+                                              _mm_mul_ps(channelSSSE3(b, green), inv)), den);
+            __m128i bl = divideSSE2(_mm_add_ps(_mm_mul_ps(channelSSSE3(t, blue), s),
+                                               _mm_mul_ps(channelSSSE3(b, blue), inv)), den);
+            __m128i a = _mm_srli_epi32(_mm_cvttps_epi32(den), 8);
+
+            // All channels are below 256, so saturating packs are lossless.
+            __m128i packed = _mm_packus_epi16(_mm_packs_epi32(r, g), _mm_packs_epi32(bl, a));
+            t = selectSSE2(useTop, t, _mm_shuffle_epi8(packed, interleave));
+        }
+
+        _mm_storeu_si128((__m128i*)(dst + i), selectSSE2(useBottom, b, t));
+    }
+
+    compositeScalar(dst + i, top + i, bottom + i, length - i);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i divideAVX2(__m256 num, __m256 den) {
+    __m256i q = _mm256_cvttps_epi32(_mm256_div_ps(num, den));
+    __m256 over = _mm256_cmp_ps(_mm256_mul_ps(_mm256_cvtepi32_ps(q), den), num, _CMP_GT_OQ);
+    return _mm256_add_epi32(q, _mm256_castps_si256(over));
+}
+
+__attribute__((target("avx2")))
+static void compositeAVX2(unsigned int* dst, const unsigned int* top,
+                          const unsigned int* bottom, size_t length) {
+    const __m256i mask = _mm256_set1_epi32(0xff);
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256 scale = _mm256_set1_ps(256.0f);
+    const __m256 one = _mm256_set1_ps(1.0f);
+
+    size_t i = 0;
+    for (; i + 8 <= length; i += 8) {
+        __m256i t = _mm256_loadu_si256((const __m256i*)(top + i));
+        __m256i b = _mm256_loadu_si256((const __m256i*)(bottom + i));
+        __m256i ta = _mm256_srli_epi32(t, 24);
+        __m256i ba = _mm256_srli_epi32(b, 24);
+
+        __m256i useBottom = _mm256_cmpeq_epi32(ta, zero);
+        __m256i useTop = _mm256_or_si256(_mm256_cmpeq_epi32(ta, mask), _mm256_cmpeq_epi32(ba, zero));
+        __m256i trivial = _mm256_or_si256(useTop, useBottom);
+
+        if (_mm256_movemask_epi8(trivial) != -1) {
+            __m256 a1 = _mm256_cvtepi32_ps(ta);
+            __m256 a0 = _mm256_cvtepi32_ps(ba);
+            __m256 s = _mm256_mul_ps(a1, scale);
+            __m256 inv = _mm256_mul_ps(_mm256_sub_ps(scale, a1), a0);
+            __m256 den = _mm256_sub_ps(_mm256_mul_ps(_mm256_add_ps(a1, a0), scale), _mm256_mul_ps(a0, a1));
+            den = _mm256_max_ps(den, one);
+
+            __m256 r1 = _mm256_cvtepi32_ps(_mm256_and_si256(t, mask));
+            __m256 g1 = _mm256_cvtepi32_ps(_mm256_and_si256(_mm256_srli_epi32(t, 8), mask));
+            __m256 b1 = _mm256_cvtepi32_ps(_mm256_and_si256(_mm256_srli_epi32(t, 16), mask));
+            __m256 r0 = _mm256_cvtepi32_ps(_mm256_and_si256(b, mask));
+            __m256 g0 = _mm256_cvtepi32_ps(_mm256_and_si256(_mm256_srli_epi32(b, 8), mask));
+            __m256 b0 = _mm256_cvtepi32_ps(_mm256_and_si256(_mm256_srli_epi32(b, 16), mask));
+
+            __m256i r = divideAVX2(_mm256_add_ps(_mm256_mul_ps(r1, s), _mm256_mul_ps(r0, inv)), den);
+            __m256i g = divideAVX2(_mm256_add_ps(_mm256_mul_ps(g1, s), _mm256_mul_ps(g0, inv)), den);
+            __m256i bl = divideAVX2(_mm256_add_ps(_mm256_mul_ps(b1, s), _mm256_mul_ps(b0, inv)), den);
+            __m256i a = _mm256_srli_epi32(_mm256_cvttps_epi32(den), 8);
+
+            __m256i result = _mm256_or_si256(
+                _mm256_or_si256(r, _mm256_slli_epi32(g, 8)),
+                _mm256_or_si256(_mm256_slli_epi32(bl, 16), _mm256_slli_epi32(a, 24)));
+            t = _mm256_blendv_epi8(result, t, useTop);
+        }
+
+        _mm256_storeu_si256((__m256i*)(dst + i), _mm256_blendv_epi8(t, b, useBottom));
+    }
+
+    compositeScalar(dst + i, top + i, bottom + i, length - i);
+}
+
+// The premultiplied paths widen the channels to 16 bits and divide by 255
+// like divide255(), so they are byte-identical to the scalar versions.
+
+__attribute__((target("sse2")))
+static inline __m128i divide255SSE2(__m128i x) {
+    x = _mm_add_epi16(x, _mm_set1_epi16(128));
+    return _mm_srli_epi16(_mm_add_epi16(x, _mm_srli_epi16(x, 8)), 8);
+}
+
+// Repeats the alpha of both widened pixels across their channels.
+__attribute__((target("sse2")))
+static inline __m128i alphaSSE2(__m128i pixels) {
+    return _mm_shufflehi_epi16(_mm_shufflelo_epi16(pixels, _MM_SHUFFLE(3, 3, 3, 3)),
+                               _MM_SHUFFLE(3, 3, 3, 3));
+}
+
+__attribute__((target("sse2")))
+static void compositePremultipliedSSE2(unsigned int* dst, const unsigned int* top,
+                                       const unsigned int* bottom, size_t length) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i max = _mm_set1_epi16(255);
+    const __m128i opaque = _mm_set1_epi32(0xFF000000);
+
+    size_t i = 0;
+    for (; i + 4 <= length; i += 4) {
+        __m128i t = _mm_loadu_si128((const __m128i*)(top + i));
+        __m128i b = _mm_loadu_si128((const __m128i*)(bottom + i));
+
+        // Opaque top pixels and transparent bottom ones leave the top as is,
+        // transparent top pixels the bottom.
+        __m128i useTop = _mm_or_si128(_mm_cmpeq_epi32(_mm_and_si128(t, opaque), opaque),
+                                      _mm_cmpeq_epi32(b, zero));
+        __m128i useBottom = _mm_cmpeq_epi32(t, zero);
+        if (_mm_movemask_epi8(_mm_or_si128(useTop, useBottom)) == 0xFFFF) {
+            _mm_storeu_si128((__m128i*)(dst + i), selectSSE2(useBottom, b, t));
+            continue;
+        }
+
+        __m128i low = _mm_mullo_epi16(_mm_unpacklo_epi8(b, zero),
+                                      _mm_sub_epi16(max, alphaSSE2(_mm_unpacklo_epi8(t, zero))));
+        __m128i high = _mm_mullo_epi16(_mm_unpackhi_epi8(b, zero),
+                                       _mm_sub_epi16(max, alphaSSE2(_mm_unpackhi_epi8(t, zero))));
+        __m128i under = _mm_packus_epi16(divide255SSE2(low), divide255SSE2(high));
+        _mm_storeu_si128((__m128i*)(dst + i), _mm_add_epi8(t, under));
+    }
+
+    compositePremultipliedScalar(dst + i, top + i, bottom + i, length - i);
+}
+
+__attribute__((target("sse2")))
+static void premultiplySSE2(unsigned int* dst, const unsigned int* src, size_t length) {
+    const __m128i zero = _mm_setzero_si128();
+    // Colors are multiplied by the alpha, the alpha by 255.
+    const __m128i colors = _mm_setr_epi16(-1, -1, -1, 0, -1, -1, -1, 0);
+    const __m128i opaque = _mm_setr_epi16(0, 0, 0, 255, 0, 0, 0, 255);
+    const __m128i alpha = _mm_set1_epi32(0xFF000000);
+
+    size_t i = 0;
+    for (; i + 4 <= length; i += 4) {
+        __m128i s = _mm_loadu_si128((const __m128i*)(src + i));
+        // Opaque pixels and zeros don't change.
+        __m128i trivial = _mm_or_si128(_mm_cmpeq_epi32(_mm_and_si128(s, alpha), alpha),
+                                       _mm_cmpeq_epi32(s, zero));
+        if (_mm_movemask_epi8(trivial) == 0xFFFF) {
+            _mm_storeu_si128((__m128i*)(dst + i), s);
+            continue;
+        }
+        __m128i low = _mm_unpacklo_epi8(s, zero);
+        __m128i high = _mm_unpackhi_epi8(s, zero);
+        low = _mm_mullo_epi16(low, _mm_or_si128(_mm_and_si128(alphaSSE2(low), colors), opaque));
+        high = _mm_mullo_epi16(high, _mm_or_si128(_mm_and_si128(alphaSSE2(high), colors), opaque));
+        _mm_storeu_si128((__m128i*)(dst + i),
+                         _mm_packus_epi16(divide255SSE2(low), divide255SSE2(high)));
+    }
+
+    premultiplyScalar(dst + i, src + i, length - i);
+}
+
+// Opaque and transparent pixels don't change, so only blocks with other
+// pixels are converted.
+__attribute__((target("sse2")))
+static void unpremultiplySSE2(unsigned int* dst, const unsigned int* src, size_t length) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i alpha = _mm_set1_epi32(0xFF000000);
+
+    size_t i = 0;
+    for (; i + 4 <= length; i += 4) {
+        __m128i s = _mm_loadu_si128((const __m128i*)(src + i));
+        __m128i a = _mm_and_si128(s, alpha);
+        __m128i trivial = _mm_or_si128(_mm_cmpeq_epi32(a, alpha), _mm_cmpeq_epi32(a, zero));
+        if (_mm_movemask_epi8(trivial) == 0xFFFF) {
+            _mm_storeu_si128((__m128i*)(dst + i), s);
+        } else {
+            unpremultiplyScalar(dst + i, src + i, 4);
+        }
+    }
+
+    unpremultiplyScalar(dst + i, src + i, length - i);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i divide255AVX2(__m256i x) {
+    x = _mm256_add_epi16(x, _mm256_set1_epi16(128));
+    return _mm256_srli_epi16(_mm256_add_epi16(x, _mm256_srli_epi16(x, 8)), 8);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i alphaAVX2(__m256i pixels) {
+    return _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(pixels, _MM_SHUFFLE(3, 3, 3, 3)),
+                                  _MM_SHUFFLE(3, 3, 3, 3));
+}
+
+// Unpacking and packing both work within 128 bit lanes, so the pixel order
+// is preserved.
+__attribute__((target("avx2")))
+static void compositePremultipliedAVX2(unsigned int* dst, const unsigned int* top,
+                                       const unsigned int* bottom, size_t length) {
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i max = _mm256_set1_epi16(255);
+    const __m256i opaque = _mm256_set1_epi32(0xFF000000);
+
+    size_t i = 0;
+    for (; i + 8 <= length; i += 8) {
+        __m256i t = _mm256_loadu_si256((const __m256i*)(top + i));
+        __m256i b = _mm256_loadu_si256((const __m256i*)(bottom + i));
+
+        __m256i useTop = _mm256_or_si256(
+            _mm256_cmpeq_epi32(_mm256_and_si256(t, opaque), opaque),
+            _mm256_cmpeq_epi32(b, zero));
+        __m256i useBottom = _mm256_cmpeq_epi32(t, zero);
+        if (_mm256_movemask_epi8(_mm256_or_si256(useTop, useBottom)) == -1) {
+            _mm256_storeu_si256((__m256i*)(dst + i), _mm256_blendv_epi8(t, b, useBottom));
+            continue;
+        }
+
+        __m256i low = _mm256_mullo_epi16(_mm256_unpacklo_epi8(b, zero),
+            _mm256_sub_epi16(max, alphaAVX2(_mm256_unpacklo_epi8(t, zero))));
+        __m256i high = _mm256_mullo_epi16(_mm256_unpackhi_epi8(b, zero),
+            _mm256_sub_epi16(max, alphaAVX2(_mm256_unpackhi_epi8(t, zero))));
+        __m256i under = _mm256_packus_epi16(divide255AVX2(low), divide255AVX2(high));
+        _mm256_storeu_si256((__m256i*)(dst + i), _mm256_add_epi8(t, under));
+    }
+
+    compositePremultipliedScalar(dst + i, top + i, bottom + i, length - i);
+}
+
+__attribute__((target("avx2")))
+static void premultiplyAVX2(unsigned int* dst, const unsigned int* src, size_t length) {
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i colors = _mm256_setr_epi16(-1, -1, -1, 0, -1, -1, -1, 0,
+                                             -1, -1, -1, 0, -1, -1, -1, 0);
+    const __m256i opaque = _mm256_setr_epi16(0, 0, 0, 255, 0, 0, 0, 255,
+                                             0, 0, 0, 255, 0, 0, 0, 255);
+    const __m256i alpha = _mm256_set1_epi32(0xFF000000);
+
+    size_t i = 0;
+    for (; i + 8 <= length; i += 8) {
+        __m256i s = _mm256_loadu_si256((const __m256i*)(src + i));
+        __m256i trivial = _mm256_or_si256(
+            _mm256_cmpeq_epi32(_mm256_and_si256(s, alpha), alpha),
+            _mm256_cmpeq_epi32(s, zero));
+        if (_mm256_movemask_epi8(trivial) == -1) {
+            _mm256_storeu_si256((__m256i*)(dst + i), s);
+            continue;
+        }
+        __m256i low = _mm256_unpacklo_epi8(s, zero);
+        __m256i high = _mm256_unpackhi_epi8(s, zero);
+        low = _mm256_mullo_epi16(low, _mm256_or_si256(_mm256_and_si256(alphaAVX2(low), colors), opaque));
+        high = _mm256_mullo_epi16(high, _mm256_or_si256(_mm256_and_si256(alphaAVX2(high), colors), opaque));
+        _mm256_storeu_si256((__m256i*)(dst + i),
+                            _mm256_packus_epi16(divide255AVX2(low), divide255AVX2(high)));
+    }
+
+    premultiplyScalar(dst + i, src + i, length - i);
+}
+
+// Looks the reciprocals up with a gather.
+__attribute__((target("avx2")))
+static void unpremultiplyAVX2(unsigned int* dst, const unsigned int* src, size_t length) {
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i mask = _mm256_set1_epi32(0xff);
+    const __m256i alpha = _mm256_set1_epi32(0xFF000000);
+    const __m256i half = _mm256_set1_epi32(32768);
+
+    size_t i = 0;
+    for (; i + 8 <= length; i += 8) {
+        __m256i s = _mm256_loadu_si256((const __m256i*)(src + i));
+        __m256i a = _mm256_and_si256(s, alpha);
+        __m256i transparent = _mm256_cmpeq_epi32(a, zero);
+        __m256i trivial = _mm256_or_si256(_mm256_cmpeq_epi32(a, alpha), transparent);
+        if (_mm256_movemask_epi8(trivial) == -1) {
+            _mm256_storeu_si256((__m256i*)(dst + i), s);
+            continue;
+        }
+
+        __m256i scale = _mm256_i32gather_epi32((const int*)unpremultiplyTable,
+                                               _mm256_srli_epi32(s, 24), 4);
+        __m256i r = _mm256_mullo_epi32(_mm256_and_si256(s, mask), scale);
+        __m256i g = _mm256_mullo_epi32(_mm256_and_si256(_mm256_srli_epi32(s, 8), mask), scale);
+        __m256i b = _mm256_mullo_epi32(_mm256_and_si256(_mm256_srli_epi32(s, 16), mask), scale);
+        r = _mm256_srli_epi32(_mm256_add_epi32(r, half), 16);
+        g = _mm256_srli_epi32(_mm256_add_epi32(g, half), 16);
+        b = _mm256_srli_epi32(_mm256_add_epi32(b, half), 16);
+
+        __m256i result = _mm256_or_si256(
+            _mm256_or_si256(r, _mm256_slli_epi32(g, 8)),
+            _mm256_or_si256(_mm256_slli_epi32(b, 16), a));
+        _mm256_storeu_si256((__m256i*)(dst + i), _mm256_blendv_epi8(result, s, transparent));
+    }
+
+    unpremultiplyScalar(dst + i, src + i, length - i);
+}
+
+#endif
+
+struct CompositeImplementation {
+    const char* name;
+    CompositeFunction function;
+    CompositeFunction premultiplied;
+    ConvertFunction premultiply;
+    ConvertFunction unpremultiply;
+    bool (*supported)();
+};
+
+static bool alwaysSupported() { return true; }
+
+#ifdef COMPOSITE_X86
+static bool supportsSSE2() { __builtin_cpu_init(); return __builtin_cpu_supports("sse2"); }
+static bool supportsSSSE3() { __builtin_cpu_init(); return __builtin_cpu_supports("ssse3"); }
+static bool supportsAVX2() { __builtin_cpu_init(); return __builtin_cpu_supports("avx2"); }
+#endif
+
+// Ordered from slowest to fastest.
+static const CompositeImplementation implementations[] = {
+    { "scalar", compositeScalar, compositePremultipliedScalar, premultiplyScalar, unpremultiplyScalar,
+      alwaysSupported },
+#ifdef COMPOSITE_X86
+    { "sse2", compositeSSE2, compositePremultipliedSSE2, premultiplySSE2, unpremultiplySSE2,
+      supportsSSE2 },
+    { "ssse3", compositeSSSE3, compositePremultipliedSSE2, premultiplySSE2, unpremultiplySSE2,
+      supportsSSSE3 },
+    { "avx2", compositeAVX2, compositePremultipliedAVX2, premultiplyAVX2, unpremultiplyAVX2,
+      supportsAVX2 },
+#endif
+};
+
+static const CompositeImplementation* selected = NULL;
+
+static CompositeFunction selectComposite() {
+    const char* cap = getenv("NODE_IMG_SIMD");
+    int count = sizeof(implementations) / sizeof(implementations[0]);
+
+    selected = &implementations[0];
+    for (int i = 1; i < count; i++) {
+        if (!implementations[i].supported()) break;
+        selected = &implementations[i];
+        if (cap && strcmp(cap, implementations[i].name) == 0) break;
+    }
+    if (cap && strcmp(cap, "scalar") == 0) {
+        selected = &implementations[0];
+    }
+
+    return selected->function;
+}
+
+CompositeFunction composite = selectComposite();
+CompositeFunction compositePremultiplied = selected->premultiplied;
+ConvertFunction premultiply = selected->premultiply;
+ConvertFunction unpremultiply = selected->unpremultiply;
+
+const char* compositeImplementation() {
+    return selected->name;
+}
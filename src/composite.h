@@ -0,0 +1,115 @@
+#ifndef NODE_IMG_SRC_COMPOSITE_H
+#define NODE_IMG_SRC_COMPOSITE_H
+
+#include <cstddef>
+
+// Composites `length` straight-alpha RGBA pixels (stored as little endian
+// ABGR words) of `top` over `bottom` and writes the result to `dst`. `dst` may
+// alias either `top` or `bottom`.
+typedef void (*CompositeFunction)(unsigned int* dst, const unsigned int* top,
+                                  const unsigned int* bottom, size_t length);
+
+// Fastest implementation supported by the CPU; selected when the module is
+// loaded. Setting NODE_IMG_SIMD=scalar|sse2|ssse3|avx2 caps the selection.
+extern CompositeFunction composite;
+
+// Name of the implementation `composite` points to.
+const char* compositeImplementation();
+
+// Returns true when all `length` pixels are fully opaque.
+bool compositeOpaque(const unsigned int* pixels, size_t length);
+
+// Portable reference implementation. All SIMD paths are byte-identical to it.
+void compositeScalar(unsigned int* dst, const unsigned int* top,
+                     const unsigned int* bottom, size_t length);
+
+// From http://trac.mapnik.org/browser/trunk/include/mapnik/graphics.hpp#L337
+inline unsigned int compositePixel(unsigned int rgba1, unsigned int rgba0) {
+    unsigned a1 = (rgba1 >> 24) & 0xff;
+    if (a1 == 0xff) return rgba1;
+    if (a1 == 0) return rgba0;
+    unsigned a0 = (rgba0 >> 24) & 0xff;
+    if (a0 == 0) return rgba1;
+
+    unsigned r1 = rgba1 & 0xff;
+    unsigned g1 = (rgba1 >> 8 ) & 0xff;
+    unsigned b1 = (rgba1 >> 16) & 0xff;
+
+    unsigned r0 = (rgba0 & 0xff) * a0;
+    unsigned g0 = ((rgba0 >> 8 ) & 0xff) * a0;
+    unsigned b0 = ((rgba0 >> 16) & 0xff) * a0;
+
+    a0 = ((a1 + a0) << 8) - a0*a1;
+
+    r0 = ((((r1 << 8) - r0) * a1 + (r0 << 8)) / a0);
+    g0 = ((((g1 << 8) - g0) * a1 + (g0 << 8)) / a0);
+    b0 = ((((b1 << 8) - b0) * a1 + (b0 << 8)) / a0);
+    a0 = a0 >> 8;
+    return (a0 << 24)| (b0 << 16) | (g0 << 8) | (r0);
+}
+
+// Premultiplied alpha variants. Blends keep their rows premultiplied between
+// decoding and encoding, which turns compositing into a multiply-add per
+// channel without any division. Compared to compositing the straight pixels
+// with compositePixel(), a result of n layers differs by at most n - 1 in
+// alpha and by at most 3 * (n - 1) * 255 / alpha in each color channel: the
+// error is bounded in premultiplied terms, so nearly transparent results can
+// lose most of their color precision while opaque ones stay within a few
+// steps. Fully transparent results are all zero.
+
+// Divides by 255 and rounds to the nearest integer; exact for x <= 65535.
+inline unsigned int divide255(unsigned int x) {
+    x += 128;
+    return (x + (x >> 8)) >> 8;
+}
+
+inline unsigned int premultiplyPixel(unsigned int rgba) {
+    unsigned a = rgba >> 24;
+    if (a == 0xff) return rgba;
+    if (a == 0) return 0;
+    unsigned r = divide255((rgba & 0xff) * a);
+    unsigned g = divide255(((rgba >> 8) & 0xff) * a);
+    unsigned b = divide255(((rgba >> 16) & 0xff) * a);
+    return (a << 24) | (b << 16) | (g << 8) | r;
+}
+
+// 65536 * 255 / alpha, rounded. Index 0 is unused.
+extern const unsigned int unpremultiplyTable[256];
+
+inline unsigned int unpremultiplyPixel(unsigned int rgba) {
+    unsigned a = rgba >> 24;
+    if (a == 0xff || a == 0) return rgba;
+    unsigned scale = unpremultiplyTable[a];
+    unsigned r = ((rgba & 0xff) * scale + 32768) >> 16;
+    unsigned g = (((rgba >> 8) & 0xff) * scale + 32768) >> 16;
+    unsigned b = (((rgba >> 16) & 0xff) * scale + 32768) >> 16;
+    return (a << 24) | (b << 16) | (g << 8) | r;
+}
+
+// Premultiplied `top` over `bottom`. No channel exceeds the alpha, so the sum
+// can't overflow.
+inline unsigned int compositePremultipliedPixel(unsigned int top, unsigned int bottom) {
+    unsigned inverse = 255 - (top >> 24);
+    if (inverse == 0) return top;
+    return top +
+        (divide255((bottom & 0xff) * inverse)) +
+        (divide255(((bottom >> 8) & 0xff) * inverse) << 8) +
+        (divide255(((bottom >> 16) & 0xff) * inverse) << 16) +
+        (divide255((bottom >> 24) * inverse) << 24);
+}
+
+// Converts `length` pixels between straight and premultiplied alpha. `dst`
+// may alias `src`.
+typedef void (*ConvertFunction)(unsigned int* dst, const unsigned int* src, size_t length);
+
+// Fastest implementations, selected together with `composite`.
+extern CompositeFunction compositePremultiplied;
+extern ConvertFunction premultiply;
+extern ConvertFunction unpremultiply;
+
+void compositePremultipliedScalar(unsigned int* dst, const unsigned int* top,
+                                  const unsigned int* bottom, size_t length);
+void premultiplyScalar(unsigned int* dst, const unsigned int* src, size_t length);
+void unpremultiplyScalar(unsigned int* dst, const unsigned int* src, size_t length);
+
+#endif
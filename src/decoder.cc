@@ -0,0 +1,176 @@
+#include "decoder.h"
+#include "pool.h"
+
+// Rows decoded between progress notifications.
+static const unsigned long PROGRESS_ROWS = 16;
+
+ParallelDecoder::ParallelDecoder(const std::vector<ImageReader*>& layers,
+                                 unsigned long w, unsigned long h)
+    : width(w), height(h), helpers(0), running(0), priority(WorkerPool::INTERACTIVE),
+      cancelled(false), refs(1) {
+    pthread_mutex_init(&mutex, NULL);
+    pthread_cond_init(&progress, NULL);
+
+    for (size_t i = 0; i < layers.size(); i++) {
+        Task task = { layers[i], NULL, 0, 0, false, false };
+        tasks.push_back(task);
+    }
+}
+
+ParallelDecoder::~ParallelDecoder() {
+    for (size_t i = 0; i < tasks.size(); i++) {
+        BufferPool::release(tasks[i].pixels);
+    }
+    pthread_cond_destroy(&progress);
+    pthread_mutex_destroy(&mutex);
+}
+
+void ParallelDecoder::unref() {
+    pthread_mutex_lock(&mutex);
+    int left = --refs;
+    pthread_mutex_unlock(&mutex);
+    if (left == 0) delete this;
+}
+
+void ParallelDecoder::start(int count, WorkerPool::Priority p) {
+    pthread_mutex_lock(&mutex);
+    helpers = count;
+    priority = p;
+    pthread_mutex_unlock(&mutex);
+
+    for (int i = 0; i < count; i++) {
+        pthread_mutex_lock(&mutex);
+        bool submit = wantHelper();
+        pthread_mutex_unlock(&mutex);
+        if (!submit) break;
+        submitHelper();
+    }
+}
+
+bool ParallelDecoder::wantHelper() {
+    if (cancelled || running >= helpers) return false;
+    // Only worth a job when a layer can decode at least half a window.
+    for (size_t i = 0; i < tasks.size(); i++) {
+        const Task& task = tasks[i];
+        if (decodable(task) && task.decoded + WINDOW / 2 <= task.consumed + WINDOW) {
+            running++;
+            refs++;
+            return true;
+        }
+    }
+    return false;
+}
+
+void ParallelDecoder::submitHelper() {
+    // A full queue just means that the blending thread does more of the work.
+    if (!WorkerPool::submit(EIO_Help, EIO_AfterHelp, this, priority)) {
+        pthread_mutex_lock(&mutex);
+        running--;
+        pthread_mutex_unlock(&mutex);
+        unref();
+    }
+}
+
+int ParallelDecoder::EIO_Help(eio_req* req) {
+    ParallelDecoder* decoder = static_cast<ParallelDecoder*>(req->data);
+
+    // Decodes the topmost layers with room in their windows until there are
+    // none; the blending thread queues helpers again as it consumes rows.
+    pthread_mutex_lock(&decoder->mutex);
+    while (!decoder->cancelled) {
+        Task* task = NULL;
+        for (size_t i = 0; i < decoder->tasks.size() && task == NULL; i++) {
+            if (decoder->decodable(decoder->tasks[i])) task = &decoder->tasks[i];
+        }
+        if (task == NULL) break;
+
+        task->busy = true;
+        pthread_mutex_unlock(&decoder->mutex);
+        decoder->fill(*task, decoder->height);
+        pthread_mutex_lock(&decoder->mutex);
+    }
+    decoder->running--;
+    pthread_mutex_unlock(&decoder->mutex);
+
+    decoder->unref();
+    return 0;
+}
+
+int ParallelDecoder::EIO_AfterHelp(eio_req* req) {
+    return 0;
+}
+
+void ParallelDecoder::fill(Task& task, unsigned long until) {
+    // Only the thread that claimed the layer touches the reader and pixels.
+    if (!task.started) {
+        task.pixels = (unsigned int*)BufferPool::allocate(WINDOW * width * 4);
+        if (task.pixels == NULL) {
+            task.reader->error = "Out of memory";
+        } else {
+            task.reader->begin(true);
+        }
+        task.started = true;
+    }
+
+    pthread_mutex_lock(&mutex);
+    // Without a window, there is nothing to wait for; the blending thread
+    // finds the reader's error.
+    if (task.pixels == NULL) task.decoded = height;
+    while (!cancelled) {
+        unsigned long y = task.decoded;
+        unsigned long limit = task.consumed + WINDOW;
+        if (limit > height) limit = height;
+        if (limit > until) limit = until;
+        if (y >= limit) break;
+        unsigned long end = y + PROGRESS_ROWS < limit ? y + PROGRESS_ROWS : limit;
+        pthread_mutex_unlock(&mutex);
+
+        for (; y < end; y++) {
+            task.reader->readRow((unsigned char*)(task.pixels + (y % WINDOW) * width));
+        }
+
+        pthread_mutex_lock(&mutex);
+        task.decoded = end;
+        pthread_cond_broadcast(&progress);
+    }
+    task.busy = false;
+    pthread_cond_broadcast(&progress);
+    pthread_mutex_unlock(&mutex);
+}
+
+const unsigned int* ParallelDecoder::row(size_t index, unsigned long y) {
+    Task& task = tasks[index];
+
+    pthread_mutex_lock(&mutex);
+    // Rows before this one are free for the next rows of the layer.
+    if (y > task.consumed) task.consumed = y;
+    while (task.decoded <= y) {
+        if (!task.busy) {
+            // Nobody is decoding the layer; rather than waiting for a
+            // helper, decode the row here.
+            task.busy = true;
+            pthread_mutex_unlock(&mutex);
+            fill(task, y + 1);
+            pthread_mutex_lock(&mutex);
+        } else {
+            pthread_cond_wait(&progress, &mutex);
+        }
+    }
+    const unsigned int* result = task.pixels != NULL ? task.pixels + (y % WINDOW) * width : NULL;
+    bool submit = wantHelper();
+    pthread_mutex_unlock(&mutex);
+
+    if (submit) submitHelper();
+    return result;
+}
+
+void ParallelDecoder::finish() {
+    pthread_mutex_lock(&mutex);
+    cancelled = true;
+    for (size_t i = 0; i < tasks.size(); i++) {
+        while (tasks[i].busy) pthread_cond_wait(&progress, &mutex);
+    }
+    pthread_mutex_unlock(&mutex);
+
+    unref();
+}
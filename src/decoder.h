@@ -0,0 +1,90 @@
+#ifndef NODE_IMG_SRC_DECODER_H
+#define NODE_IMG_SRC_DECODER_H
+
+#include <pthread.h>
+
+#include <vector>
+
+#include "reader.h"
+#include "workers.h"
+
+// Decodes the layers of one blend() concurrently, each into a small ring of
+// rows. Helper jobs on the WorkerPool decode layers in the background, and
+// the blending thread decodes a layer itself when nobody else is, so
+// progress never depends on a free worker. A layer is decoded at most
+// WINDOW rows past the last row the blending thread asked for, which bounds
+// memory to a few rows per layer and keeps layers that are covered by
+// opaque rows from being decoded much further than they are needed.
+class ParallelDecoder {
+public:
+    // Rows buffered per layer.
+    static const unsigned long WINDOW = 64;
+
+    // Doesn't take ownership of the readers, but they must stay alive until
+    // finish() returns.
+    ParallelDecoder(const std::vector<ImageReader*>& layers,
+                    unsigned long width, unsigned long height);
+
+    // Runs up to `helpers` helper jobs at a time.
+    void start(int helpers, WorkerPool::Priority priority);
+
+    // Returns row `y` of layer `index`, waiting for (or doing) its decoding.
+    // Rows have to be requested in order per layer; the row stays valid
+    // until the next call for the same layer. Returns NULL when memory ran
+    // out, which also sets the reader's error.
+    const unsigned int* row(size_t index, unsigned long y);
+
+    // Stops decoding and waits for layers that are still being decoded.
+    // Releases the caller's reference.
+    void finish();
+
+protected:
+    struct Task {
+        ImageReader* reader;
+        // WINDOW rows; row y lives in slot y % WINDOW.
+        unsigned int* pixels;
+        // Rows decoded so far.
+        unsigned long decoded;
+        // Last row requested; rows before it may be overwritten.
+        unsigned long consumed;
+        bool started;
+        // Somebody is decoding the layer.
+        bool busy;
+    };
+
+    ~ParallelDecoder();
+    void unref();
+
+    // Whether the layer has rows left to decode within its window.
+    inline bool decodable(const Task& task) const {
+        return !task.busy && task.decoded < height && task.decoded < task.consumed + WINDOW;
+    }
+
+    // Decodes rows of a claimed layer until row `until` is available or the
+    // window is full, then releases it.
+    void fill(Task& task, unsigned long until);
+
+    // Queues another helper job if fewer than `helpers` are running and
+    // there is enough work. Called with the mutex held; returns true when
+    // the caller has to submit the job after unlocking.
+    bool wantHelper();
+    void submitHelper();
+
+    static int EIO_Help(eio_req* req);
+    static int EIO_AfterHelp(eio_req* req);
+
+    std::vector<Task> tasks;
+    unsigned long width;
+    unsigned long height;
+    int helpers;
+    int running;
+    WorkerPool::Priority priority;
+    bool cancelled;
+    int refs;
+
+    // Guards the task states; `progress` is signaled as rows come in.
+    pthread_mutex_t mutex;
+    pthread_cond_t progress;
+};
+
+#endif
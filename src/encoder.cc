@@ -0,0 +1,779 @@
+#include <assert.h>
+#include <pthread.h>
+#include <cstdlib>
+#include <cstring>
+#include <stdio.h>
+#include <zlib.h>
+#include <setjmp.h>
+#include <jpeglib.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "encoder.h"
+#include "quantize.h"
+#include "pool.h"
+
+bool EncodeOptions::defaults() const {
+    EncodeOptions standard;
+    return type == standard.type && color == standard.color && level == standard.level &&
+           filter == standard.filter && strategy == standard.strategy;
+}
+
+int EncodeFormat::bytes() const {
+    switch (type) {
+        case PNG_COLOR_TYPE_RGB_ALPHA: return 4;
+        case PNG_COLOR_TYPE_RGB: return 3;
+        case PNG_COLOR_TYPE_GRAY_ALPHA: return 2;
+        default: return 1;
+    }
+}
+
+// Compressed size relative to the RGBA pixels, in 1/1024ths. Updated without
+// locking; a lost update only makes the next estimate a little worse.
+static volatile unsigned int compressionRatio = 256;
+
+EstimatedOutput::EstimatedOutput(EncodeOutput* out, size_t r)
+    : output(out), raw(r), length(0) {
+    size_t expected = (uint64_t)raw * compressionRatio / 1024;
+    // Leave some headroom so that most images fit without growing.
+    output->reserve(expected + expected / 4 + 1024);
+}
+
+void EstimatedOutput::write(const char* data, size_t size) {
+    output->write(data, size);
+    if (output->failed) failed = true;
+    length += size;
+}
+
+void EstimatedOutput::finish() {
+    if (raw == 0) return;
+    uint64_t observed = (uint64_t)length * 1024 / raw;
+    if (observed > 2048) observed = 2048;
+    compressionRatio = (compressionRatio * 7 + observed) / 8;
+}
+
+void encodeWritePNG(png_structp png_ptr, png_bytep data, png_size_t length) {
+    EncodeOutput* output = static_cast<EncodeOutput*>(png_get_io_ptr(png_ptr));
+    output->write((const char*)data, length);
+}
+
+static EncodeExecutor* executor = NULL;
+
+void encodeSetExecutor(EncodeExecutor* e) {
+    executor = e;
+}
+
+// Bands compressed at once by encodeParallelPNG(): one per executor thread.
+static int encodeThreads() {
+    return executor != NULL ? executor->threads() : 1;
+}
+
+static int colorType(EncodeColor color) {
+    switch (color) {
+        case COLOR_RGB: return PNG_COLOR_TYPE_RGB;
+        case COLOR_GRAY: return PNG_COLOR_TYPE_GRAY;
+        case COLOR_GRAY_ALPHA: return PNG_COLOR_TYPE_GRAY_ALPHA;
+        case COLOR_PALETTE: return PNG_COLOR_TYPE_PALETTE;
+        default: return PNG_COLOR_TYPE_RGB_ALPHA;
+    }
+}
+
+// Picks the smallest color type that represents the pixels exactly.
+static EncodeColor autoColor(const unsigned char* pixels, unsigned long width,
+                             unsigned long height, size_t stride, bool alpha,
+                             int colors) {
+    bool opaque = true;
+    bool gray = true;
+
+    // Distinct colors, counted until there are too many for a palette.
+    std::vector<unsigned int> table(1024);
+    std::vector<bool> used(1024, false);
+    int distinct = 0;
+
+    for (unsigned long y = 0; y < height; y++) {
+        const unsigned int* row = (const unsigned int*)(pixels + y * stride);
+        unsigned int last = 0;
+        for (unsigned long x = 0; x < width; x++) {
+            unsigned int pixel = row[x];
+            if (x > 0 && pixel == last) continue;
+            last = pixel;
+
+            unsigned int a = pixel >> 24;
+            if (a != 0xFF) opaque = false;
+            // Fully transparent pixels all become the same palette entry.
+            if (a == 0) pixel = 0;
+            else if (((pixel ^ (pixel >> 8)) & 0xFFFF) != 0) gray = false;
+
+            if (distinct > colors) continue;
+            size_t i = (pixel * 2654435761u) & 1023;
+            while (used[i] && table[i] != pixel) i = (i + 1) & 1023;
+            if (!used[i]) {
+                used[i] = true;
+                table[i] = pixel;
+                distinct++;
+            }
+        }
+        if (!gray && !opaque && distinct > colors) break;
+    }
+    if (!alpha) opaque = true;
+
+    if (gray && opaque) return COLOR_GRAY;
+    if (distinct <= colors) return COLOR_PALETTE;
+    if (gray) return COLOR_GRAY_ALPHA;
+    if (opaque) return COLOR_RGB;
+    return COLOR_RGBA;
+}
+
+// `colors` is the palette size for paletted images.
+static EncodeFormat resolveFormat(const EncodeOptions& options, int type, int colors) {
+    EncodeFormat format;
+    format.type = type;
+    format.level = options.level;
+
+    switch (options.filter) {
+        case FILTER_NONE: format.filter = PNG_FILTER_VALUE_NONE; break;
+        case FILTER_SUB: format.filter = PNG_FILTER_VALUE_SUB; break;
+        case FILTER_UP: format.filter = PNG_FILTER_VALUE_UP; break;
+        case FILTER_AVERAGE: format.filter = PNG_FILTER_VALUE_AVG; break;
+        case FILTER_PAETH: format.filter = PNG_FILTER_VALUE_PAETH; break;
+        case FILTER_ADAPTIVE: format.filter = -1; break;
+        default: format.filter = type == PNG_COLOR_TYPE_PALETTE ? PNG_FILTER_VALUE_NONE : -1;
+    }
+
+    switch (options.strategy) {
+        case STRATEGY_DEFAULT: format.strategy = Z_DEFAULT_STRATEGY; break;
+        case STRATEGY_FILTERED: format.strategy = Z_FILTERED; break;
+        case STRATEGY_HUFFMAN: format.strategy = Z_HUFFMAN_ONLY; break;
+        case STRATEGY_RLE: format.strategy = Z_RLE; break;
+        default:
+            if (type == PNG_COLOR_TYPE_PALETTE && colors <= 16) {
+                format.strategy = Z_RLE;
+            } else if (format.filter != PNG_FILTER_VALUE_NONE) {
+                // Same as libpng.
+                format.strategy = Z_FILTERED;
+            } else {
+                format.strategy = Z_DEFAULT_STRATEGY;
+            }
+    }
+
+    return format;
+}
+
+// Converts a row of RGBA pixels to the samples of a PNG color type. Paletted
+// rows are indices already.
+static void packRow(const unsigned char* src, unsigned long width, int type,
+                    unsigned char* dst) {
+    switch (type) {
+        case PNG_COLOR_TYPE_RGB_ALPHA:
+            memcpy(dst, src, width * 4);
+            break;
+        case PNG_COLOR_TYPE_RGB:
+            for (unsigned long x = 0; x < width; x++, src += 4, dst += 3) {
+                dst[0] = src[0];
+                dst[1] = src[1];
+                dst[2] = src[2];
+            }
+            break;
+        case PNG_COLOR_TYPE_GRAY:
+        case PNG_COLOR_TYPE_GRAY_ALPHA: {
+            bool alpha = type == PNG_COLOR_TYPE_GRAY_ALPHA;
+            for (unsigned long x = 0; x < width; x++, src += 4) {
+                // Rec. 601 luma; exact for pixels that are gray already.
+                *dst++ = (77 * src[0] + 150 * src[1] + 29 * src[2] + 128) >> 8;
+                if (alpha) *dst++ = src[3];
+            }
+        } break;
+        default:
+            memcpy(dst, src, width);
+    }
+}
+
+static png_structp beginPNG(unsigned long width, unsigned long height,
+                            const EncodeFormat& format, const unsigned int* palette,
+                            int colors, int transparent, EncodeOutput* output,
+                            png_infop* info) {
+    png_structp png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    png_infop info_ptr = png_create_info_struct(png_ptr);
+    assert(png_ptr && info_ptr);
+
+    png_set_compression_level(png_ptr, format.level);
+    png_set_compression_strategy(png_ptr, format.strategy);
+    png_set_compression_buffer_size(png_ptr, 32768);
+
+    static const int filters[] = { PNG_FILTER_NONE, PNG_FILTER_SUB, PNG_FILTER_UP,
+                                   PNG_FILTER_AVG, PNG_FILTER_PAETH };
+    png_set_filter(png_ptr, PNG_FILTER_TYPE_BASE,
+                   format.filter < 0 ? PNG_ALL_FILTERS : filters[format.filter]);
+
+    png_set_IHDR(png_ptr, info_ptr, width, height, 8, format.type,
+                 PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT,
+                 PNG_FILTER_TYPE_DEFAULT);
+
+    if (palette) {
+        png_color entries[256];
+        png_byte trans[256];
+        for (int i = 0; i < colors; i++) {
+            entries[i].red = palette[i] & 0xff;
+            entries[i].green = (palette[i] >> 8) & 0xff;
+            entries[i].blue = (palette[i] >> 16) & 0xff;
+            trans[i] = palette[i] >> 24;
+        }
+        png_set_PLTE(png_ptr, info_ptr, entries, colors);
+        if (transparent) {
+            png_set_tRNS(png_ptr, info_ptr, trans, transparent, NULL);
+        }
+    }
+
+    png_set_write_fn(png_ptr, (png_voidp)output, encodeWritePNG, NULL);
+    png_write_info(png_ptr, info_ptr);
+
+    *info = info_ptr;
+    return png_ptr;
+}
+
+// libjpeg compressor writing to an EncodeOutput through a fixed buffer.
+struct JPEGWriter {
+    struct jpeg_compress_struct info;
+    struct jpeg_error_mgr error;
+    struct jpeg_destination_mgr manager;
+    EncodeOutput* output;
+    // libjpeg calls exit() on errors by default; errorExitJPEG() jumps back
+    // to the setjmp() of the function that called into libjpeg instead, which
+    // marks the writer as failed.
+    jmp_buf jump;
+    bool failed;
+    JOCTET buffer[16384];
+};
+
+static void errorExitJPEG(j_common_ptr info) {
+    longjmp(static_cast<JPEGWriter*>(info->client_data)->jump, 1);
+}
+
+static void outputMessageJPEG(j_common_ptr info) {}
+
+static void initDestinationJPEG(j_compress_ptr info) {
+    JPEGWriter* writer = static_cast<JPEGWriter*>(info->client_data);
+    writer->manager.next_output_byte = writer->buffer;
+    writer->manager.free_in_buffer = sizeof(writer->buffer);
+}
+
+static boolean emptyBufferJPEG(j_compress_ptr info) {
+    JPEGWriter* writer = static_cast<JPEGWriter*>(info->client_data);
+    writer->output->write((const char*)writer->buffer, sizeof(writer->buffer));
+    initDestinationJPEG(info);
+    return TRUE;
+}
+
+static void termDestinationJPEG(j_compress_ptr info) {
+    JPEGWriter* writer = static_cast<JPEGWriter*>(info->client_data);
+    size_t used = sizeof(writer->buffer) - writer->manager.free_in_buffer;
+    if (used > 0) writer->output->write((const char*)writer->buffer, used);
+}
+
+// `type` is PNG_COLOR_TYPE_RGB or PNG_COLOR_TYPE_GRAY, matching the rows
+// that packRow() produces.
+static JPEGWriter* beginJPEG(unsigned long width, unsigned long height, int type,
+                             int quality, EncodeOutput* output) {
+    JPEGWriter* writer = new JPEGWriter();
+    writer->output = output;
+    writer->failed = false;
+    writer->info.err = jpeg_std_error(&writer->error);
+    writer->error.error_exit = errorExitJPEG;
+    writer->error.output_message = outputMessageJPEG;
+    // Kept by jpeg_create_compress().
+    writer->info.client_data = writer;
+    if (setjmp(writer->jump)) {
+        writer->failed = true;
+        return writer;
+    }
+    jpeg_create_compress(&writer->info);
+
+    writer->manager.init_destination = initDestinationJPEG;
+    writer->manager.empty_output_buffer = emptyBufferJPEG;
+    writer->manager.term_destination = termDestinationJPEG;
+    writer->info.dest = &writer->manager;
+
+    writer->info.image_width = width;
+    writer->info.image_height = height;
+    bool gray = type == PNG_COLOR_TYPE_GRAY;
+    writer->info.input_components = gray ? 1 : 3;
+    writer->info.in_color_space = gray ? JCS_GRAYSCALE : JCS_RGB;
+    jpeg_set_defaults(&writer->info);
+    jpeg_set_quality(&writer->info, quality, TRUE);
+    jpeg_start_compress(&writer->info, TRUE);
+    return writer;
+}
+
+RowEncoder::RowEncoder(unsigned long w, unsigned long height, bool alpha,
+                       const EncodeOptions& options, EncodeOutput* output)
+    : estimated(output, w * height * 4), jpeg(NULL), png_ptr(NULL),
+      info_ptr(NULL), width(w) {
+    EncodeColor color = options.color;
+    if (options.type == TYPE_JPEG && !alpha) {
+        // JPEG only distinguishes gray from color.
+        bool gray = color == COLOR_GRAY || color == COLOR_GRAY_ALPHA;
+        format.type = gray ? PNG_COLOR_TYPE_GRAY : PNG_COLOR_TYPE_RGB;
+        jpeg = beginJPEG(width, height, format.type, options.quality, &estimated);
+    } else {
+        if (color == COLOR_SOURCE) color = alpha ? COLOR_RGBA : COLOR_RGB;
+        assert(color != COLOR_AUTO && color != COLOR_PALETTE);
+
+        format = resolveFormat(options, colorType(color), 0);
+        png_ptr = beginPNG(width, height, format, NULL, 0, 0, &estimated, &info_ptr);
+    }
+    packed = (unsigned char*)malloc(width * format.bytes());
+    assert(packed);
+}
+
+RowEncoder::~RowEncoder() {
+    if (jpeg != NULL) {
+        jpeg_destroy_compress(&jpeg->info);
+        delete jpeg;
+    } else {
+        png_destroy_write_struct(&png_ptr, &info_ptr);
+    }
+    free(packed);
+}
+
+void RowEncoder::write(const unsigned int* row) {
+    packRow((const unsigned char*)row, width, format.type, packed);
+    if (jpeg != NULL) {
+        if (jpeg->failed || setjmp(jpeg->jump)) {
+            jpeg->failed = true;
+            return;
+        }
+        JSAMPROW rows[] = { packed };
+        jpeg_write_scanlines(&jpeg->info, rows, 1);
+    } else {
+        png_write_row(png_ptr, packed);
+    }
+}
+
+void RowEncoder::finish() {
+    if (jpeg != NULL) {
+        if (jpeg->failed || setjmp(jpeg->jump)) {
+            jpeg->failed = true;
+            return;
+        }
+        jpeg_finish_compress(&jpeg->info);
+    } else {
+        png_write_end(png_ptr, NULL);
+    }
+    estimated.finish();
+}
+
+const char* RowEncoder::error() const {
+    if (estimated.failed) return "Out of memory";
+    return jpeg != NULL && jpeg->failed ? "JPEG encoding failed" : NULL;
+}
+
+static void encodePalette(const unsigned char* pixels, unsigned long width,
+                          unsigned long height, size_t stride,
+                          const EncodeOptions& options, bool parallel,
+                          EncodeOutput* output) {
+    Quantizer quantizer(options.colors);
+    for (unsigned long y = 0; y < height; y++) {
+        quantizer.add((const unsigned int*)(pixels + y * stride), width);
+    }
+    quantizer.finish();
+
+    int colors = quantizer.palette.size();
+    const unsigned int* palette = &quantizer.palette[0];
+    EncodeFormat format = resolveFormat(options, PNG_COLOR_TYPE_PALETTE, colors);
+
+    // Without memory for the indices, the rows are remapped one at a time.
+    unsigned char* indices = parallel ?
+        (unsigned char*)BufferPool::allocate(width * height) : NULL;
+    if (indices != NULL) {
+        for (unsigned long y = 0; y < height; y++) {
+            quantizer.remap((const unsigned int*)(pixels + y * stride), indices + y * width, width);
+        }
+        encodeParallelPNG(indices, width, height, width, format, palette,
+                          colors, quantizer.transparent, encodeThreads(), output);
+        BufferPool::release(indices);
+        return;
+    }
+
+    png_infop info_ptr;
+    png_structp png_ptr = beginPNG(width, height, format, palette, colors,
+                                   quantizer.transparent, output, &info_ptr);
+
+    png_bytep row = (png_bytep)malloc(width);
+    assert(row);
+    for (unsigned long y = 0; y < height; y++) {
+        quantizer.remap((const unsigned int*)(pixels + y * stride), row, width);
+        png_write_row(png_ptr, row);
+    }
+    free(row);
+
+    png_write_end(png_ptr, NULL);
+    png_destroy_write_struct(&png_ptr, &info_ptr);
+}
+
+static bool encodeParallel(unsigned long width, unsigned long height) {
+    return width * height >= PARALLEL_ENCODE_PIXELS && encodeThreads() > 1;
+}
+
+bool encodeNeedsImage(unsigned long width, unsigned long height, bool alpha,
+                      const EncodeOptions& options) {
+    // Whether JPEG can be used depends on the pixels unless the image is
+    // known to be opaque. Fixed color types are streamed through a single
+    // threaded RowEncoder unless the image is large enough to be compressed
+    // in parallel bands, which needs all rows at once.
+    if (options.type == TYPE_JPEG) return alpha;
+    return options.color == COLOR_AUTO || options.color == COLOR_PALETTE ||
+           encodeParallel(width, height);
+}
+
+void encodePNG(const unsigned char* pixels, unsigned long width,
+               unsigned long height, size_t stride, bool alpha,
+               const EncodeOptions& options, EncodeOutput* output) {
+    bool parallel = encodeParallel(width, height);
+
+    EncodeOptions resolved = options;
+    resolved.type = TYPE_PNG;
+    if (resolved.color == COLOR_AUTO) {
+        resolved.color = autoColor(pixels, width, height, stride, alpha, options.colors);
+    } else if (resolved.color == COLOR_SOURCE) {
+        resolved.color = alpha ? COLOR_RGBA : COLOR_RGB;
+    }
+
+    if (resolved.color == COLOR_PALETTE) {
+        EstimatedOutput estimated(output, width * height * 4);
+        encodePalette(pixels, width, height, stride, resolved, parallel, &estimated);
+        estimated.finish();
+    } else if (parallel) {
+        EstimatedOutput estimated(output, width * height * 4);
+        EncodeFormat format = resolveFormat(resolved, colorType(resolved.color), 0);
+        encodeParallelPNG(pixels, width, height, stride, format, NULL, 0, 0,
+                          encodeThreads(), &estimated);
+        estimated.finish();
+    } else {
+        RowEncoder encoder(width, height, alpha, resolved, output);
+        for (unsigned long y = 0; y < height; y++) {
+            encoder.write((const unsigned int*)(pixels + y * stride));
+        }
+        encoder.finish();
+    }
+}
+
+static bool isOpaque(const unsigned char* pixels, unsigned long width,
+                     unsigned long height, size_t stride) {
+    for (unsigned long y = 0; y < height; y++) {
+        const unsigned int* row = (const unsigned int*)(pixels + y * stride);
+        for (unsigned long x = 0; x < width; x++) {
+            if ((row[x] >> 24) != 0xFF) return false;
+        }
+    }
+    return true;
+}
+
+const char* encodeImage(const unsigned char* pixels, unsigned long width,
+                        unsigned long height, size_t stride, bool alpha,
+                        const EncodeOptions& options, EncodeOutput* output) {
+    if (options.type == TYPE_JPEG && (!alpha || isOpaque(pixels, width, height, stride))) {
+        RowEncoder encoder(width, height, false, options, output);
+        for (unsigned long y = 0; y < height; y++) {
+            encoder.write((const unsigned int*)(pixels + y * stride));
+        }
+        encoder.finish();
+        return encoder.error();
+    }
+    encodePNG(pixels, width, height, stride, alpha, options, output);
+    return output->failed ? "Out of memory" : NULL;
+}
+
+
+// Size of the deflate window, which is also the useful dictionary size.
+static const size_t WINDOW_SIZE = 32768;
+// Bands shorter than this aren't worth a thread.
+static const unsigned long MIN_BAND_ROWS = 16;
+
+struct Band {
+    const unsigned char* pixels;
+    size_t stride;
+    unsigned long width;
+    unsigned long begin;
+    unsigned long end;
+    const EncodeFormat* format;
+    bool last;
+
+    std::string compressed;
+    uLong adler;
+    size_t length;
+};
+
+static inline unsigned char paeth(int a, int b, int c) {
+    int p = a + b - c;
+    int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+    if (pa <= pb && pa <= pc) return a;
+    if (pb <= pc) return b;
+    return c;
+}
+
+// Filters `row` into `out` (filter type byte followed by the filtered row).
+// Adaptive filtering (`filter` < 0) uses the filter with the smallest sum of
+// absolute values, like libpng. `prev` is NULL for the first row of the
+// image.
+static void filterRow(const unsigned char* row, const unsigned char* prev,
+                      size_t rowbytes, int bpp, int filter, unsigned char* out,
+                      unsigned char* scratch) {
+    if (filter == PNG_FILTER_VALUE_NONE) {
+        out[0] = 0;
+        memcpy(out + 1, row, rowbytes);
+        return;
+    }
+
+    unsigned long best = ~0UL;
+    int first = filter < 0 ? 0 : filter;
+    int last = filter < 0 ? 4 : filter;
+    for (int type = first; type <= last; type++) {
+        unsigned char* candidate = filter < 0 ? scratch + type * (rowbytes + 1) : out;
+        candidate[0] = type;
+        unsigned long sum = 0;
+        for (size_t i = 0; i < rowbytes; i++) {
+            int a = i >= (size_t)bpp ? row[i - bpp] : 0;
+            int b = prev ? prev[i] : 0;
+            int c = prev && i >= (size_t)bpp ? prev[i - bpp] : 0;
+            unsigned char value = row[i];
+            switch (type) {
+                case 1: value -= a; break;
+                case 2: value -= b; break;
+                case 3: value -= (a + b) >> 1; break;
+                case 4: value -= paeth(a, b, c); break;
+            }
+            candidate[i + 1] = value;
+            sum += value < 128 ? value : 256 - value;
+        }
+        if (sum < best && candidate != out) {
+            best = sum;
+            memcpy(out, candidate, rowbytes + 1);
+        }
+    }
+}
+
+static void deflateInto(z_stream* stream, const unsigned char* data, size_t length,
+                        int flush, std::string& output) {
+    unsigned char buffer[16384];
+    stream->next_in = (Bytef*)data;
+    stream->avail_in = length;
+    do {
+        stream->next_out = buffer;
+        stream->avail_out = sizeof(buffer);
+        deflate(stream, flush);
+        output.append((const char*)buffer, sizeof(buffer) - stream->avail_out);
+    } while (stream->avail_out == 0);
+}
+
+static void compressBand(Band* band) {
+    const EncodeFormat& format = *band->format;
+    int bpp = format.bytes();
+    size_t rowbytes = band->width * bpp;
+
+    unsigned char* rows = (unsigned char*)malloc(2 * rowbytes + 6 * (rowbytes + 1));
+    assert(rows);
+    unsigned char* row = rows;
+    unsigned char* prev = rows + rowbytes;
+    unsigned char* filtered = rows + 2 * rowbytes;
+    unsigned char* scratch = filtered + rowbytes + 1;
+
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    int status = deflateInit2(&stream, format.level, Z_DEFLATED, -15, 8, format.strategy);
+    assert(status == Z_OK);
+
+    // Filter the tail of the previous band again to prime the window with
+    // exactly the bytes that precede this band in the stream.
+    unsigned long y = band->begin;
+    if (band->begin > 0) {
+        unsigned long count = (WINDOW_SIZE + rowbytes) / (rowbytes + 1);
+        unsigned long start = band->begin > count ? band->begin - count : 0;
+        std::string dictionary;
+        if (start > 0) packRow(band->pixels + (start - 1) * band->stride, band->width, format.type, prev);
+        for (unsigned long i = start; i < band->begin; i++) {
+            packRow(band->pixels + i * band->stride, band->width, format.type, row);
+            filterRow(row, i > 0 ? prev : NULL, rowbytes, bpp, format.filter, filtered, scratch);
+            dictionary.append((const char*)filtered, rowbytes + 1);
+            std::swap(row, prev);
+        }
+        if (dictionary.size() > WINDOW_SIZE) {
+            dictionary.erase(0, dictionary.size() - WINDOW_SIZE);
+        }
+        deflateSetDictionary(&stream, (const Bytef*)dictionary.data(), dictionary.size());
+    }
+
+    band->adler = adler32(0L, Z_NULL, 0);
+    band->length = 0;
+    for (; y < band->end; y++) {
+        packRow(band->pixels + y * band->stride, band->width, format.type, row);
+        filterRow(row, y > 0 ? prev : NULL, rowbytes, bpp, format.filter, filtered, scratch);
+        band->adler = adler32(band->adler, filtered, rowbytes + 1);
+        band->length += rowbytes + 1;
+        deflateInto(&stream, filtered, rowbytes + 1, Z_NO_FLUSH, band->compressed);
+        std::swap(row, prev);
+    }
+
+    // Sync flushes end on a byte boundary, so the next band can follow.
+    deflateInto(&stream, NULL, 0, band->last ? Z_FINISH : Z_SYNC_FLUSH, band->compressed);
+    deflateEnd(&stream);
+    free(rows);
+}
+
+// The bands of one encodeParallelPNG() call. Whoever is free claims the next
+// band: the calling thread and the helper tasks it queued on the executor.
+// Helpers that only start after all bands were claimed just drop their
+// reference.
+struct BandJob {
+    std::vector<Band> bands;
+    // Next band nobody claimed yet.
+    size_t next;
+    size_t finished;
+    int refs;
+    // Guards the counters; `done` is signaled as bands are finished.
+    pthread_mutex_t mutex;
+    pthread_cond_t done;
+};
+
+static void compressBands(BandJob* job) {
+    pthread_mutex_lock(&job->mutex);
+    while (job->next < job->bands.size()) {
+        Band& band = job->bands[job->next++];
+        pthread_mutex_unlock(&job->mutex);
+        compressBand(&band);
+        pthread_mutex_lock(&job->mutex);
+        job->finished++;
+        pthread_cond_signal(&job->done);
+    }
+    pthread_mutex_unlock(&job->mutex);
+}
+
+static void unrefBands(BandJob* job) {
+    pthread_mutex_lock(&job->mutex);
+    int left = --job->refs;
+    pthread_mutex_unlock(&job->mutex);
+    if (left > 0) return;
+
+    pthread_cond_destroy(&job->done);
+    pthread_mutex_destroy(&job->mutex);
+    delete job;
+}
+
+static void helpCompressBands(void* data) {
+    BandJob* job = static_cast<BandJob*>(data);
+    compressBands(job);
+    unrefBands(job);
+}
+
+static inline void putUint32(unsigned char* dst, uint32_t value) {
+    dst[0] = value >> 24;
+    dst[1] = value >> 16;
+    dst[2] = value >> 8;
+    dst[3] = value;
+}
+
+static void writeChunk(EncodeOutput* output, const char* type,
+                       const unsigned char* data, size_t length) {
+    unsigned char header[8];
+    putUint32(header, length);
+    memcpy(header + 4, type, 4);
+    output->write((const char*)header, 8);
+    if (length) output->write((const char*)data, length);
+
+    unsigned char crc[4];
+    uLong sum = crc32(0L, (const Bytef*)type, 4);
+    if (length) sum = crc32(sum, data, length);
+    putUint32(crc, sum);
+    output->write((const char*)crc, 4);
+}
+
+void encodeParallelPNG(const unsigned char* pixels, unsigned long width,
+                       unsigned long height, size_t stride, const EncodeFormat& format,
+                       const unsigned int* palette, int colors, int transparent,
+                       int threads, EncodeOutput* output) {
+    unsigned long count = (height + MIN_BAND_ROWS - 1) / MIN_BAND_ROWS;
+    if (count > (unsigned long)threads) count = threads;
+    if (count < 1) count = 1;
+    unsigned long rows = (height + count - 1) / count;
+
+    BandJob* job = new BandJob();
+    job->next = 0;
+    job->finished = 0;
+    pthread_mutex_init(&job->mutex, NULL);
+    pthread_cond_init(&job->done, NULL);
+    std::vector<Band>& bands = job->bands;
+    bands.resize(count);
+    for (unsigned long i = 0; i < count; i++) {
+        Band& band = bands[i];
+        band.pixels = pixels;
+        band.stride = stride;
+        band.width = width;
+        band.begin = i * rows;
+        band.end = (i + 1) * rows < height ? (i + 1) * rows : height;
+        band.format = &format;
+        band.last = i == count - 1;
+    }
+
+    // The calling thread compresses bands too, so a busy executor only
+    // means that it does more of them itself.
+    job->refs = count;
+    for (unsigned long i = 1; i < count; i++) {
+        if (executor == NULL || !executor->submit(helpCompressBands, job)) {
+            // A full queue; drop the references of the helpers not queued.
+            for (; i < count; i++) unrefBands(job);
+            break;
+        }
+    }
+    compressBands(job);
+    pthread_mutex_lock(&job->mutex);
+    while (job->finished < count) pthread_cond_wait(&job->done, &job->mutex);
+    pthread_mutex_unlock(&job->mutex);
+
+    static const unsigned char signature[8] = { 137, 80, 78, 71, 13, 10, 26, 10 };
+    output->write((const char*)signature, 8);
+
+    unsigned char ihdr[13];
+    putUint32(ihdr, width);
+    putUint32(ihdr + 4, height);
+    ihdr[8] = 8;
+    ihdr[9] = format.type;
+    ihdr[10] = ihdr[11] = ihdr[12] = 0;
+    writeChunk(output, "IHDR", ihdr, 13);
+
+    if (palette) {
+        unsigned char plte[768], trns[256];
+        for (int i = 0; i < colors; i++) {
+            plte[3 * i] = palette[i] & 0xff;
+            plte[3 * i + 1] = (palette[i] >> 8) & 0xff;
+            plte[3 * i + 2] = (palette[i] >> 16) & 0xff;
+            trns[i] = palette[i] >> 24;
+        }
+        writeChunk(output, "PLTE", plte, 3 * colors);
+        if (transparent) writeChunk(output, "tRNS", trns, transparent);
+    }
+
+    // One IDAT per band, wrapped in the zlib header and checksum.
+    uLong adler = adler32(0L, Z_NULL, 0);
+    for (unsigned long i = 0; i < count; i++) {
+        std::string& data = bands[i].compressed;
+        adler = adler32_combine(adler, bands[i].adler, bands[i].length);
+        if (i == 0) {
+            // Deflate with a 32K window; the level is informational.
+            unsigned char header[2] = { 0x78, 0 };
+            int level = format.level;
+            header[1] = (level < 2 ? 0 : level < 6 ? 1 : level == 6 ? 2 : 3) << 6;
+            header[1] += 31 - (header[0] * 256 + header[1]) % 31;
+            data.insert(0, (const char*)header, 2);
+        }
+        if (i == count - 1) {
+            unsigned char trailer[4];
+            putUint32(trailer, adler);
+            data.append((const char*)trailer, 4);
+        }
+        writeChunk(output, "IDAT", (const unsigned char*)data.data(), data.size());
+    }
+
+    writeChunk(output, "IEND", NULL, 0);
+    unrefBands(job);
+}
@@ -0,0 +1,196 @@
+#ifndef NODE_IMG_SRC_ENCODER_H
+#define NODE_IMG_SRC_ENCODER_H
+
+#include <png.h>
+#include <stdint.h>
+
+#include <cstddef>
+
+struct JPEGWriter;
+
+enum EncodeType {
+    TYPE_PNG,
+    // JPEG for opaque images; images with transparent pixels stay PNG.
+    TYPE_JPEG
+};
+
+enum EncodeColor {
+    // RGBA, or RGB when the source is known to be opaque.
+    COLOR_SOURCE,
+    // Smallest lossless type for the image content.
+    COLOR_AUTO,
+    COLOR_RGBA,
+    COLOR_RGB,
+    COLOR_GRAY,
+    COLOR_GRAY_ALPHA,
+    COLOR_PALETTE
+};
+
+enum EncodeFilter {
+    // No filter for paletted images, adaptive otherwise.
+    FILTER_AUTO,
+    FILTER_NONE,
+    FILTER_SUB,
+    FILTER_UP,
+    FILTER_AVERAGE,
+    FILTER_PAETH,
+    // Picks the filter per row, like libpng does by default.
+    FILTER_ADAPTIVE
+};
+
+enum EncodeStrategy {
+    // Run length encoding for small palettes, otherwise filtered when the rows
+    // are filtered.
+    STRATEGY_AUTO,
+    STRATEGY_DEFAULT,
+    STRATEGY_FILTERED,
+    STRATEGY_HUFFMAN,
+    STRATEGY_RLE
+};
+
+// Output options shared by blend() and Image#asPNG.
+struct EncodeOptions {
+    EncodeOptions() : type(TYPE_PNG), quality(85), color(COLOR_SOURCE),
+        colors(256), level(1), filter(FILTER_AUTO), strategy(STRATEGY_AUTO) {}
+
+    EncodeType type;
+    // JPEG quality from 1 to 100.
+    int quality;
+    EncodeColor color;
+    // Upper bound for the palette size of paletted images.
+    int colors;
+    // zlib compression level.
+    int level;
+    EncodeFilter filter;
+    EncodeStrategy strategy;
+
+    // Whether these are the options used when none are passed.
+    bool defaults() const;
+};
+
+// Encoder settings for one image, resolved from the EncodeOptions.
+struct EncodeFormat {
+    // PNG_COLOR_TYPE_*
+    int type;
+    // PNG_FILTER_VALUE_*, or -1 to pick one per row.
+    int filter;
+    int level;
+    // Z_* strategy
+    int strategy;
+
+    // Bytes per pixel.
+    int bytes() const;
+};
+
+// Receives the encoded bytes.
+class EncodeOutput {
+public:
+    EncodeOutput() : failed(false) {}
+    virtual ~EncodeOutput() {}
+    virtual void write(const char* data, size_t length) = 0;
+    // Hint with the expected total size, given before the first write. It is
+    // only a hint, so outputs ignore it when memory runs out.
+    virtual void reserve(size_t length) {}
+
+    // Set by outputs that ran out of memory; later writes are dropped.
+    // encodeImage() and RowEncoder report it as an error.
+    bool failed;
+};
+
+// Forwards to another output, which is sized up front from the compression
+// ratio of earlier images. finish() updates that ratio.
+class EstimatedOutput : public EncodeOutput {
+public:
+    // `raw` is the size of the RGBA pixels being encoded.
+    EstimatedOutput(EncodeOutput* output, size_t raw);
+
+    void write(const char* data, size_t length);
+    void finish();
+
+protected:
+    EncodeOutput* output;
+    size_t raw;
+    size_t length;
+};
+
+// libpng write callback for an EncodeOutput passed as the io pointer.
+void encodeWritePNG(png_structp png_ptr, png_bytep data, png_size_t length);
+
+// Whole images with at least this many pixels are compressed on multiple
+// threads.
+const unsigned long PARALLEL_ENCODE_PIXELS = 512 * 512;
+
+// Whether encodeImage() needs all pixels at once, either to pick the output
+// format or to compress bands in parallel. Otherwise, the rows can be
+// streamed through a RowEncoder.
+bool encodeNeedsImage(unsigned long width, unsigned long height, bool alpha,
+                      const EncodeOptions& options);
+
+// Encodes like encodePNG(), except that JPEG output is used when requested
+// and all pixels turn out to be opaque. Returns an error message when the
+// encoder failed, otherwise NULL.
+const char* encodeImage(const unsigned char* pixels, unsigned long width,
+                        unsigned long height, size_t stride, bool alpha,
+                        const EncodeOptions& options, EncodeOutput* output);
+
+// Encodes `height` rows of RGBA pixels, `stride` bytes apart, as PNG. `alpha`
+// is false when the pixels are known to be opaque. The output type option is
+// ignored.
+void encodePNG(const unsigned char* pixels, unsigned long width,
+               unsigned long height, size_t stride, bool alpha,
+               const EncodeOptions& options, EncodeOutput* output);
+
+// Encodes RGBA rows one at a time with libpng, or with libjpeg for JPEG
+// output of opaque images. Only for options that don't need the whole image.
+class RowEncoder {
+public:
+    RowEncoder(unsigned long width, unsigned long height, bool alpha,
+               const EncodeOptions& options, EncodeOutput* output);
+    ~RowEncoder();
+
+    void write(const unsigned int* row);
+    void finish();
+    // Error message once the encoder failed, otherwise NULL. Later rows are
+    // ignored then.
+    const char* error() const;
+
+protected:
+    EstimatedOutput estimated;
+    // Set instead of the libpng structs for JPEG output.
+    JPEGWriter* jpeg;
+    png_structp png_ptr;
+    png_infop info_ptr;
+    EncodeFormat format;
+    unsigned long width;
+    unsigned char* packed;
+};
+
+// Runs encoder work on other threads. encodeParallelPNG() uses it to compress
+// bands concurrently; the module installs one backed by the WorkerPool.
+class EncodeExecutor {
+public:
+    virtual ~EncodeExecutor() {}
+    // Threads that can work on one image at once, including the caller.
+    virtual int threads() = 0;
+    // Runs `task(data)` on another thread. Returns false, without running
+    // it, when the task can't be queued.
+    virtual bool submit(void (*task)(void* data), void* data) = 0;
+};
+
+// Sets the executor for parallel compression, or NULL to compress on the
+// calling thread only. Not thread safe; set it before encoding anything.
+void encodeSetExecutor(EncodeExecutor* executor);
+
+// Writes a PNG with the IDAT stream compressed in up to `threads` horizontal
+// bands, by the calling thread and tasks on the EncodeExecutor. Each band is
+// filtered and deflated independently (using
+// the end of the previous band as dictionary) and terminated with a sync
+// flush, so the concatenation is a single valid zlib stream. `pixels` are
+// RGBA unless the format is paletted, in which case they are indices into
+// `palette`.
+void encodeParallelPNG(const unsigned char* pixels, unsigned long width,
+                       unsigned long height, size_t stride, const EncodeFormat& format,
+                       const unsigned int* palette, int colors, int transparent,
+                       int threads, EncodeOutput* output);
+
+#endif
@@ -0,0 +1,46 @@
+#ifndef NODE_IMG_SRC_HASH_H
+#define NODE_IMG_SRC_HASH_H
+
+#include <stdint.h>
+#include <cstring>
+
+// MurmurHash64A by Austin Appleby (public domain).
+inline uint64_t hash64(const char* data, size_t length, uint64_t seed = 0) {
+    const uint64_t m = 0xc6a4a7935bd1e995ULL;
+    const int r = 47;
+
+    uint64_t h = seed ^ (length * m);
+
+    const char* end = data + (length & ~(size_t)7);
+    for (; data != end; data += 8) {
+        uint64_t k;
+        memcpy(&k, data, 8);
+
+        k *= m;
+        k ^= k >> r;
+        k *= m;
+
+        h ^= k;
+        h *= m;
+    }
+
+    const unsigned char* tail = (const unsigned char*)data;
+    switch (length & 7) {
+        case 7: h ^= uint64_t(tail[6]) << 48;
+        case 6: h ^= uint64_t(tail[5]) << 40;
+        case 5: h ^= uint64_t(tail[4]) << 32;
+        case 4: h ^= uint64_t(tail[3]) << 24;
+        case 3: h ^= uint64_t(tail[2]) << 16;
+        case 2: h ^= uint64_t(tail[1]) << 8;
+        case 1: h ^= uint64_t(tail[0]);
+                h *= m;
+    };
+
+    h ^= h >> r;
+    h *= m;
+    h ^= h >> r;
+
+    return h;
+}
+
+#endif
@@ -0,0 +1,137 @@
+#include <png.h>
+#include <cstring>
+
+#include "header.h"
+
+static inline unsigned long readUint32(const unsigned char* data) {
+    return ((unsigned long)data[0] << 24) | (data[1] << 16) | (data[2] << 8) | data[3];
+}
+
+static inline unsigned int readUint16(const unsigned char* data) {
+    return (data[0] << 8) | data[1];
+}
+
+bool ImageHeader::read(const char* data, size_t length) {
+    const unsigned char* bytes = (const unsigned char*)data;
+    if (length >= 8 && png_sig_cmp((png_bytep)bytes, 0, 8) == 0) {
+        return readPNG(bytes, length);
+    } else if (length >= 3 && bytes[0] == 0xFF && bytes[1] == 0xD8 && bytes[2] == 0xFF) {
+        return readJPEG(bytes, length);
+    }
+    return false;
+}
+
+bool ImageHeader::readPNG(const unsigned char* data, size_t length) {
+    // IHDR has to come first.
+    size_t pos = 8;
+    if (length < pos + 8 + 13 + 4 || readUint32(data + pos) != 13 ||
+        memcmp(data + pos + 4, "IHDR", 4) != 0) {
+        return false;
+    }
+
+    const unsigned char* ihdr = data + pos + 8;
+    width = readUint32(ihdr);
+    height = readUint32(ihdr + 4);
+    depth = ihdr[8];
+    color = ihdr[9];
+    interlaced = ihdr[12] != 0;
+    if (width == 0 || height == 0 || width > PNG_UINT_31_MAX || height > PNG_UINT_31_MAX) {
+        return false;
+    }
+
+    switch (color) {
+        case PNG_COLOR_TYPE_GRAY:
+            if (depth != 1 && depth != 2 && depth != 4 && depth != 8 && depth != 16) return false;
+            break;
+        case PNG_COLOR_TYPE_PALETTE:
+            if (depth != 1 && depth != 2 && depth != 4 && depth != 8) return false;
+            break;
+        case PNG_COLOR_TYPE_RGB:
+        case PNG_COLOR_TYPE_GRAY_ALPHA:
+        case PNG_COLOR_TYPE_RGB_ALPHA:
+            if (depth != 8 && depth != 16) return false;
+            break;
+        default:
+            return false;
+    }
+    alpha = (color & PNG_COLOR_MASK_ALPHA) != 0;
+
+    // Walk the chunks until the image data for the palette and transparency.
+    pos += 8 + 13 + 4;
+    while (pos + 8 <= length) {
+        unsigned long size = readUint32(data + pos);
+        const unsigned char* type = data + pos + 4;
+        if (size > length - pos - 8) return false;
+
+        if (memcmp(type, "IDAT", 4) == 0 || memcmp(type, "IEND", 4) == 0) {
+            break;
+        } else if (memcmp(type, "PLTE", 4) == 0) {
+            if (size % 3 != 0 || size == 0 || size > 256 * 3) return false;
+            colors = size / 3;
+        } else if (memcmp(type, "tRNS", 4) == 0) {
+            alpha = true;
+        }
+        pos += 8 + size + 4;
+    }
+
+    format = FORMAT_PNG;
+    return color != PNG_COLOR_TYPE_PALETTE || colors > 0;
+}
+
+bool ImageHeader::readJPEG(const unsigned char* data, size_t length) {
+    size_t pos = 2;
+    while (pos + 4 <= length) {
+        if (data[pos] != 0xFF) return false;
+        unsigned char marker = data[pos + 1];
+        if (marker == 0xFF) {
+            // Fill byte.
+            pos++;
+            continue;
+        }
+        pos += 2;
+
+        // Markers without a segment.
+        if (marker == 0x01 || (marker >= 0xD0 && marker <= 0xD7)) continue;
+        if (marker == 0xD9 || marker == 0xDA) return false;
+
+        unsigned int size = readUint16(data + pos);
+        if (size < 2 || pos + size > length) return false;
+
+        // SOF0 to SOF15, except DHT, JPG and DAC.
+        if (marker >= 0xC0 && marker <= 0xCF && marker != 0xC4 &&
+            marker != 0xC8 && marker != 0xCC) {
+            if (size < 8) return false;
+            depth = data[pos + 2];
+            height = readUint16(data + pos + 3);
+            width = readUint16(data + pos + 5);
+            color = data[pos + 7];
+            // Progressive frames.
+            interlaced = marker == 0xC2 || marker == 0xC6 || marker == 0xCA || marker == 0xCE;
+            if (width == 0 || height == 0) return false;
+            if (color != 1 && color != 3 && color != 4) return false;
+            format = FORMAT_JPEG;
+            return true;
+        }
+        pos += size;
+    }
+    return false;
+}
+
+uint64_t ImageHeader::maxPixels = ImageHeader::DEFAULT_MAX_PIXELS;
+
+bool ImageHeader::allowed(unsigned long width, unsigned long height) {
+    if (width == 0 || height == 0) return true;
+    // Dimensions from headers have at most 31 bits, but resize() sizes and
+    // 64-bit longs can be larger.
+    if (width > 0xFFFFFFFFul || height > 0xFFFFFFFFul) return false;
+    uint64_t pixels = (uint64_t)width * height;
+    return pixels <= maxPixels && pixels <= (size_t)-1 / 4;
+}
+
+unsigned long ImageHeader::scaledWidth(int scale) const {
+    return (width + scale - 1) / scale;
+}
+
+unsigned long ImageHeader::scaledHeight(int scale) const {
+    return (height + scale - 1) / scale;
+}
@@ -0,0 +1,56 @@
+#ifndef NODE_IMG_SRC_HEADER_H
+#define NODE_IMG_SRC_HEADER_H
+
+#include <stdint.h>
+
+#include <cstddef>
+
+// Image metadata parsed straight from the encoded bytes, without setting up
+// a decoder. Cheap enough to run on the main thread.
+struct ImageHeader {
+    enum Format {
+        FORMAT_UNKNOWN,
+        FORMAT_PNG,
+        FORMAT_JPEG
+    };
+
+    Format format;
+    unsigned long width;
+    unsigned long height;
+    // Bits per sample.
+    int depth;
+    // PNG_COLOR_TYPE_* for PNGs; the number of components for JPEGs.
+    int color;
+    // Whether the image has an alpha channel or a tRNS chunk.
+    bool alpha;
+    bool interlaced;
+    // Palette entries of paletted PNGs.
+    int colors;
+
+    ImageHeader() : format(FORMAT_UNKNOWN), width(0), height(0), depth(0),
+                    color(-1), alpha(false), interlaced(false), colors(0) {}
+
+    // Reads the PNG chunks up to the first IDAT, or the JPEG markers up to the
+    // frame header. Returns false for other formats and malformed headers.
+    bool read(const char* data, size_t length);
+
+    // Dimensions after decoding at 1/`scale` of the size, like libjpeg does.
+    unsigned long scaledWidth(int scale) const;
+    unsigned long scaledHeight(int scale) const;
+
+    // Largest number of pixels of an image that is decoded or created;
+    // larger ones are rejected before anything is allocated. Set with
+    // img.setMaxPixels().
+    static uint64_t maxPixels;
+    static const uint64_t DEFAULT_MAX_PIXELS = 1 << 28;
+
+    // Whether a `width` x `height` image is within maxPixels, and its RGBA
+    // pixels can be addressed without overflowing.
+    static bool allowed(unsigned long width, unsigned long height);
+
+protected:
+    bool readPNG(const unsigned char* data, size_t length);
+    bool readJPEG(const unsigned char* data, size_t length);
+};
+
+#endif
@@ -4,6 +4,13 @@
 #include <node_events.h>
 
 #include "image.h"
+#include "reader.h"
+#include "header.h"
+#include "composite.h"
+#include "options.h"
+#include "slice.h"
+#include "workers.h"
+#include "metrics.h"
 #include "macros.h"
 
 Persistent<FunctionTemplate> Image::constructor_template;
@@ -19,9 +26,13 @@ void Image::Init(Handle<Object> target) {
     constructor_template->SetClassName(String::NewSymbol("Image"));
 
     NODE_SET_PROTOTYPE_METHOD(constructor_template, "load", Load);
+    NODE_SET_PROTOTYPE_METHOD(constructor_template, "write", Write);
+    NODE_SET_PROTOTYPE_METHOD(constructor_template, "end", End);
     NODE_SET_PROTOTYPE_METHOD(constructor_template, "process", Process);
     NODE_SET_PROTOTYPE_METHOD(constructor_template, "overlay", Overlay);
     NODE_SET_PROTOTYPE_METHOD(constructor_template, "asPNG", AsPNG);
+    NODE_SET_PROTOTYPE_METHOD(constructor_template, "slice", Slice);
+    NODE_SET_PROTOTYPE_METHOD(constructor_template, "resize", Resize);
 
     Local<ObjectTemplate> instance_template = constructor_template->InstanceTemplate();
     instance_template->SetAccessor(String::NewSymbol("width"), GetWidth);
@@ -82,8 +93,11 @@ Handle<Value> Image::GetData(Local<String> name, const AccessorInfo& info) {
     if (image->data == NULL) {
         return scope.Close(Undefined());
     } else {
-        // Returns a copy of the buffer for now.
-        Buffer *buffer = Buffer::New(image->data, 4 * image->width * image->height);
+        // A view of the pixels, which keeps them alive; later overlays show
+        // up in it.
+        image->surface->ref();
+        Buffer *buffer = Buffer::New(image->data, image->surface->size(),
+                                     Surface::unrefCallback, image->surface);
         return scope.Close(buffer->handle_);
     }
 }
@@ -108,7 +122,9 @@ Handle<Value> Image::Load(const Arguments& args) {
 
 void Image::EIO_BeginLoad(Baton* baton) {
     baton->image->locked = true;
-    eio_custom(EIO_Load, EIO_PRI_DEFAULT, EIO_AfterLoad, baton);
+    // Image calls are already queued per image, so they aren't bounded.
+    WorkerPool::submit(EIO_Load, EIO_AfterLoad, baton, WorkerPool::INTERACTIVE, false);
+    Metrics::begin();
 }
 
 void Image::readPNG(png_structp png_ptr, png_bytep data, png_size_t length) {
@@ -130,6 +146,15 @@ int Image::EIO_Load(eio_req *req) {
 
     assert(image->data == NULL);
     assert(baton->pos == 0);
+    uint64_t start = Metrics::now();
+
+    ImageHeader header;
+    if (header.read(baton->data, baton->length) &&
+        !ImageHeader::allowed(header.width, header.height)) {
+        baton->error = 1;
+        baton->message = "Image is too large";
+        return 0;
+    }
 
     // Decode baton->data
     if (png_sig_cmp((png_bytep)baton->data, 0, 8) == 0) {
@@ -184,12 +209,15 @@ int Image::EIO_Load(eio_req *req) {
         unsigned int rowbytes = png_get_rowbytes(png_ptr, info_ptr);
         assert(width * 4 == rowbytes);
 
-        char* data = new char[height * rowbytes];
-        assert(data);
-        // if (image->data == NULL) {
-        //     baton->error = 3;
-        //     return 0;
-        // }
+        Surface* surface = new Surface(width, height, true);
+        char* data = (char*)surface->pixels;
+        if (data == NULL) {
+            surface->unref();
+            png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+            baton->error = 1;
+            baton->message = "Out of memory";
+            return 0;
+        }
 
         png_bytep row_pointers[height];
         for (unsigned i = 0; i < height; i++) {
@@ -203,30 +231,344 @@ int Image::EIO_Load(eio_req *req) {
         png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
         image->width = width;
         image->height = height;
+        image->surface = surface;
         image->data = data;
+    } else if (ImageReader::isJPEG(baton->data, baton->length)) {
+        JPEGImageReader reader(baton->data, baton->length);
+        Surface* surface = NULL;
+        if (reader.error == NULL) {
+            surface = new Surface(reader.width, reader.height, false);
+            if (surface->pixels == NULL) {
+                reader.error = "Out of memory";
+            } else {
+                reader.decode((unsigned char*)surface->pixels, true);
+            }
+        }
+        if (reader.error != NULL) {
+            if (surface != NULL) surface->unref();
+            baton->error = 1;
+            baton->message = reader.error;
+        } else {
+            image->width = reader.width;
+            image->height = reader.height;
+            image->surface = surface;
+            image->data = (char*)surface->pixels;
+        }
     }
 
+    if (image->data != NULL) {
+        Metrics::time(Metrics::DECODE, Metrics::now() - start);
+        Metrics::count(Metrics::LOADS);
+        Metrics::count(Metrics::BYTES_IN, baton->length);
+        Metrics::count(Metrics::PIXELS, (uint64_t)image->width * image->height);
+    }
     return 0;
 }
 
 int Image::EIO_AfterLoad(eio_req *req) {
     HandleScope scope;
+    Metrics::end();
     LoadBaton* baton = static_cast<LoadBaton*>(req->data);
     Image* image = baton->image;
 
-    if (!baton->callback.IsEmpty() && baton->callback->IsFunction()) {
-        Local<Value> argv[] = {
-            Local<Value>::New(Null()),
+    if (baton->error) {
+        Local<Value> err = Exception::Error(String::New(baton->message.c_str()));
+        if (!baton->callback.IsEmpty() && baton->callback->IsFunction()) {
+            Local<Value> argv[] = { err };
+            TRY_CATCH_CALL(image->handle_, baton->callback, 1, argv);
+        } else {
+            Local<Value> args[] = { String::NewSymbol("error"), err };
+            EMIT_EVENT(image->handle_, 2, args);
+        }
+    } else {
+        if (!baton->callback.IsEmpty() && baton->callback->IsFunction()) {
+            Local<Value> argv[] = {
+                Local<Value>::New(Null()),
+                Local<Value>::New(image->handle_)
+            };
+            TRY_CATCH_CALL(image->handle_, baton->callback, 2, argv);
+        }
+
+        Local<Value> args[] = {
+            String::NewSymbol("load"),
             Local<Value>::New(image->handle_)
         };
-        TRY_CATCH_CALL(image->handle_, baton->callback, 2, argv);
+        EMIT_EVENT(image->handle_, 2, args);
     }
 
-    Local<Value> args[] = {
-        String::NewSymbol("load"),
-        Local<Value>::New(image->handle_)
-    };
-    EMIT_EVENT(image->handle_, 2, args);
+    delete baton;
+    image->locked = false;
+    image->Process();
+    return 0;
+}
+
+// Chunks that may be waiting for the decoder before write() asks the caller
+// to hold back.
+static const size_t MAX_PENDING_BYTES = 256 * 1024;
+
+// Image#write(buffer) passes on the next piece of an encoded image that
+// arrives in chunks, e.g. from a stream. PNGs are decoded while the chunks
+// come in. Returns false when the decoder is falling behind and emits 'drain'
+// once it caught up.
+Handle<Value> Image::Write(const Arguments& args) {
+    HandleScope scope;
+    Image* image = ObjectWrap::Unwrap<Image>(args.This());
+
+    if (args.Length() < 1 || !Buffer::HasInstance(args[0])) {
+        return ThrowException(Exception::TypeError(
+            String::New("Buffer required as first argument")));
+    }
+
+    PushBaton* baton = image->Push();
+    if (baton->ended) {
+        return ThrowException(Exception::Error(
+            String::New("Image data was already ended")));
+    }
+
+    baton->add(args[0]->ToObject());
+    if (baton->started && !baton->running) SubmitPush(baton);
+
+    bool ok = baton->pendingBytes < MAX_PENDING_BYTES;
+    if (!ok) baton->blocked = true;
+    return scope.Close(Boolean::New(ok));
+}
+
+// Image#end([buffer], [callback]) passes on the last chunk. Emits 'load' and
+// calls the callback once all chunks are decoded.
+Handle<Value> Image::End(const Arguments& args) {
+    HandleScope scope;
+    Image* image = ObjectWrap::Unwrap<Image>(args.This());
+
+    int argc = args.Length();
+    Local<Function> callback;
+    if (argc > 0 && args[argc - 1]->IsFunction()) {
+        callback = Local<Function>::Cast(args[--argc]);
+    }
+    bool chunk = argc > 0 && !args[0]->IsUndefined() && !args[0]->IsNull();
+    if (chunk && !Buffer::HasInstance(args[0])) {
+        return ThrowException(Exception::TypeError(
+            String::New("Buffer required as first argument")));
+    }
+
+    PushBaton* baton = image->Push();
+    if (baton->ended) {
+        return ThrowException(Exception::Error(
+            String::New("Image data was already ended")));
+    }
+
+    if (chunk) baton->add(args[0]->ToObject());
+    baton->ended = true;
+    if (!callback.IsEmpty()) {
+        baton->callback = Persistent<Function>::New(callback);
+    }
+    if (baton->started && !baton->running) SubmitPush(baton);
+
+    return args.This();
+}
+
+// Returns the baton that collects written chunks, queueing a new one after
+// the image's pending calls if needed.
+Image::PushBaton* Image::Push() {
+    if (push == NULL) {
+        push = new PushBaton(this);
+        Schedule(EIO_BeginPush, push);
+    }
+    return push;
+}
+
+void Image::EIO_BeginPush(Baton* baton) {
+    PushBaton* push = static_cast<PushBaton*>(baton);
+    push->image->locked = true;
+    push->started = true;
+    Metrics::begin();
+
+    if (!push->pending.empty() || push->ended) SubmitPush(push);
+}
+
+// Hands the pending chunks to a new job.
+void Image::SubmitPush(PushBaton* baton) {
+    assert(baton->processing.empty());
+    baton->processing.swap(baton->pending);
+    baton->pendingBytes = 0;
+    baton->finishing = baton->ended;
+    baton->running = true;
+
+    // Keeps the loop alive until the job is done.
+    ev_ref(EV_DEFAULT_UC);
+    WorkerPool::submit(EIO_Push, EIO_AfterPush, baton, WorkerPool::INTERACTIVE, false);
+}
+
+void Image::PushBaton::add(Handle<Object> buffer) {
+    Chunk chunk;
+    chunk.buffer = Persistent<Object>::New(buffer);
+    chunk.data = Buffer::Data(buffer);
+    chunk.length = Buffer::Length(buffer);
+    pending.push_back(chunk);
+    pendingBytes += chunk.length;
+}
+
+void Image::PushBaton::dispose(Chunks& chunks) {
+    for (size_t i = 0; i < chunks.size(); i++) chunks[i].buffer.Dispose();
+    chunks.clear();
+}
+
+bool Image::PushBaton::append(const char* data, size_t size) {
+    if (max < length + size) {
+        char* grown = (char*)BufferPool::grow(head, length,
+            length + size > 2 * max ? length + size : 2 * max);
+        if (grown == NULL) return false;
+        head = grown;
+        max = BufferPool::capacity(head);
+    }
+    memcpy(head + length, data, size);
+    length += size;
+    return true;
+}
+
+void Image::PushBaton::decode(const char* data, size_t size) {
+    if (png != NULL) {
+        if (!png->write(data, size)) {
+            error = 1;
+            message = png->error;
+        }
+        return;
+    }
+
+    if (!append(data, size)) {
+        error = 1;
+        message = "Out of memory";
+        return;
+    }
+    // Wait for the full signature.
+    if (jpeg || length < 8) return;
+
+    if (png_sig_cmp((png_bytep)head, 0, 8) == 0) {
+        png = new ProgressivePNGDecoder();
+        if (!png->write(head, length)) {
+            error = 1;
+            message = png->error;
+        }
+        BufferPool::release(head);
+        head = NULL;
+        length = max = 0;
+    } else if (ImageReader::isJPEG(head, length)) {
+        jpeg = true;
+    } else {
+        error = 1;
+        message = "Unknown image format";
+    }
+}
+
+Surface* Image::PushBaton::finish() {
+    if (jpeg) {
+        JPEGImageReader reader(head, length);
+        Surface* surface = NULL;
+        if (reader.error == NULL && !ImageHeader::allowed(reader.width, reader.height)) {
+            reader.error = "Image is too large";
+        } else if (reader.error == NULL) {
+            surface = new Surface(reader.width, reader.height, false);
+            if (surface->pixels == NULL) {
+                reader.error = "Out of memory";
+            } else {
+                reader.decode((unsigned char*)surface->pixels, true);
+            }
+        }
+        if (reader.error != NULL) {
+            if (surface != NULL) surface->unref();
+            error = 1;
+            message = reader.error;
+            return NULL;
+        }
+        return surface;
+    } else if (png != NULL) {
+        Surface* surface = png->release();
+        if (surface == NULL) {
+            error = 1;
+            message = "Unexpected end of PNG data";
+        }
+        return surface;
+    }
+
+    error = 1;
+    message = "Unknown image format";
+    return NULL;
+}
+
+int Image::EIO_Push(eio_req *req) {
+    PushBaton* baton = static_cast<PushBaton*>(req->data);
+    Image* image = baton->image;
+    uint64_t start = Metrics::now();
+
+    // After an error, the remaining chunks are only collected until end().
+    for (size_t i = 0; i < baton->processing.size() && !baton->error; i++) {
+        baton->decode(baton->processing[i].data, baton->processing[i].length);
+        Metrics::count(Metrics::BYTES_IN, baton->processing[i].length);
+    }
+
+    if (baton->finishing && !baton->error) {
+        Surface* surface = baton->finish();
+        if (surface != NULL) {
+            if (image->surface != NULL) image->surface->unref();
+            image->width = surface->width;
+            image->height = surface->height;
+            image->surface = surface;
+            image->data = (char*)surface->pixels;
+
+            Metrics::count(Metrics::LOADS);
+            Metrics::count(Metrics::PIXELS, (uint64_t)image->width * image->height);
+        }
+    }
+
+    Metrics::time(Metrics::DECODE, Metrics::now() - start);
+    return 0;
+}
+
+int Image::EIO_AfterPush(eio_req *req) {
+    HandleScope scope;
+    PushBaton* baton = static_cast<PushBaton*>(req->data);
+    Image* image = baton->image;
+
+    ev_unref(EV_DEFAULT_UC);
+    baton->running = false;
+    PushBaton::dispose(baton->processing);
+
+    if (!baton->finishing) {
+        if (!baton->pending.empty() || baton->ended) SubmitPush(baton);
+        if (baton->blocked && baton->pendingBytes < MAX_PENDING_BYTES) {
+            baton->blocked = false;
+            Local<Value> args[] = { String::NewSymbol("drain") };
+            EMIT_EVENT(image->handle_, 1, args);
+        }
+        return 0;
+    }
+
+    Metrics::end();
+    image->push = NULL;
+
+    if (baton->error) {
+        Local<Value> err = Exception::Error(String::New(baton->message.c_str()));
+        if (!baton->callback.IsEmpty() && baton->callback->IsFunction()) {
+            Local<Value> argv[] = { err };
+            TRY_CATCH_CALL(image->handle_, baton->callback, 1, argv);
+        } else {
+            Local<Value> args[] = { String::NewSymbol("error"), err };
+            EMIT_EVENT(image->handle_, 2, args);
+        }
+    } else {
+        if (!baton->callback.IsEmpty() && baton->callback->IsFunction()) {
+            Local<Value> argv[] = {
+                Local<Value>::New(Null()),
+                Local<Value>::New(image->handle_)
+            };
+            TRY_CATCH_CALL(image->handle_, baton->callback, 2, argv);
+        }
+
+        Local<Value> args[] = {
+            String::NewSymbol("load"),
+            Local<Value>::New(image->handle_)
+        };
+        EMIT_EVENT(image->handle_, 2, args);
+    }
 
     delete baton;
     image->locked = false;
@@ -241,10 +583,23 @@ Handle<Value> Image::AsPNG(const Arguments& args) {
     HandleScope scope;
     Image* image = ObjectWrap::Unwrap<Image>(args.This());
 
-    // First argument is a hash with config options depth/color
+    // First argument is a hash with encoding options.
     OPTIONAL_ARGUMENT_FUNCTION(1, callback);
 
-    Baton* baton = new AsPNGBaton(image, callback);
+    AsPNGBaton* baton = new AsPNGBaton(image, callback);
+    if (args.Length() > 0 && args[0]->IsObject()) {
+        std::string error;
+        if (!ParseEncodeOptions(args[0]->ToObject(), baton->options, error)) {
+            delete baton;
+            return ThrowException(Exception::TypeError(String::New(error.c_str())));
+        }
+
+        baton->stream = ChunkStream::Create(args[0]->ToObject(), error);
+        if (!error.empty()) {
+            delete baton;
+            return ThrowException(Exception::TypeError(String::New(error.c_str())));
+        }
+    }
     image->Schedule(EIO_BeginAsPNG, baton);
 
     return args.This();
@@ -252,23 +607,35 @@ Handle<Value> Image::AsPNG(const Arguments& args) {
 
 void Image::EIO_BeginAsPNG(Baton* baton) {
     baton->image->locked = true;
-    eio_custom(EIO_AsPNG, EIO_PRI_DEFAULT, EIO_AfterAsPNG, baton);
+    WorkerPool::submit(EIO_AsPNG, EIO_AfterAsPNG, baton, WorkerPool::INTERACTIVE, false);
+    Metrics::begin();
 }
 
-void Image::writePNG(png_structp png_ptr, png_bytep data, png_size_t length) {
-    AsPNGBaton* baton = static_cast<AsPNGBaton*>(png_get_io_ptr(png_ptr));
+void Image::AsPNGBaton::reserve(size_t size) {
+    if (stream != NULL) return;
+    char* grown = (char*)BufferPool::grow(data, length, size);
+    if (grown == NULL) return;
+    data = grown;
+    max = BufferPool::capacity(data);
+}
 
-    if (baton->data == NULL || baton->max < baton->length + length) {
-        int increase = baton->length ? 4 * length : 32768;
-        baton->data = (char*)realloc(baton->data, baton->max + increase);
-        baton->max += increase;
+void Image::AsPNGBaton::write(const char* chunk, size_t size) {
+    if (stream != NULL) {
+        stream->write(chunk, size);
+        return;
+    }
+    if (failed) return;
+    if (max < length + size) {
+        reserve(length + size > 2 * max ? length + size : 2 * max);
+        if (max < length + size) reserve(length + size);
+        if (max < length + size) {
+            failed = true;
+            return;
+        }
     }
 
-    // TODO: implement OOM check
-    assert(baton->data);
-
-    memcpy(baton->data + baton->length, data, length);
-    baton->length += length;
+    memcpy(data + length, chunk, size);
+    length += size;
 }
 
 int Image::EIO_AsPNG(eio_req *req) {
@@ -277,65 +644,217 @@ int Image::EIO_AsPNG(eio_req *req) {
 
     assert(image->data != NULL);
 
-    png_structp png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
-    assert(png_ptr);
-    // if (!png_ptr) {
-    //     baton->error = 1;
-    //     return 0;
-    // }
-    png_infop info_ptr = png_create_info_struct(png_ptr);
-    assert(info_ptr);
-    // if (!info_ptr) {
-    //     png_destroy_writestruct(&png_ptr, NULL, NULL);
-    //     baton->error = 2;
-    //     return 0;
-    // }
+    uint64_t start = Metrics::now();
+    const char* error = encodeImage((unsigned char*)image->data, image->width, image->height,
+                                    4 * image->width, true, baton->options, baton);
+    if (error != NULL) {
+        baton->error = 1;
+        baton->message = error;
+    }
+    if (baton->stream != NULL) {
+        baton->stream->flush();
+        if (!baton->error && baton->stream->error() != NULL) {
+            baton->error = 1;
+            baton->message = baton->stream->error();
+        }
+    }
 
-    png_set_compression_level(png_ptr, Z_BEST_SPEED);
-    png_set_compression_buffer_size(png_ptr, 32768);
+    Metrics::time(Metrics::ENCODE, Metrics::now() - start);
+    Metrics::count(Metrics::ENCODES);
+    Metrics::count(Metrics::BYTES_OUT,
+        baton->stream != NULL ? baton->stream->length() : baton->length);
+    Metrics::count(Metrics::PIXELS, (uint64_t)image->width * image->height);
+    return 0;
+}
 
-    png_set_IHDR(png_ptr, info_ptr, image->width, image->height, 8,
-                 PNG_COLOR_TYPE_RGB_ALPHA, PNG_INTERLACE_NONE,
-                 PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+int Image::EIO_AfterAsPNG(eio_req *req) {
+    HandleScope scope;
+    Metrics::end();
+    AsPNGBaton* baton = static_cast<AsPNGBaton*>(req->data);
+    Image* image = baton->image;
 
-    png_set_write_fn(png_ptr, (png_voidp)baton, writePNG, NULL);
-    png_write_info(png_ptr, info_ptr);
+    if (baton->stream != NULL) {
+        // Chunks the notifier hasn't passed on yet.
+        baton->stream->close();
+    }
 
-    // Enable this when setting PNG_COLOR_TYPE_RGB instead of PNG_COLOR_TYPE_RGB_ALPHA.
-    // png_set_filler(png_ptr, 0, PNG_FILLER_AFTER);
+    if (!baton->callback.IsEmpty() && baton->callback->IsFunction()) {
+        if (baton->error) {
+            Local<Value> argv[] = {
+                Local<Value>::New(Exception::Error(String::New(baton->message.c_str())))
+            };
+            TRY_CATCH_CALL(image->handle_, baton->callback, 1, argv);
+        } else if (baton->stream != NULL && baton->stream->length() > 0) {
+            Local<Value> argv[] = { Local<Value>::New(Null()) };
+            TRY_CATCH_CALL(image->handle_, baton->callback, 1, argv);
+        } else if (baton->data != NULL && baton->length > 0) {
+            Local<Value> argv[] = {
+                Local<Value>::New(Null()),
+                // The buffer takes over the encoded data.
+                Local<Value>::New(Buffer::New(baton->data, baton->length,
+                                              BufferPool::releaseCallback, NULL)->handle_)
+            };
+            baton->data = NULL;
+            TRY_CATCH_CALL(image->handle_, baton->callback, 2, argv);
+        } else {
+            Local<Value> argv[] = {
+                Local<Value>::New(Exception::Error(String::New("Encoder produced no data")))
+            };
+            TRY_CATCH_CALL(image->handle_, baton->callback, 1, argv);
+        }
+    }
+
+    delete baton;
+    image->locked = false;
+    image->Process();
+    return 0;
+}
+
+// Image#slice(size, [options], callback) cuts the image into tiles of `size`
+// pixels, e.g. a rendered metatile into map tiles, and encodes them in
+// parallel. Calls back with an array of the encoded tiles, row by row.
+Handle<Value> Image::Slice(const Arguments& args) {
+    HandleScope scope;
+    Image* image = ObjectWrap::Unwrap<Image>(args.This());
 
-    png_bytep row_pointers[image->height];
-    for (unsigned i = 0; i < image->height; i++) {
-        row_pointers[i] = (unsigned char*)(image->data + (4 * image->width * i));
+    if (args.Length() < 1 || !args[0]->IsInt32() || args[0]->Int32Value() < 1) {
+        return ThrowException(Exception::TypeError(
+            String::New("Tile size must be a positive integer")));
+    }
+    int last = args.Length() - 1;
+    if (last < 1 || !args[last]->IsFunction()) {
+        return ThrowException(Exception::TypeError(
+            String::New("Callback required as last argument")));
+    }
+
+    SliceBaton* baton = new SliceBaton(image, Local<Function>::Cast(args[last]),
+                                       args[0]->Int32Value());
+    if (last > 1 && args[1]->IsObject()) {
+        std::string error;
+        if (!ParseEncodeOptions(args[1]->ToObject(), baton->options, error)) {
+            delete baton;
+            return ThrowException(Exception::TypeError(String::New(error.c_str())));
+        }
+    }
+    image->Schedule(EIO_BeginSlice, baton);
+
+    return args.This();
+}
+
+void Image::EIO_BeginSlice(Baton* baton) {
+    SliceBaton* slice = static_cast<SliceBaton*>(baton);
+    Image* image = slice->image;
+    image->locked = true;
+
+    TileBatch* batch = new TileBatch(image->surface, slice->size, slice->options,
+                                     slice->callback, AfterSlice, slice);
+    batch->start();
+}
+
+void Image::AfterSlice(void* data) {
+    SliceBaton* baton = static_cast<SliceBaton*>(data);
+    Image* image = baton->image;
+
+    delete baton;
+    image->locked = false;
+    image->Process();
+}
+
+// Image#resize(width, height, [filter], [callback]) scales the image with
+// the 'box', 'bilinear' (default) or 'lanczos' filter.
+Handle<Value> Image::Resize(const Arguments& args) {
+    HandleScope scope;
+    Image* image = ObjectWrap::Unwrap<Image>(args.This());
+
+    if (args.Length() < 2 || !args[0]->IsInt32() || !args[1]->IsInt32() ||
+        args[0]->Int32Value() < 1 || args[1]->Int32Value() < 1) {
+        return ThrowException(Exception::TypeError(
+            String::New("Width and height must be positive integers")));
+    } else if (!ImageHeader::allowed(args[0]->Int32Value(), args[1]->Int32Value())) {
+        return ThrowException(Exception::TypeError(String::New("Image is too large")));
+    }
+
+    int argc = args.Length();
+    Local<Function> callback;
+    if (argc > 2 && args[argc - 1]->IsFunction()) {
+        callback = Local<Function>::Cast(args[--argc]);
     }
 
-    // Write image data
-    png_write_image(png_ptr, row_pointers);
+    ResampleFilter filter = RESAMPLE_BILINEAR;
+    if (argc > 2 && !args[2]->IsUndefined()) {
+        String::AsciiValue name(args[2]);
+        if (strcmp(*name, "box") == 0) {
+            filter = RESAMPLE_BOX;
+        } else if (strcmp(*name, "bilinear") == 0) {
+            filter = RESAMPLE_BILINEAR;
+        } else if (strcmp(*name, "lanczos") == 0) {
+            filter = RESAMPLE_LANCZOS;
+        } else {
+            return ThrowException(Exception::TypeError(
+                String::New("filter must be 'box', 'bilinear' or 'lanczos'")));
+        }
+    }
+
+    Baton* baton = new ResizeBaton(image, callback, args[0]->Int32Value(),
+                                   args[1]->Int32Value(), filter);
+    image->Schedule(EIO_BeginResize, baton);
+
+    return args.This();
+}
 
-    png_write_end(png_ptr, NULL);
-    png_destroy_write_struct(&png_ptr, &info_ptr);
+void Image::EIO_BeginResize(Baton* baton) {
+    baton->image->locked = true;
+    WorkerPool::submit(EIO_Resize, EIO_AfterResize, baton, WorkerPool::INTERACTIVE, false);
+    Metrics::begin();
+}
+
+int Image::EIO_Resize(eio_req *req) {
+    ResizeBaton* baton = static_cast<ResizeBaton*>(req->data);
+    Image* image = baton->image;
+
+    assert(image->data != NULL);
+    uint64_t start = Metrics::now();
+
+    Surface* surface = new Surface(baton->width, baton->height, image->surface->alpha);
+    if (surface->pixels == NULL ||
+        !resample(image->surface->pixels, image->width, image->height, image->width * 4,
+                  surface->pixels, baton->width, baton->height, baton->filter)) {
+        surface->unref();
+        baton->error = 1;
+        baton->message = "Out of memory";
+        return 0;
+    }
 
+    // Views of the old pixels keep them alive.
+    image->surface->unref();
+    image->surface = surface;
+    image->data = (char*)surface->pixels;
+    image->width = baton->width;
+    image->height = baton->height;
+
+    Metrics::time(Metrics::RESAMPLE, Metrics::now() - start);
+    Metrics::count(Metrics::PIXELS, (uint64_t)image->width * image->height);
     return 0;
 }
 
-int Image::EIO_AfterAsPNG(eio_req *req) {
+int Image::EIO_AfterResize(eio_req *req) {
     HandleScope scope;
-    AsPNGBaton* baton = static_cast<AsPNGBaton*>(req->data);
+    Metrics::end();
+    ResizeBaton* baton = static_cast<ResizeBaton*>(req->data);
     Image* image = baton->image;
 
     if (!baton->callback.IsEmpty() && baton->callback->IsFunction()) {
-        if (baton->data != NULL && baton->length > 0) {
+        if (baton->error) {
+            Local<Value> argv[] = {
+                Local<Value>::New(Exception::Error(String::New(baton->message.c_str())))
+            };
+            TRY_CATCH_CALL(image->handle_, baton->callback, 1, argv);
+        } else {
             Local<Value> argv[] = {
                 Local<Value>::New(Null()),
-                // TODO: Currently creates a copy of the data.
-                // TODO: Buffer::New returns a persistent handle. ->Ref() it?
-                Local<Value>::New(Buffer::New(baton->data, baton->length)->handle_)
+                Local<Value>::New(image->handle_)
             };
             TRY_CATCH_CALL(image->handle_, baton->callback, 2, argv);
-        } else {
-            // TODO: send proper error message.
-            Local<Value> argv[] = { Local<Value>::New(True()) };
-            TRY_CATCH_CALL(image->handle_, baton->callback, 1, argv);
         }
     }
 
@@ -345,11 +864,30 @@ int Image::EIO_AfterAsPNG(eio_req *req) {
     return 0;
 }
 
+// Image#overlay(image, [{ x: n, y: n }], [callback]) composites `image` over
+// this one with its top left corner at (x, y). Only the part that overlaps
+// this image is composited.
 Handle<Value> Image::Overlay(const Arguments& args) {
     HandleScope scope;
     Image* image = ObjectWrap::Unwrap<Image>(args.This());
 
-    OPTIONAL_ARGUMENT_FUNCTION(1, callback);
+    int x = 0;
+    int y = 0;
+    int cb = 1;
+    if (args.Length() > 1 && args[1]->IsObject() && !args[1]->IsFunction()) {
+        Local<Object> options = args[1]->ToObject();
+        Local<Value> left = options->Get(String::NewSymbol("x"));
+        Local<Value> top = options->Get(String::NewSymbol("y"));
+        if ((!left->IsUndefined() && !left->IsInt32()) || (!top->IsUndefined() && !top->IsInt32())) {
+            return ThrowException(Exception::TypeError(
+                String::New("x and y must be integers")));
+        }
+        x = left->Int32Value();
+        y = top->Int32Value();
+        cb = 2;
+    }
+
+    OPTIONAL_ARGUMENT_FUNCTION(cb, callback);
     // TODO: Allow arbitrary RGBA buffers to be passed in.
     if (args.Length() < 1 || !Image::HasInstance(args[0])) {
         return ThrowException(Exception::TypeError(
@@ -357,7 +895,7 @@ Handle<Value> Image::Overlay(const Arguments& args) {
     }
 
     Image* overlay = ObjectWrap::Unwrap<Image>(args[0]->ToObject());
-    Baton* baton = new OverlayBaton(image, callback, overlay);
+    Baton* baton = new OverlayBaton(image, callback, overlay, x, y);
     image->Schedule(EIO_BeginOverlay, baton);
 
     return args.This();
@@ -365,60 +903,46 @@ Handle<Value> Image::Overlay(const Arguments& args) {
 
 void Image::EIO_BeginOverlay(Baton* baton) {
     baton->image->locked = true;
-    eio_custom(EIO_Overlay, EIO_PRI_DEFAULT, EIO_AfterOverlay, baton);
+    WorkerPool::submit(EIO_Overlay, EIO_AfterOverlay, baton, WorkerPool::INTERACTIVE, false);
+    Metrics::begin();
 }
 
 int Image::EIO_Overlay(eio_req *req) {
     OverlayBaton* baton = static_cast<OverlayBaton*>(req->data);
     Image* image = baton->image;
 
+    Image* overlay = baton->overlay;
     assert(image->data != NULL);
-    assert(baton->overlay->data != NULL);
-
-    // TODO: Need better checks for this.
-    assert(image->width == baton->overlay->width);
-    assert(image->height == baton->overlay->height);
-
-    for (unsigned long y = 0; y < image->height; y++) {
-        int offset = 4 * y * image->width;
-        unsigned int* src = (unsigned int*)(baton->overlay->data + offset);
-        unsigned int* dst = (unsigned int*)(image->data + offset);
-
-        for (unsigned long x = 0; x < image->width; x++) {
-             unsigned int rgba0 = dst[x];
-             unsigned int rgba1 = src[x];
-
-             // From http://trac.mapnik.org/browser/trunk/include/mapnik/graphics.hpp#L337
-             unsigned a1 = (rgba1 >> 24) & 0xff;
-             if (a1 == 0) continue;
-             if (a1 == 0xff) {
-                 dst[x] = rgba1;
-                 continue;
-             }
-             unsigned r1 = rgba1 & 0xff;
-             unsigned g1 = (rgba1 >> 8 ) & 0xff;
-             unsigned b1 = (rgba1 >> 16) & 0xff;
-
-             unsigned a0 = (rgba0 >> 24) & 0xff;
-             unsigned r0 = (rgba0 & 0xff) * a0;
-             unsigned g0 = ((rgba0 >> 8 ) & 0xff) * a0;
-             unsigned b0 = ((rgba0 >> 16) & 0xff) * a0;
-
-             a0 = ((a1 + a0) << 8) - a0*a1;
-
-             r0 = ((((r1 << 8) - r0) * a1 + (r0 << 8)) / a0);
-             g0 = ((((g1 << 8) - g0) * a1 + (g0 << 8)) / a0);
-             b0 = ((((b1 << 8) - b0) * a1 + (b0 << 8)) / a0);
-             a0 = a0 >> 8;
-             dst[x] = (a0 << 24)| (b0 << 16) | (g0 << 8) | (r0);
+    assert(overlay->data != NULL);
+
+    // The rectangle both images cover, in this image's coordinates.
+    long left = baton->x > 0 ? baton->x : 0;
+    long top = baton->y > 0 ? baton->y : 0;
+    long right = (long)baton->x + (long)overlay->width;
+    long bottom = (long)baton->y + (long)overlay->height;
+    if (right > (long)image->width) right = image->width;
+    if (bottom > (long)image->height) bottom = image->height;
+
+    uint64_t start = Metrics::now();
+    if (left < right && top < bottom) {
+        unsigned long length = right - left;
+        for (long y = top; y < bottom; y++) {
+            const unsigned int* src = (const unsigned int*)overlay->data +
+                (y - baton->y) * overlay->width + (left - baton->x);
+            unsigned int* dst = (unsigned int*)image->data + y * image->width + left;
+            composite(dst, src, dst, length);
         }
+        Metrics::count(Metrics::PIXELS, (uint64_t)length * (bottom - top));
     }
 
+    Metrics::time(Metrics::COMPOSITE, Metrics::now() - start);
+    Metrics::count(Metrics::OVERLAYS);
     return 0;
 }
 
 int Image::EIO_AfterOverlay(eio_req *req) {
     HandleScope scope;
+    Metrics::end();
     OverlayBaton* baton = static_cast<OverlayBaton*>(req->data);
     Image* image = baton->image;
 
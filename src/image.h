@@ -12,6 +12,14 @@
 
 #include <string>
 #include <queue>
+#include <vector>
+
+#include "encoder.h"
+#include "pool.h"
+#include "progressive.h"
+#include "resample.h"
+#include "stream.h"
+#include "surface.h"
 
 using namespace v8;
 using namespace node;
@@ -59,24 +67,117 @@ class Image : public EventEmitter {
         }
     };
 
-    class AsPNGBaton : public Baton {
+    // Collects the chunks passed to Image#write() and Image#end() and decodes
+    // them on the thread pool, one job at a time and in order.
+    class PushBaton : public Baton {
+    public:
+        struct Chunk {
+            Persistent<Object> buffer;
+            char* data;
+            size_t length;
+        };
+        typedef std::vector<Chunk> Chunks;
+
+        // Written, but not handed to a job yet.
+        Chunks pending;
+        size_t pendingBytes;
+        // Decoded by the running job.
+        Chunks processing;
+
+        // Set once the baton's turn in the image's queue came.
+        bool started;
+        bool running;
+        bool ended;
+        // The running job decodes the last chunk.
+        bool finishing;
+        // write() returned false; 'drain' is due.
+        bool blocked;
+
+        ProgressivePNGDecoder* png;
+        // The start of the file until its format is known, and JPEGs, which
+        // are decoded in one go at the end.
+        char* head;
+        size_t length;
+        size_t max;
+        bool jpeg;
+
+        PushBaton(Image* img) : Baton(img, Handle<Function>()), pendingBytes(0),
+            started(false), running(false), ended(false), finishing(false),
+            blocked(false), png(NULL), head(NULL), length(0), max(0), jpeg(false) {
+            // Only running jobs keep the loop alive, not a stream that is
+            // never ended.
+            ev_unref(EV_DEFAULT_UC);
+        }
+        virtual bool precondition(Baton* baton) {
+            return true;
+        }
+        ~PushBaton() {
+            ev_ref(EV_DEFAULT_UC);
+            dispose(pending);
+            dispose(processing);
+            delete png;
+            BufferPool::release(head);
+        }
+
+        void add(Handle<Object> buffer);
+        static void dispose(Chunks& chunks);
+
+        // Called on the thread pool.
+        void decode(const char* data, size_t size);
+        Surface* finish();
+
+    protected:
+        // Returns false when memory runs out.
+        bool append(const char* data, size_t size);
+    };
+
+    class AsPNGBaton : public Baton, public EncodeOutput {
     public:
         size_t length;
         size_t max;
         char* data;
+        EncodeOptions options;
+        // Set when the encoded data is passed on in chunks.
+        ChunkStream* stream;
 
-        AsPNGBaton(Image* img, Handle<Function> cb) : Baton(img, cb), length(0), max(0), data(NULL) {}
+        AsPNGBaton(Image* img, Handle<Function> cb) : Baton(img, cb), length(0), max(0), data(NULL), stream(NULL) {}
         ~AsPNGBaton() {
-            if (data != NULL) {
-                free(data);
-            }
+            BufferPool::release(data);
+            delete stream;
         }
+
+        void write(const char* chunk, size_t size);
+        void reserve(size_t size);
+    };
+
+    class SliceBaton : public Baton {
+    public:
+        // Tile width and height.
+        unsigned long size;
+        EncodeOptions options;
+
+        SliceBaton(Image* img, Handle<Function> cb, unsigned long s) : Baton(img, cb), size(s) {}
+    };
+
+    class ResizeBaton : public Baton {
+    public:
+        unsigned long width;
+        unsigned long height;
+        ResampleFilter filter;
+
+        ResizeBaton(Image* img, Handle<Function> cb, unsigned long w, unsigned long h, ResampleFilter f) :
+            Baton(img, cb), width(w), height(h), filter(f) {}
     };
 
     class OverlayBaton: public Baton {
     public:
         Image* overlay;
-        OverlayBaton(Image* img, Handle<Function> cb, Image* ovl) : Baton(img, cb), overlay(ovl) {
+        // Position of the overlay's top left corner; it is clipped to the
+        // image.
+        int x;
+        int y;
+        OverlayBaton(Image* img, Handle<Function> cb, Image* ovl, int x_, int y_) :
+            Baton(img, cb), overlay(ovl), x(x_), y(y_) {
             overlay->Ref();
         }
         virtual bool precondition(Baton* baton) {
@@ -106,10 +207,12 @@ protected:
         locked(false),
         width(0),
         height(0),
-        data(NULL) {}
+        surface(NULL),
+        data(NULL),
+        push(NULL) {}
     ~Image() {
-        if (data != NULL) {
-            delete[] data;
+        if (surface != NULL) {
+            surface->unref();
         }
     }
     static Handle<Value> New(const Arguments& args);
@@ -135,13 +238,29 @@ protected:
     static int EIO_AfterLoad(eio_req *req);
 
     static void readPNG(png_structp png_ptr, png_bytep data, png_size_t length);
-    static void writePNG(png_structp png_ptr, png_bytep data, png_size_t length);
+
+    PushBaton* Push();
+    static Handle<Value> Write(const Arguments& args);
+    static Handle<Value> End(const Arguments& args);
+    static void EIO_BeginPush(Baton* baton);
+    static void SubmitPush(PushBaton* baton);
+    static int EIO_Push(eio_req *req);
+    static int EIO_AfterPush(eio_req *req);
 
     static Handle<Value> AsPNG(const Arguments& args);
     static void EIO_BeginAsPNG(Baton* baton);
     static int EIO_AsPNG(eio_req *req);
     static int EIO_AfterAsPNG(eio_req *req);
 
+    static Handle<Value> Slice(const Arguments& args);
+    static void EIO_BeginSlice(Baton* baton);
+    static void AfterSlice(void* data);
+
+    static Handle<Value> Resize(const Arguments& args);
+    static void EIO_BeginResize(Baton* baton);
+    static int EIO_Resize(eio_req *req);
+    static int EIO_AfterResize(eio_req *req);
+
     static Handle<Value> Overlay(const Arguments& args);
     static void EIO_BeginOverlay(Baton* baton);
     static int EIO_Overlay(eio_req *req);
@@ -152,7 +271,11 @@ protected:
 
     unsigned long width;
     unsigned long height;
+    // Owns the decoded pixels at `data`.
+    Surface* surface;
     char* data;
+    // Receives the chunks written to the image until end() was called.
+    PushBaton* push;
 };
 
 
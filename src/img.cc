@@ -3,12 +3,73 @@
 
 #include "image.h"
 #include "blend.h"
+#include "quad.h"
+#include "composite.h"
+#include "stream.h"
+#include "encoder.h"
+#include "workers.h"
 #include "macros.h"
 
+// Compresses PNG bands on the WorkerPool. Helpers run at interactive
+// priority since they finish a job that is already running.
+class PoolEncodeExecutor : public EncodeExecutor {
+public:
+    int threads() {
+        return WorkerPool::stats().threads;
+    }
+
+    bool submit(void (*task)(void* data), void* data) {
+        Task* job = new Task();
+        job->task = task;
+        job->data = data;
+        if (!WorkerPool::submit(EIO_Run, EIO_AfterRun, job)) {
+            delete job;
+            return false;
+        }
+        return true;
+    }
+
+protected:
+    struct Task {
+        void (*task)(void* data);
+        void* data;
+    };
+
+    static int EIO_Run(eio_req* req) {
+        Task* job = static_cast<Task*>(req->data);
+        job->task(job->data);
+        delete job;
+        return 0;
+    }
+
+    static int EIO_AfterRun(eio_req* req) {
+        return 0;
+    }
+};
+
+static PoolEncodeExecutor encodeExecutor;
+
 extern "C" void init (v8::Handle<v8::Object> target) {
     Image::Init(target);
+    ChunkStream::Init();
+    encodeSetExecutor(&encodeExecutor);
 
     NODE_SET_METHOD(target, "blend", Blend);
+    NODE_SET_METHOD(target, "blendMany", BlendMany);
+    NODE_SET_METHOD(target, "quad", Quad);
+    NODE_SET_METHOD(target, "info", Info);
+    NODE_SET_METHOD(target, "registerUniform", RegisterUniform);
+    NODE_SET_METHOD(target, "setLayerCacheSize", SetLayerCacheSize);
+    NODE_SET_METHOD(target, "layerCacheStats", LayerCacheStats);
+    NODE_SET_METHOD(target, "setResultCacheSize", SetResultCacheSize);
+    NODE_SET_METHOD(target, "resultCacheStats", ResultCacheStats);
+    NODE_SET_METHOD(target, "configureWorkers", ConfigureWorkers);
+    NODE_SET_METHOD(target, "workerStats", WorkerStats);
+    NODE_SET_METHOD(target, "setMaxPixels", SetMaxPixels);
+    NODE_SET_METHOD(target, "setBufferPoolSize", SetBufferPoolSize);
+    NODE_SET_METHOD(target, "bufferPoolStats", BufferPoolStats);
+    NODE_SET_METHOD(target, "stats", ModuleStats);
 
     DEFINE_CONSTANT_STRING(target, PNG_LIBPNG_VER_STRING, libpng);
+    DEFINE_CONSTANT_STRING(target, compositeImplementation(), simd);
 }
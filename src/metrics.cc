@@ -0,0 +1,125 @@
+#include <pthread.h>
+#include <sys/time.h>
+#include <time.h>
+#include <cstring>
+
+#include <vector>
+
+#include "metrics.h"
+
+struct Slot {
+    // Only written by the thread the slot belongs to.
+    volatile uint64_t time[Metrics::STAGES];
+    volatile uint64_t calls[Metrics::STAGES];
+    volatile uint64_t counters[Metrics::COUNTERS];
+    volatile int64_t inFlight;
+};
+
+static pthread_key_t key;
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+// Slots of all threads that ever recorded anything; threads don't go away
+// in practice, so slots are never freed.
+static std::vector<Slot*> slots;
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+// Totals at the last reset().
+static Metrics::Totals baseline;
+
+static void createKey() {
+    pthread_key_create(&key, NULL);
+}
+
+static Slot* slot() {
+    pthread_once(&once, createKey);
+    Slot* current = static_cast<Slot*>(pthread_getspecific(key));
+    if (current == NULL) {
+        current = new Slot();
+        pthread_setspecific(key, current);
+
+        pthread_mutex_lock(&mutex);
+        slots.push_back(current);
+        pthread_mutex_unlock(&mutex);
+    }
+    return current;
+}
+
+uint64_t Metrics::now() {
+#ifdef CLOCK_MONOTONIC
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#else
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (uint64_t)tv.tv_sec * 1000000000 + (uint64_t)tv.tv_usec * 1000;
+#endif
+}
+
+void Metrics::time(Stage stage, uint64_t nanoseconds) {
+    Slot* current = slot();
+    current->time[stage] += nanoseconds;
+    current->calls[stage]++;
+}
+
+void Metrics::count(Counter counter, uint64_t amount) {
+    slot()->counters[counter] += amount;
+}
+
+void Metrics::begin() {
+    slot()->inFlight++;
+}
+
+void Metrics::end() {
+    slot()->inFlight--;
+}
+
+// Sums all slots, without subtracting the baseline.
+static Metrics::Totals sum() {
+    Metrics::Totals totals;
+    memset(&totals, 0, sizeof(totals));
+
+    pthread_mutex_lock(&mutex);
+    for (size_t i = 0; i < slots.size(); i++) {
+        const Slot* current = slots[i];
+        for (int j = 0; j < Metrics::STAGES; j++) {
+            totals.time[j] += current->time[j];
+            totals.calls[j] += current->calls[j];
+        }
+        for (int j = 0; j < Metrics::COUNTERS; j++) {
+            totals.counters[j] += current->counters[j];
+        }
+        totals.inFlight += current->inFlight;
+    }
+    pthread_mutex_unlock(&mutex);
+    return totals;
+}
+
+Metrics::Totals Metrics::totals() {
+    Totals totals = sum();
+    pthread_mutex_lock(&mutex);
+    for (int j = 0; j < STAGES; j++) {
+        totals.time[j] -= baseline.time[j];
+        totals.calls[j] -= baseline.calls[j];
+    }
+    for (int j = 0; j < COUNTERS; j++) {
+        totals.counters[j] -= baseline.counters[j];
+    }
+    pthread_mutex_unlock(&mutex);
+    return totals;
+}
+
+void Metrics::reset() {
+    Totals totals = sum();
+    pthread_mutex_lock(&mutex);
+    baseline = totals;
+    pthread_mutex_unlock(&mutex);
+}
+
+StageClock::StageClock() : last(Metrics::now()) {
+    memset(elapsed, 0, sizeof(elapsed));
+}
+
+void StageClock::record() {
+    for (int i = 0; i < Metrics::STAGES; i++) {
+        if (elapsed[i] > 0) Metrics::time((Metrics::Stage)i, elapsed[i]);
+    }
+}
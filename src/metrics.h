@@ -0,0 +1,83 @@
+#ifndef NODE_IMG_SRC_METRICS_H
+#define NODE_IMG_SRC_METRICS_H
+
+#include <stdint.h>
+
+// Process wide timers and counters for img.stats(). Every thread updates its
+// own slot without locking or atomic instructions; totals() adds up the slots
+// of all threads.
+class Metrics {
+public:
+    enum Stage {
+        // Waiting for a worker thread.
+        QUEUE,
+        DECODE,
+        COMPOSITE,
+        // Resizing and downsampling.
+        RESAMPLE,
+        ENCODE,
+        STAGES
+    };
+
+    enum Counter {
+        BYTES_IN,
+        BYTES_OUT,
+        PIXELS,
+        BLENDS,
+        LOADS,
+        OVERLAYS,
+        ENCODES,
+        COUNTERS
+    };
+
+    struct Totals {
+        // Nanoseconds spent in each stage, and how many jobs went through it.
+        uint64_t time[STAGES];
+        uint64_t calls[STAGES];
+        uint64_t counters[COUNTERS];
+        // Requests that were submitted but haven't called back yet.
+        int64_t inFlight;
+    };
+
+    // Monotonic time in nanoseconds.
+    static uint64_t now();
+
+    // Records one job that spent `nanoseconds` in `stage`.
+    static void time(Stage stage, uint64_t nanoseconds);
+    static void count(Counter counter, uint64_t amount = 1);
+
+    // Request started and finished.
+    static void begin();
+    static void end();
+
+    static Totals totals();
+    // Starts counting from zero again. In flight requests aren't affected.
+    static void reset();
+};
+
+// Splits the time of a loop that interleaves several stages: every lap()
+// charges the time since the previous lap to a stage. record() reports the
+// stages that took any time, as one job each.
+class StageClock {
+public:
+    StageClock();
+
+    inline void lap(Metrics::Stage stage) {
+        uint64_t time = Metrics::now();
+        elapsed[stage] += time - last;
+        last = time;
+    }
+
+    // Discards the time since the last lap.
+    inline void skip() {
+        last = Metrics::now();
+    }
+
+    void record();
+
+protected:
+    uint64_t last;
+    uint64_t elapsed[Metrics::STAGES];
+};
+
+#endif
@@ -0,0 +1,115 @@
+#include <cstring>
+
+#include "options.h"
+
+// Looks up a string option in a NULL terminated list of names. Returns the
+// index of the match, or -1 when the value isn't one of them.
+static int ParseName(Local<Value> value, const char* const* names) {
+    if (!value->IsString()) return -1;
+    String::AsciiValue name(value);
+    for (int i = 0; names[i]; i++) {
+        if (strcmp(*name, names[i]) == 0) return i;
+    }
+    return -1;
+}
+
+bool ParseEncodeOptions(Handle<Object> object, EncodeOptions& options, std::string& error) {
+    HandleScope scope;
+
+    // Shorthand for picking color type, filter and strategy from the image.
+    Local<Value> preset = object->Get(String::NewSymbol("preset"));
+    if (!preset->IsUndefined()) {
+        static const char* const presets[] = { "auto", NULL };
+        if (ParseName(preset, presets) < 0) {
+            error = "preset must be 'auto'";
+            return false;
+        }
+        options.color = COLOR_AUTO;
+        options.filter = FILTER_AUTO;
+        options.strategy = STRATEGY_AUTO;
+    }
+
+    Local<Value> format = object->Get(String::NewSymbol("format"));
+    if (!format->IsUndefined()) {
+        static const char* const formats[] = { "png", "jpeg", NULL };
+        int index = ParseName(format, formats);
+        if (index < 0) {
+            error = "format must be 'png' or 'jpeg'";
+            return false;
+        }
+        options.type = (EncodeType)index;
+    }
+
+    Local<Value> quality = object->Get(String::NewSymbol("quality"));
+    if (!quality->IsUndefined()) {
+        if (!quality->IsInt32() || quality->Int32Value() < 1 || quality->Int32Value() > 100) {
+            error = "quality must be an integer between 1 and 100";
+            return false;
+        }
+        options.quality = quality->Int32Value();
+    }
+
+    Local<Value> palette = object->Get(String::NewSymbol("palette"));
+    if (!palette->IsUndefined() && palette->BooleanValue()) {
+        options.color = COLOR_PALETTE;
+    }
+
+    Local<Value> color = object->Get(String::NewSymbol("color"));
+    if (!color->IsUndefined()) {
+        static const char* const colors[] = {
+            "source", "auto", "rgba", "rgb", "gray", "grayalpha", "palette", NULL
+        };
+        int index = ParseName(color, colors);
+        if (index < 0) {
+            error = "color must be one of source, auto, rgba, rgb, gray, grayalpha or palette";
+            return false;
+        }
+        options.color = (EncodeColor)index;
+    }
+
+    Local<Value> colors = object->Get(String::NewSymbol("colors"));
+    if (!colors->IsUndefined()) {
+        if (!colors->IsInt32() || colors->Int32Value() < 2 || colors->Int32Value() > 256) {
+            error = "colors must be an integer between 2 and 256";
+            return false;
+        }
+        options.colors = colors->Int32Value();
+    }
+
+    Local<Value> level = object->Get(String::NewSymbol("level"));
+    if (!level->IsUndefined()) {
+        if (!level->IsInt32() || level->Int32Value() < 0 || level->Int32Value() > 9) {
+            error = "level must be an integer between 0 and 9";
+            return false;
+        }
+        options.level = level->Int32Value();
+    }
+
+    Local<Value> filter = object->Get(String::NewSymbol("filter"));
+    if (!filter->IsUndefined()) {
+        static const char* const filters[] = {
+            "auto", "none", "sub", "up", "average", "paeth", "adaptive", NULL
+        };
+        int index = ParseName(filter, filters);
+        if (index < 0) {
+            error = "filter must be one of auto, none, sub, up, average, paeth or adaptive";
+            return false;
+        }
+        options.filter = (EncodeFilter)index;
+    }
+
+    Local<Value> strategy = object->Get(String::NewSymbol("strategy"));
+    if (!strategy->IsUndefined()) {
+        static const char* const strategies[] = {
+            "auto", "default", "filtered", "huffman", "rle", NULL
+        };
+        int index = ParseName(strategy, strategies);
+        if (index < 0) {
+            error = "strategy must be one of auto, default, filtered, huffman or rle";
+            return false;
+        }
+        options.strategy = (EncodeStrategy)index;
+    }
+
+    return true;
+}
@@ -0,0 +1,16 @@
+#ifndef NODE_IMG_SRC_OPTIONS_H
+#define NODE_IMG_SRC_OPTIONS_H
+
+#include <v8.h>
+
+#include <string>
+
+#include "encoder.h"
+
+using namespace v8;
+
+// Reads the encoding options from a JavaScript object. Returns false and
+// sets `error` when an option is invalid.
+bool ParseEncodeOptions(Handle<Object> object, EncodeOptions& options, std::string& error);
+
+#endif
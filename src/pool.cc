@@ -0,0 +1,157 @@
+#include <pthread.h>
+#include <cstdlib>
+#include <cstring>
+
+#include <vector>
+
+#include "pool.h"
+
+// Every block starts with its size class, padded so that the data stays 16
+// byte aligned.
+struct Header {
+    size_t capacity;
+    // -1 for blocks too large to be pooled.
+    int index;
+};
+static const size_t HEADER_SIZE = 16;
+
+// Classes go from 4 KB to 256 MB.
+static const size_t MIN_CLASS = 4096;
+static const int CLASS_COUNT = 1 + 4 * 16;
+
+static inline size_t classSize(int index) {
+    if (index == 0) return MIN_CLASS;
+    size_t base = MIN_CLASS << ((index - 1) / 4);
+    return base + ((index - 1) % 4 + 1) * (base / 4);
+}
+
+static inline int classIndex(size_t size) {
+    if (size <= MIN_CLASS) return 0;
+    size_t base = MIN_CLASS;
+    int octave = 0;
+    while (base * 2 < size) {
+        // Larger sizes aren't pooled; stop before `base` overflows.
+        if (++octave == CLASS_COUNT / 4) return -1;
+        base *= 2;
+    }
+    size_t step = (size - base + base / 4 - 1) / (base / 4);
+    int index = 1 + octave * 4 + step - 1;
+    return index < CLASS_COUNT ? index : -1;
+}
+
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static std::vector<Header*> available[CLASS_COUNT];
+static size_t poolCapacity = 32 * 1024 * 1024;
+static BufferPool::Stats counters = { 0, 0, 0, 0, 0, 0, 0 };
+
+static inline Header* headerOf(const void* data) {
+    return (Header*)((char*)data - HEADER_SIZE);
+}
+
+// Frees pooled buffers, the largest first, until the pool holds at most
+// `bytes`.
+static void shrink(size_t bytes) {
+    std::vector<Header*> discarded;
+
+    pthread_mutex_lock(&mutex);
+    for (int index = CLASS_COUNT - 1; index >= 0 && counters.bytes > bytes; index--) {
+        while (!available[index].empty() && counters.bytes > bytes) {
+            discarded.push_back(available[index].back());
+            available[index].pop_back();
+            counters.buffers--;
+            counters.bytes -= classSize(index);
+        }
+    }
+    pthread_mutex_unlock(&mutex);
+
+    for (size_t i = 0; i < discarded.size(); i++) free(discarded[i]);
+}
+
+static Header* allocateBlock(size_t capacity) {
+    if (capacity > (size_t)-1 - HEADER_SIZE) return NULL;
+    return (Header*)malloc(HEADER_SIZE + capacity);
+}
+
+void* BufferPool::allocate(size_t size) {
+    int index = classIndex(size);
+    size_t capacity = index < 0 ? size : classSize(index);
+    Header* block = NULL;
+
+    pthread_mutex_lock(&mutex);
+    counters.allocations++;
+    if (index >= 0 && !available[index].empty()) {
+        block = available[index].back();
+        available[index].pop_back();
+        counters.reuses++;
+        counters.buffers--;
+        counters.bytes -= capacity;
+    }
+    pthread_mutex_unlock(&mutex);
+
+    if (block == NULL) {
+        block = allocateBlock(capacity);
+        if (block == NULL) {
+            // The buffers kept for reuse may be what is missing.
+            shrink(0);
+            block = allocateBlock(capacity);
+        }
+        if (block == NULL) return NULL;
+        block->capacity = capacity;
+        block->index = index;
+    }
+    return (char*)block + HEADER_SIZE;
+}
+
+void* BufferPool::grow(void* data, size_t used, size_t size) {
+    if (data != NULL && capacity(data) >= size) return data;
+    void* result = allocate(size);
+    if (result == NULL) return NULL;
+    if (data != NULL) {
+        memcpy(result, data, used);
+        release(data);
+    }
+    return result;
+}
+
+void BufferPool::release(void* data) {
+    if (data == NULL) return;
+    Header* block = headerOf(data);
+
+    bool retained = false;
+    pthread_mutex_lock(&mutex);
+    counters.releases++;
+    if (block->index >= 0 && counters.bytes + block->capacity <= poolCapacity) {
+        available[block->index].push_back(block);
+        counters.buffers++;
+        counters.bytes += block->capacity;
+        retained = true;
+    } else {
+        counters.discards++;
+    }
+    pthread_mutex_unlock(&mutex);
+
+    if (!retained) free(block);
+}
+
+size_t BufferPool::capacity(const void* data) {
+    return headerOf(data)->capacity;
+}
+
+void BufferPool::releaseCallback(char* data, void* hint) {
+    release(data);
+}
+
+void BufferPool::setCapacity(size_t bytes) {
+    pthread_mutex_lock(&mutex);
+    poolCapacity = bytes;
+    pthread_mutex_unlock(&mutex);
+    shrink(bytes);
+}
+
+BufferPool::Stats BufferPool::stats() {
+    pthread_mutex_lock(&mutex);
+    Stats result = counters;
+    result.capacity = poolCapacity;
+    pthread_mutex_unlock(&mutex);
+    return result;
+}
@@ -0,0 +1,45 @@
+#ifndef NODE_IMG_SRC_POOL_H
+#define NODE_IMG_SRC_POOL_H
+
+#include <stdint.h>
+
+#include <cstddef>
+
+// Thread safe pool of pixel and output buffers. Sizes are rounded up to one
+// of four classes per power of two, and released buffers are kept for reuse
+// until the pool holds `capacity` bytes. Blocks must be released with
+// release(), never free().
+class BufferPool {
+public:
+    struct Stats {
+        uint64_t allocations;
+        // Allocations that were served from the pool.
+        uint64_t reuses;
+        uint64_t releases;
+        // Released buffers that didn't fit under the capacity.
+        uint64_t discards;
+        size_t buffers;
+        size_t bytes;
+        size_t capacity;
+    };
+
+    // Returns a buffer of at least `size` bytes. When memory runs out, the
+    // pooled buffers are freed and the allocation is retried; if that doesn't
+    // help either, returns NULL. Sizes often come from image headers, so
+    // callers report that as an error rather than taking the process down.
+    static void* allocate(size_t size);
+    // Returns a buffer of at least `size` bytes holding the first `used` bytes
+    // of `data`, which may be NULL, and releases `data`. Returns NULL and
+    // leaves `data` alone when memory runs out.
+    static void* grow(void* data, size_t used, size_t size);
+    static void release(void* data);
+    // Usable size of a buffer returned by allocate() or grow().
+    static size_t capacity(const void* data);
+    // Buffer::New() free callback that releases `data`.
+    static void releaseCallback(char* data, void* hint);
+
+    static void setCapacity(size_t bytes);
+    static Stats stats();
+};
+
+#endif
@@ -0,0 +1,101 @@
+#include "progressive.h"
+#include "header.h"
+
+ProgressivePNGDecoder::ProgressivePNGDecoder() :
+    width(0), height(0), surface(NULL), done(false), failed(false) {
+    png = png_create_read_struct(PNG_LIBPNG_VER_STRING, this, errorCallback, NULL);
+    info = png_create_info_struct(png);
+    png_set_progressive_read_fn(png, this, infoCallback, rowCallback, endCallback);
+}
+
+ProgressivePNGDecoder::~ProgressivePNGDecoder() {
+    png_destroy_read_struct(&png, &info, NULL);
+    if (surface != NULL) surface->unref();
+}
+
+bool ProgressivePNGDecoder::write(const char* data, size_t length) {
+    if (failed) return false;
+    // Trailing data after IEND is ignored.
+    if (done) return true;
+
+    if (setjmp(png_jmpbuf(png))) {
+        failed = true;
+        return false;
+    }
+    png_process_data(png, info, (png_bytep)data, length);
+    return true;
+}
+
+Surface* ProgressivePNGDecoder::release() {
+    if (!done) return NULL;
+    Surface* result = surface;
+    surface = NULL;
+    return result;
+}
+
+void ProgressivePNGDecoder::infoCallback(png_structp png, png_infop info) {
+    ProgressivePNGDecoder* decoder = static_cast<ProgressivePNGDecoder*>(png_get_progressive_ptr(png));
+
+    png_uint_32 width = 0;
+    png_uint_32 height = 0;
+    int depth = 0;
+    int color = -1;
+    png_get_IHDR(png, info, &width, &height, &depth, &color, NULL, NULL, NULL);
+
+    // Same output as Image#load(): 8 bit RGBA.
+    if (color == PNG_COLOR_TYPE_PALETTE)
+        png_set_expand(png);
+    if (color == PNG_COLOR_TYPE_GRAY)
+        png_set_expand(png);
+    if (png_get_valid(png, info, PNG_INFO_tRNS))
+        png_set_expand(png);
+    if (depth == 16)
+        png_set_strip_16(png);
+    if (depth < 8)
+        png_set_packing(png);
+    if (color == PNG_COLOR_TYPE_GRAY ||
+        color == PNG_COLOR_TYPE_GRAY_ALPHA)
+        png_set_gray_to_rgb(png);
+    png_set_add_alpha(png, 0xFF, PNG_FILLER_AFTER);
+
+    double gamma;
+    if (png_get_gAMA(png, info, &gamma))
+        png_set_gamma(png, 2.2, gamma);
+
+    // Interlaced rows arrive once per pass and are combined below.
+    png_set_interlace_handling(png);
+    png_read_update_info(png, info);
+
+    if (png_get_rowbytes(png, info) != width * 4) {
+        png_error(png, "Unsupported pixel format");
+    }
+
+    if (!ImageHeader::allowed(width, height)) {
+        png_error(png, "Image is too large");
+    }
+
+    decoder->width = width;
+    decoder->height = height;
+    decoder->surface = new Surface(width, height, true);
+    if (decoder->surface->pixels == NULL) {
+        png_error(png, "Out of memory");
+    }
+}
+
+void ProgressivePNGDecoder::rowCallback(png_structp png, png_bytep row, png_uint_32 y, int pass) {
+    // Rows that didn't change in this pass.
+    if (row == NULL) return;
+
+    ProgressivePNGDecoder* decoder = static_cast<ProgressivePNGDecoder*>(png_get_progressive_ptr(png));
+    png_progressive_combine_row(png, (png_bytep)(decoder->surface->pixels + y * decoder->width), row);
+}
+
+void ProgressivePNGDecoder::endCallback(png_structp png, png_infop info) {
+    static_cast<ProgressivePNGDecoder*>(png_get_progressive_ptr(png))->done = true;
+}
+
+void ProgressivePNGDecoder::errorCallback(png_structp png, png_const_charp message) {
+    ProgressivePNGDecoder* decoder = static_cast<ProgressivePNGDecoder*>(png_get_error_ptr(png));
+    decoder->error = message;
+    png_longjmp(png, 1);
+}
@@ -0,0 +1,46 @@
+#ifndef NODE_IMG_SRC_PROGRESSIVE_H
+#define NODE_IMG_SRC_PROGRESSIVE_H
+
+#include <png.h>
+
+#include <string>
+
+#include "surface.h"
+
+// Decodes a PNG while its data is still arriving, with libpng's progressive
+// reader. Every write() decodes as many rows as the data so far allows into
+// an RGBA surface, so decoding overlaps with reading the rest of the file.
+class ProgressivePNGDecoder {
+public:
+    ProgressivePNGDecoder();
+    ~ProgressivePNGDecoder();
+
+    // Decodes the next `length` bytes of the file. Returns false once the
+    // data turned out to be invalid, with the reason in `error`.
+    bool write(const char* data, size_t length);
+
+    // Whether the end of the image was reached.
+    inline bool finished() const { return done; }
+
+    // Hands over the decoded pixels, or NULL if the image wasn't finished.
+    Surface* release();
+
+    unsigned long width;
+    unsigned long height;
+    std::string error;
+
+protected:
+    static void infoCallback(png_structp png, png_infop info);
+    static void rowCallback(png_structp png, png_bytep row, png_uint_32 y, int pass);
+    static void endCallback(png_structp png, png_infop info);
+    static void errorCallback(png_structp png, png_const_charp message);
+
+    png_structp png;
+    png_infop info;
+    // Allocated once the header was read.
+    Surface* surface;
+    bool done;
+    bool failed;
+};
+
+#endif
@@ -0,0 +1,256 @@
+#include <string.h>
+#include <v8.h>
+#include <node.h>
+#include <node_buffer.h>
+
+#include <string>
+
+#include "quad.h"
+#include "blend.h"
+#include "reader.h"
+#include "header.h"
+#include "resample.h"
+#include "encoder.h"
+#include "options.h"
+#include "workers.h"
+#include "metrics.h"
+#include "pool.h"
+#include "macros.h"
+
+// Children in the order they are passed.
+enum { NW, NE, SW, SE, CHILDREN };
+
+struct QuadBaton : public EncodeOutput {
+    Persistent<Function> callback;
+    // NULL for missing children, which are transparent.
+    Persistent<Object> references[CHILDREN];
+    const char* data[CHILDREN];
+    size_t lengths[CHILDREN];
+    EncodeOptions options;
+    // Set when a child is corrupt or the parent couldn't be encoded.
+    const char* error;
+
+    char* result;
+    size_t length;
+    size_t max;
+
+    QuadBaton(Handle<Function> cb) : error(NULL), result(NULL), length(0), max(0) {
+        ev_ref(EV_DEFAULT_UC);
+        callback = Persistent<Function>::New(cb);
+        for (int i = 0; i < CHILDREN; i++) {
+            data[i] = NULL;
+            lengths[i] = 0;
+        }
+    }
+    ~QuadBaton() {
+        ev_unref(EV_DEFAULT_UC);
+        for (int i = 0; i < CHILDREN; i++) references[i].Dispose();
+        BufferPool::release(result);
+        callback.Dispose();
+    }
+
+    void write(const char* chunk, size_t size) {
+        if (failed) return;
+        if (max < length + size) {
+            reserve(length + size > 2 * max ? length + size : 2 * max);
+            if (max < length + size) reserve(length + size);
+            if (max < length + size) {
+                failed = true;
+                return;
+            }
+        }
+        memcpy(result + length, chunk, size);
+        length += size;
+    }
+    void reserve(size_t size) {
+        char* grown = (char*)BufferPool::grow(result, length, size);
+        if (grown == NULL) return;
+        result = grown;
+        max = BufferPool::capacity(result);
+    }
+};
+
+// Takes the children from `value` and checks their headers. Returns an error
+// message or NULL.
+static const char* Quad_Children(Handle<Value> value, QuadBaton* baton) {
+    if (!value->IsArray() || Handle<Array>::Cast(value)->Length() != CHILDREN) {
+        return "First argument must be an array of four Buffers or nulls.";
+    }
+    Handle<Array> children = Handle<Array>::Cast(value);
+
+    unsigned long width = 0;
+    unsigned long height = 0;
+    for (int i = 0; i < CHILDREN; i++) {
+        Local<Value> child = children->Get(i);
+        if (child->IsNull() || child->IsUndefined()) continue;
+        if (!Buffer::HasInstance(child)) {
+            return "First argument must be an array of four Buffers or nulls.";
+        }
+
+        Local<Object> buffer = child->ToObject();
+        baton->references[i] = Persistent<Object>::New(buffer);
+        baton->data[i] = Buffer::Data(buffer);
+        baton->lengths[i] = Buffer::Length(buffer);
+
+        ImageHeader header;
+        if (!header.read(baton->data[i], baton->lengths[i])) {
+            return "Unknown image format";
+        } else if (!ImageHeader::allowed(header.width, header.height)) {
+            return "Image is too large";
+        } else if (width == 0) {
+            width = header.width;
+            height = header.height;
+        } else if (header.width != width || header.height != height) {
+            return "Image dimensions don't match";
+        }
+    }
+
+    if (width == 0) return "At least one child tile is required";
+    if (width % 2 != 0 || height % 2 != 0) return "Tile dimensions must be even";
+    return NULL;
+}
+
+int EIO_Quad(eio_req *req) {
+    QuadBaton* baton = static_cast<QuadBaton*>(req->data);
+    StageClock clock;
+
+    ImageReader* children[CHILDREN];
+    unsigned long width = 0;
+    unsigned long height = 0;
+    bool alpha = false;
+    for (int i = 0; i < CHILDREN; i++) {
+        children[i] = NULL;
+        if (baton->data[i] == NULL) {
+            alpha = true;
+            continue;
+        }
+        children[i] = ImageReader::create(baton->data[i], baton->lengths[i]);
+        children[i]->begin(true);
+        width = children[i]->width;
+        height = children[i]->height;
+        alpha = alpha || children[i]->alpha;
+        Metrics::count(Metrics::BYTES_IN, baton->lengths[i]);
+    }
+    clock.lap(Metrics::DECODE);
+
+    // The parent has the size of a child; every child fills a quarter.
+    bool full = encodeNeedsImage(width, height, alpha, baton->options);
+    RowEncoder* encoder = NULL;
+    unsigned int* surface = NULL;
+    if (full) {
+        surface = (unsigned int*)BufferPool::allocate(width * height * 4);
+    } else {
+        encoder = new RowEncoder(width, height, alpha, baton->options, baton);
+    }
+    clock.lap(Metrics::ENCODE);
+
+    // Two rows of a child, and one row of the parent.
+    unsigned int* rows = (unsigned int*)BufferPool::allocate(3 * width * 4);
+    if (rows == NULL || (full && surface == NULL)) baton->error = "Out of memory";
+    for (unsigned long y = 0; y < height && baton->error == NULL; y++) {
+        unsigned int* parent = full ? surface + y * width : rows + 2 * width;
+        int first = 2 * y < height ? NW : SW;
+        for (int side = 0; side < 2; side++) {
+            ImageReader* child = children[first + side];
+            unsigned int* dst = parent + side * (width / 2);
+            if (child == NULL) {
+                memset(dst, 0, width / 2 * 4);
+                continue;
+            }
+            child->readRow((unsigned char*)rows);
+            child->readRow((unsigned char*)(rows + width));
+            clock.lap(Metrics::DECODE);
+            if (child->error != NULL) baton->error = child->error;
+            downsampleRows(rows, rows + width, dst, width);
+            clock.lap(Metrics::RESAMPLE);
+        }
+        if (!full) {
+            encoder->write(parent);
+            clock.lap(Metrics::ENCODE);
+        }
+    }
+    BufferPool::release(rows);
+
+    if (baton->error != NULL) {
+        BufferPool::release(surface);
+        delete encoder;
+    } else if (full) {
+        baton->error = encodeImage((unsigned char*)surface, width, height, width * 4,
+                                   alpha, baton->options, baton);
+        BufferPool::release(surface);
+    } else {
+        encoder->finish();
+        baton->error = encoder->error();
+        delete encoder;
+    }
+    clock.lap(Metrics::ENCODE);
+
+    for (int i = 0; i < CHILDREN; i++) delete children[i];
+    clock.record();
+    Metrics::count(Metrics::PIXELS, (uint64_t)width * height);
+    Metrics::count(Metrics::BYTES_OUT, baton->length);
+    return 0;
+}
+
+int EIO_AfterQuad(eio_req *req) {
+    HandleScope scope;
+    QuadBaton* baton = static_cast<QuadBaton*>(req->data);
+    Metrics::end();
+
+    if (!baton->callback.IsEmpty() && baton->error != NULL) {
+        Local<Value> argv[] = {
+            Local<Value>::New(Exception::Error(String::New(baton->error)))
+        };
+        TRY_CATCH_CALL(Context::GetCurrent()->Global(), baton->callback, 1, argv);
+    } else if (!baton->callback.IsEmpty()) {
+        Local<Value> argv[] = {
+            Local<Value>::New(Null()),
+            // The buffer takes over the encoded data.
+            Local<Value>::New(Buffer::New(baton->result, baton->length,
+                                          BufferPool::releaseCallback, NULL)->handle_)
+        };
+        baton->result = NULL;
+        TRY_CATCH_CALL(Context::GetCurrent()->Global(), baton->callback, 2, argv);
+    }
+
+    delete baton;
+    return 0;
+}
+
+// img.quad([nw, ne, sw, se], [options], callback) builds the parent of four
+// map tiles at the next lower zoom level: every child is downsampled 2x2 into
+// its quarter of the parent in a single pass, and the result is encoded like
+// blend() output. Missing children (null) leave their quarter transparent.
+Handle<Value> Quad(const Arguments& args) {
+    HandleScope scope;
+
+    Local<Object> options;
+    Local<Function> callback;
+    Handle<Value> exception = Blend_Arguments(args, options, callback);
+    if (!exception.IsEmpty()) return exception;
+
+    QuadBaton* baton = new QuadBaton(callback);
+    const char* message = args.Length() < 1 ?
+        "First argument must be an array of four Buffers or nulls." :
+        Quad_Children(args[0], baton);
+    if (message != NULL) {
+        delete baton;
+        return ThrowOrCall(callback, message);
+    }
+
+    if (!options.IsEmpty()) {
+        std::string error;
+        if (!ParseEncodeOptions(options, baton->options, error)) {
+            delete baton;
+            return ThrowOrCall(callback, error.c_str());
+        }
+    }
+
+    if (!WorkerPool::submit(EIO_Quad, EIO_AfterQuad, baton)) {
+        delete baton;
+        return ThrowOrCall(callback, "Too many queued jobs");
+    }
+    Metrics::begin();
+
+    return scope.Close(Undefined());
+}
@@ -0,0 +1,12 @@
+#ifndef NODE_IMG_SRC_QUAD_H
+#define NODE_IMG_SRC_QUAD_H
+
+#include <v8.h>
+#include <node.h>
+
+using namespace v8;
+using namespace node;
+
+Handle<Value> Quad(const Arguments& args);
+
+#endif
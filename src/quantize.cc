@@ -0,0 +1,249 @@
+#include <algorithm>
+
+#include "quantize.h"
+
+// Upper bound for distinct colors in the histogram; beyond that, colors are
+// reduced in precision.
+static const size_t maxEntries = 1 << 16;
+
+Quantizer::Quantizer(int c) : transparent(0), colors(c), shift(0),
+    mask(0xFFFFFFFF), table(1024, -1), clear(0), clearIndex(0) {
+    if (colors < 2) colors = 2;
+    if (colors > 256) colors = 256;
+}
+
+Quantizer::~Quantizer() {}
+
+static inline size_t hashColor(unsigned int color, size_t size) {
+    return (color * 2654435761u) & (size - 1);
+}
+
+Quantizer::Entry* Quantizer::find(unsigned int color) const {
+    size_t size = table.size();
+    for (size_t i = hashColor(color, size); table[i] >= 0; i = (i + 1) & (size - 1)) {
+        const Entry* entry = &entries[table[i]];
+        if (entry->color == color) return const_cast<Entry*>(entry);
+    }
+    return NULL;
+}
+
+void Quantizer::insert(unsigned int color, unsigned int count) {
+    color &= mask;
+
+    size_t size = table.size();
+    size_t i = hashColor(color, size);
+    for (; table[i] >= 0; i = (i + 1) & (size - 1)) {
+        if (entries[table[i]].color == color) {
+            entries[table[i]].count += count;
+            return;
+        }
+    }
+
+    Entry entry = { color, count, 0 };
+    table[i] = entries.size();
+    entries.push_back(entry);
+
+    if (entries.size() * 2 > size || entries.size() > maxEntries) grow();
+}
+
+void Quantizer::grow() {
+    std::vector<Entry> old;
+    old.swap(entries);
+
+    if (old.size() > maxEntries) {
+        // Drop one more bit of precision from the color channels.
+        shift++;
+        unsigned int channel = (0xFF << shift) & 0xFF;
+        mask = 0xFF000000 | (channel << 16) | (channel << 8) | channel;
+    }
+
+    size_t size = table.size();
+    while (size < old.size() * 4) size *= 2;
+    table.assign(size, -1);
+
+    for (size_t i = 0; i < old.size(); i++) {
+        insert(old[i].color, old[i].count);
+    }
+}
+
+void Quantizer::add(const unsigned int* pixels, size_t length) {
+    // Pixels often come in runs, so only count each run once.
+    size_t i = 0;
+    while (i < length) {
+        unsigned int color = pixels[i];
+        size_t run = i + 1;
+        while (run < length && pixels[run] == color) run++;
+
+        if (color <= 0x00FFFFFF) {
+            clear += run - i;
+        } else {
+            insert(color, run - i);
+        }
+        i = run;
+    }
+}
+
+struct Box {
+    size_t begin;
+    size_t end;
+    int channel;
+    double score;
+};
+
+// Value of one channel of the premultiplied color; channel 3 is alpha.
+static inline unsigned int channelValue(unsigned int color, int channel) {
+    unsigned int alpha = color >> 24;
+    if (channel == 3) return alpha * 255;
+    return ((color >> (8 * channel)) & 0xFF) * alpha;
+}
+
+struct ChannelOrder {
+    int channel;
+    template <class T>
+    bool operator()(const T& a, const T& b) const {
+        return channelValue(a.color, channel) < channelValue(b.color, channel);
+    }
+};
+
+// Scores a box by its population times the range of its widest channel.
+template <class T>
+static void measure(Box& box, const std::vector<T>& sorted) {
+    unsigned int min[4] = { 0xFFFFFFFF, 0xFFFFFFFF, 0xFFFFFFFF, 0xFFFFFFFF };
+    unsigned int max[4] = { 0, 0, 0, 0 };
+    double population = 0;
+    for (size_t i = box.begin; i < box.end; i++) {
+        for (int c = 0; c < 4; c++) {
+            unsigned int v = channelValue(sorted[i].color, c);
+            if (v < min[c]) min[c] = v;
+            if (v > max[c]) max[c] = v;
+        }
+        population += sorted[i].count;
+    }
+
+    box.channel = 0;
+    box.score = 0;
+    if (box.end - box.begin < 2) return;
+    for (int c = 0; c < 4; c++) {
+        double score = (double)(max[c] - min[c]) * population;
+        if (score > box.score) {
+            box.score = score;
+            box.channel = c;
+        }
+    }
+}
+
+void Quantizer::finish() {
+    palette.clear();
+    size_t reserved = clear ? 1 : 0;
+
+    // Boxes are ranges of this copy of the histogram, which is reordered
+    // while splitting.
+    std::vector<Entry> sorted(entries);
+    std::vector<Box> boxes;
+    if (!sorted.empty()) {
+        Box all = { 0, sorted.size(), 0, 0 };
+        measure(all, sorted);
+        boxes.push_back(all);
+    }
+
+    size_t target = colors - reserved;
+    while (boxes.size() < target) {
+        size_t best = 0;
+        for (size_t b = 1; b < boxes.size(); b++) {
+            if (boxes[b].score > boxes[best].score) best = b;
+        }
+        if (boxes.empty() || boxes[best].score <= 0) break;
+
+        // Split at the weighted median of the widest channel.
+        Box& box = boxes[best];
+        ChannelOrder order = { box.channel };
+        std::sort(sorted.begin() + box.begin, sorted.begin() + box.end, order);
+
+        double total = 0;
+        for (size_t i = box.begin; i < box.end; i++) total += sorted[i].count;
+        double sum = 0;
+        size_t split = box.begin + 1;
+        for (size_t i = box.begin; i < box.end - 1; i++) {
+            sum += sorted[i].count;
+            split = i + 1;
+            if (sum >= total / 2) break;
+        }
+
+        Box upper = { split, box.end, 0, 0 };
+        box.end = split;
+        measure(box, sorted);
+        measure(upper, sorted);
+        boxes.push_back(upper);
+    }
+
+    // Masked colors are biased towards zero; compensate by half a step.
+    unsigned int bias = (1 << shift) >> 1;
+
+    // Average every box, weighting colors by their alpha.
+    std::vector<unsigned int> averages;
+    for (size_t b = 0; b < boxes.size(); b++) {
+        double weight = 0, alpha = 0, sum[3] = { 0, 0, 0 };
+        for (size_t i = boxes[b].begin; i < boxes[b].end; i++) {
+            unsigned int color = sorted[i].color;
+            double count = sorted[i].count;
+            double a = color >> 24;
+            weight += count;
+            alpha += count * a;
+            for (int c = 0; c < 3; c++) {
+                sum[c] += count * a * (((color >> (8 * c)) & 0xFF) + bias);
+            }
+        }
+        unsigned int result = (unsigned int)(alpha / weight + 0.5) << 24;
+        for (int c = 0; c < 3; c++) {
+            unsigned int v = (unsigned int)(sum[c] / alpha + 0.5);
+            result |= (v > 255 ? 255 : v) << (8 * c);
+        }
+        averages.push_back(result);
+    }
+
+    // Order entries with transparency first, as required by tRNS.
+    transparent = 0;
+    if (clear) {
+        palette.push_back(0);
+        clearIndex = 0;
+        transparent++;
+    }
+    for (int pass = 0; pass < 2; pass++) {
+        for (size_t b = 0; b < averages.size(); b++) {
+            bool opaque = (averages[b] >> 24) == 0xFF;
+            if (opaque != (pass == 1)) continue;
+            unsigned char index = palette.size();
+            palette.push_back(averages[b]);
+            if (!opaque) transparent++;
+
+            for (size_t i = boxes[b].begin; i < boxes[b].end; i++) {
+                find(sorted[i].color)->index = index;
+            }
+        }
+    }
+
+    if (palette.empty()) {
+        palette.push_back(0);
+        transparent = 1;
+    }
+}
+
+unsigned char Quantizer::index(unsigned int pixel) const {
+    if (pixel <= 0x00FFFFFF) return clearIndex;
+    Entry* entry = find(pixel & mask);
+    return entry ? entry->index : 0;
+}
+
+void Quantizer::remap(const unsigned int* pixels, unsigned char* indices, size_t length) const {
+    unsigned int last = 0;
+    unsigned char lastIndex = length ? index(pixels[0]) : 0;
+    if (length) last = pixels[0];
+
+    for (size_t i = 0; i < length; i++) {
+        if (pixels[i] != last) {
+            last = pixels[i];
+            lastIndex = index(last);
+        }
+        indices[i] = lastIndex;
+    }
+}
@@ -0,0 +1,57 @@
+#ifndef NODE_IMG_SRC_QUANTIZE_H
+#define NODE_IMG_SRC_QUANTIZE_H
+
+#include <cstddef>
+#include <vector>
+
+// Reduces straight alpha RGBA pixels (little endian ABGR words) to a palette
+// of at most `colors` entries with median cut. Images that already have few
+// enough colors get an exact palette.
+class Quantizer {
+public:
+    Quantizer(int colors = 256);
+    ~Quantizer();
+
+    // Builds the palette for `length` pixels at `pixels`. The rows of a
+    // surface can be added one after another before calling finish().
+    void add(const unsigned int* pixels, size_t length);
+    void finish();
+
+    // Palette index of a pixel that was passed to add().
+    unsigned char index(unsigned int pixel) const;
+
+    // Maps `length` pixels to palette indices.
+    void remap(const unsigned int* pixels, unsigned char* indices, size_t length) const;
+
+    // Palette entries as ABGR words. Entries with transparency come first so
+    // that the tRNS chunk only needs to cover `transparent` entries.
+    std::vector<unsigned int> palette;
+    int transparent;
+
+protected:
+    struct Entry {
+        unsigned int color;
+        unsigned int count;
+        unsigned char index;
+    };
+
+    void insert(unsigned int color, unsigned int count);
+    void grow();
+    Entry* find(unsigned int color) const;
+    void split();
+
+    int colors;
+    // Number of low bits dropped from every channel so that the histogram
+    // stays small for photographic images.
+    int shift;
+    unsigned int mask;
+
+    // Open addressing hash table of the distinct colors. Fully transparent
+    // pixels are all counted in `clear`.
+    std::vector<Entry> entries;
+    std::vector<int> table;
+    unsigned int clear;
+    int clearIndex;
+};
+
+#endif
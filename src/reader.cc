@@ -1,14 +1,41 @@
+#include <cstdlib>
+#include <cstring>
+#include <stdio.h>
+#include <jpeglib.h>
+#include <jerror.h>
+
 #include "reader.h"
+#include "uniform.h"
+#include "pool.h"
+
+bool ImageReader::isJPEG(const char* surface, size_t len) {
+    return len >= 3 && (unsigned char)surface[0] == 0xFF &&
+           (unsigned char)surface[1] == 0xD8 && (unsigned char)surface[2] == 0xFF;
+}
+
+ImageReader* ImageReader::create(const char* surface, size_t len, int scale) {
+    if (isJPEG(surface, len)) {
+        return new JPEGImageReader(surface, len, scale);
+    }
+
+    if (len >= 8 && png_sig_cmp((png_bytep)surface, 0, 8) == 0) {
+        PNGImageReader* reader = new PNGImageReader(surface, len);
 
-ImageReader* ImageReader::create(const char* surface, size_t len) {
-    if (png_sig_cmp((png_bytep)surface, 0, 8) == 0) {
-        return new PNGImageReader(surface, len);
+        unsigned int color = reader->uniformColor;
+        if (reader->uniform || UniformRegistry::lookup(surface, len, &color)) {
+            ImageReader* uniform = new UniformImageReader(reader->width, reader->height, color);
+            delete reader;
+            return uniform;
+        }
+
+        return reader;
     }
 
     return NULL;
 }
 
-PNGImageReader::PNGImageReader(const char* src, size_t len) : ImageReader() {
+PNGImageReader::PNGImageReader(const char* src, size_t len) : ImageReader(),
+    interlaced(false), surface(NULL), rowbytes(0) {
     source = src;
     length = len;
 
@@ -17,12 +44,43 @@ PNGImageReader::PNGImageReader(const char* src, size_t len) : ImageReader() {
     info = png_create_info_struct(png);
     png_set_read_fn(png, this, readCallback);
     png_read_info(png, info);
-    png_get_IHDR(png, info, &width, &height, &depth, &color, NULL, NULL, NULL);
+    png_uint_32 w = 0, h = 0;
+    int interlace = PNG_INTERLACE_NONE;
+    png_get_IHDR(png, info, &w, &h, &depth, &color, &interlace, NULL, NULL);
+    width = w;
+    height = h;
+    interlaced = interlace != PNG_INTERLACE_NONE;
     alpha = (color & PNG_COLOR_MASK_ALPHA) || png_get_valid(png, info, PNG_INFO_tRNS);
+
+    // Paletted images with a single color or only fully transparent entries
+    // are uniform. Gamma correction would alter the palette color, so those
+    // are decoded normally.
+    png_colorp palette = NULL;
+    int colors = 0;
+    if (color == PNG_COLOR_TYPE_PALETTE && png_get_PLTE(png, info, &palette, &colors)) {
+        png_bytep trans = NULL;
+        int transparent = 0;
+        if (png_get_valid(png, info, PNG_INFO_tRNS)) {
+            png_get_tRNS(png, info, &trans, &transparent, NULL);
+        }
+
+        if (transparent >= colors) {
+            uniform = true;
+            for (int i = 0; uniform && i < colors; i++) uniform = trans[i] == 0;
+        }
+
+        if (!uniform && colors == 1 && !png_get_valid(png, info, PNG_INFO_gAMA)) {
+            uniform = true;
+            uniformColor = ((transparent ? trans[0] : 0xFFu) << 24) |
+                (palette[0].blue << 16) | (palette[0].green << 8) | palette[0].red;
+            if (uniformColor <= 0x00FFFFFF) uniformColor = 0;
+        }
+    }
 }
 
 PNGImageReader::~PNGImageReader() {
     png_destroy_read_struct(&png, &info, NULL);
+    BufferPool::release(surface);
 }
 
 void PNGImageReader::readCallback(png_structp png, png_bytep data, png_size_t length) {
@@ -39,7 +97,7 @@ void PNGImageReader::readCallback(png_structp png, png_bytep data, png_size_t le
 }
 
 
-void PNGImageReader::decode(unsigned char* surface, bool alpha) {
+void PNGImageReader::setTransforms(bool alpha) {
     // From http://trac.mapnik.org/browser/trunk/src/png_reader.cpp
     if (color == PNG_COLOR_TYPE_PALETTE)
         png_set_expand(png);
@@ -66,10 +124,17 @@ void PNGImageReader::decode(unsigned char* surface, bool alpha) {
     if (png_get_gAMA(png, info, &gamma))
         png_set_gamma(png, 2.2, gamma);
 
+    if (interlaced)
+        png_set_interlace_handling(png);
+
     png_read_update_info(png, info);
+}
+
+void PNGImageReader::decode(unsigned char* surface, bool alpha) {
+    setTransforms(alpha);
 
     unsigned int rowbytes = png_get_rowbytes(png, info);
-    assert(width * 4 == rowbytes);
+    assert(width * (alpha ? 4 : 3) == rowbytes);
 
     png_bytep row_pointers[height];
     for (unsigned i = 0; i < height; i++) {
@@ -81,3 +146,274 @@ void PNGImageReader::decode(unsigned char* surface, bool alpha) {
 
     png_read_end(png, NULL);
 }
+
+void PNGImageReader::begin(bool alpha) {
+    if (!interlaced) {
+        setTransforms(alpha);
+        rowbytes = png_get_rowbytes(png, info);
+    } else {
+        rowbytes = width * (alpha ? 4 : 3);
+        surface = (unsigned char*)BufferPool::allocate(height * rowbytes);
+        if (surface == NULL) {
+            error = "Out of memory";
+        } else {
+            decode(surface, alpha);
+        }
+    }
+    row = 0;
+}
+
+void PNGImageReader::readRow(unsigned char* dst) {
+    assert(row < height);
+    if (error != NULL) {
+        if (dst != NULL) memset(dst, 0, rowbytes);
+    } else if (surface == NULL) {
+        png_read_row(png, dst, NULL);
+    } else if (dst != NULL) {
+        memcpy(dst, surface + row * rowbytes, rowbytes);
+    }
+    row++;
+}
+
+JPEGImageReader::JPEGImageReader(const char* src, size_t len, int scale)
+    : ImageReader(), outputAlpha(true), inverted(false), scanline(NULL) {
+    source = src;
+    length = len;
+
+    info.err = jpeg_std_error(&errors.base);
+    errors.base.error_exit = errorExit;
+    errors.base.output_message = outputMessage;
+    jpeg_create_decompress(&info);
+
+    // Read straight from the buffer.
+    manager.next_input_byte = NULL;
+    manager.bytes_in_buffer = 0;
+    manager.init_source = initSource;
+    manager.fill_input_buffer = fillInputBuffer;
+    manager.skip_input_data = skipInputData;
+    manager.resync_to_restart = jpeg_resync_to_restart;
+    manager.term_source = termSource;
+    info.src = &manager;
+    info.client_data = this;
+
+    if (setjmp(errors.jump)) {
+        fail();
+        return;
+    }
+    jpeg_read_header(&info, TRUE);
+
+    // Gray and CMYK are decoded as they are and expanded row by row, since
+    // not every libjpeg converts them to RGB.
+    if (info.jpeg_color_space == JCS_GRAYSCALE) {
+        info.out_color_space = JCS_GRAYSCALE;
+    } else if (info.jpeg_color_space == JCS_CMYK || info.jpeg_color_space == JCS_YCCK) {
+        info.out_color_space = JCS_CMYK;
+        inverted = info.saw_Adobe_marker;
+    } else {
+        info.out_color_space = JCS_RGB;
+    }
+
+    info.scale_num = 1;
+    info.scale_denom = scale;
+    jpeg_calc_output_dimensions(&info);
+
+    width = info.output_width;
+    height = info.output_height;
+    depth = 8;
+    color = info.out_color_space;
+    alpha = false;
+}
+
+void JPEGImageReader::errorExit(j_common_ptr info) {
+    longjmp(reinterpret_cast<ErrorManager*>(info->err)->jump, 1);
+}
+
+void JPEGImageReader::outputMessage(j_common_ptr info) {}
+
+void JPEGImageReader::fail() {
+    error = "Invalid JPEG";
+    // The decompressor is unusable after an error.
+    jpeg_abort_decompress(&info);
+}
+
+JPEGImageReader::~JPEGImageReader() {
+    jpeg_destroy_decompress(&info);
+    BufferPool::release(scanline);
+}
+
+void JPEGImageReader::initSource(j_decompress_ptr info) {
+    JPEGImageReader* reader = static_cast<JPEGImageReader*>(info->client_data);
+    reader->manager.next_input_byte = (const JOCTET*)reader->source;
+    reader->manager.bytes_in_buffer = reader->length;
+}
+
+boolean JPEGImageReader::fillInputBuffer(j_decompress_ptr info) {
+    // The whole buffer was handed over in initSource(), so the data is
+    // truncated.
+    ERREXIT(info, JERR_INPUT_EOF);
+    return FALSE;
+}
+
+void JPEGImageReader::skipInputData(j_decompress_ptr info, long count) {
+    if (count <= 0) return;
+    if ((size_t)count > info->src->bytes_in_buffer) {
+        fillInputBuffer(info);
+    } else {
+        info->src->next_input_byte += count;
+        info->src->bytes_in_buffer -= count;
+    }
+}
+
+void JPEGImageReader::termSource(j_decompress_ptr info) {}
+
+void JPEGImageReader::decode(unsigned char* surface, bool alpha) {
+    begin(alpha);
+    for (unsigned long y = 0; y < height; y++) {
+        readRow(surface + y * width * (alpha ? 4 : 3));
+    }
+}
+
+void JPEGImageReader::begin(bool alpha) {
+    outputAlpha = alpha;
+    row = 0;
+    if (error != NULL) return;
+
+    scanline = (unsigned char*)BufferPool::allocate(width * info.output_components);
+    if (scanline == NULL) {
+        error = "Out of memory";
+        return;
+    }
+    if (setjmp(errors.jump)) {
+        fail();
+        return;
+    }
+    jpeg_start_decompress(&info);
+}
+
+void JPEGImageReader::readRow(unsigned char* dst) {
+    assert(row < height);
+    int bytes = outputAlpha ? 4 : 3;
+    row++;
+
+    if (error == NULL) {
+        if (setjmp(errors.jump)) {
+            fail();
+        } else {
+            JSAMPROW rows[] = { scanline };
+            jpeg_read_scanlines(&info, rows, 1);
+        }
+    }
+    if (dst == NULL) return;
+    if (error != NULL) {
+        memset(dst, 0, width * bytes);
+        return;
+    }
+
+    const unsigned char* src = scanline;
+    for (unsigned long x = 0; x < width; x++, dst += bytes) {
+        switch (info.out_color_space) {
+            case JCS_GRAYSCALE:
+                dst[0] = dst[1] = dst[2] = src[0];
+                src += 1;
+                break;
+            case JCS_CMYK: {
+                int c = src[0], m = src[1], y = src[2], k = src[3];
+                if (!inverted) {
+                    c = 255 - c; m = 255 - m; y = 255 - y; k = 255 - k;
+                }
+                dst[0] = c * k / 255;
+                dst[1] = m * k / 255;
+                dst[2] = y * k / 255;
+                src += 4;
+                break;
+            }
+            default:
+                dst[0] = src[0];
+                dst[1] = src[1];
+                dst[2] = src[2];
+                src += 3;
+        }
+        if (outputAlpha) dst[3] = 0xFF;
+    }
+}
+
+UniformImageReader::UniformImageReader(unsigned long w, unsigned long h, unsigned int color)
+    : ImageReader(), outputAlpha(true) {
+    width = w;
+    height = h;
+    depth = 8;
+    alpha = (color >> 24) != 0xFF;
+    uniform = true;
+    uniformColor = color;
+}
+
+void UniformImageReader::decode(unsigned char* surface, bool alpha) {
+    begin(alpha);
+    for (unsigned long y = 0; y < height; y++) {
+        readRow(surface + y * width * (alpha ? 4 : 3));
+    }
+}
+
+void UniformImageReader::begin(bool alpha) {
+    outputAlpha = alpha;
+    row = 0;
+}
+
+void UniformImageReader::readRow(unsigned char* dst) {
+    assert(row < height);
+    if (dst != NULL) {
+        if (outputAlpha) {
+            unsigned int* pixels = (unsigned int*)dst;
+            for (unsigned long x = 0; x < width; x++) pixels[x] = uniformColor;
+        } else {
+            for (unsigned long x = 0; x < width; x++) {
+                dst[3 * x] = uniformColor & 0xff;
+                dst[3 * x + 1] = (uniformColor >> 8) & 0xff;
+                dst[3 * x + 2] = (uniformColor >> 16) & 0xff;
+            }
+        }
+    }
+    row++;
+}
+
+SurfaceImageReader::SurfaceImageReader(Surface* src)
+    : ImageReader(), surface(src), outputAlpha(true) {
+    surface->ref();
+    width = surface->width;
+    height = surface->height;
+    depth = 8;
+    alpha = surface->alpha;
+}
+
+SurfaceImageReader::~SurfaceImageReader() {
+    surface->unref();
+}
+
+void SurfaceImageReader::decode(unsigned char* dst, bool alpha) {
+    begin(alpha);
+    for (unsigned long y = 0; y < height; y++) {
+        readRow(dst + y * width * (alpha ? 4 : 3));
+    }
+}
+
+void SurfaceImageReader::begin(bool alpha) {
+    outputAlpha = alpha;
+    row = 0;
+}
+
+void SurfaceImageReader::readRow(unsigned char* dst) {
+    assert(row < height);
+    const unsigned int* pixels = surface->pixels + row * width;
+    if (dst == NULL) {
+        // Nothing to do.
+    } else if (outputAlpha) {
+        memcpy(dst, pixels, width * 4);
+    } else {
+        for (unsigned long x = 0; x < width; x++) {
+            dst[3 * x] = pixels[x] & 0xff;
+            dst[3 * x + 1] = (pixels[x] >> 8) & 0xff;
+            dst[3 * x + 2] = (pixels[x] >> 16) & 0xff;
+        }
+    }
+    row++;
+}
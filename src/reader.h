@@ -3,6 +3,11 @@
 
 #include <png.h>
 #include <assert.h>
+#include <setjmp.h>
+#include <stdio.h>
+#include <jpeglib.h>
+
+#include "surface.h"
 
 #include <string>
 #include <queue>
@@ -13,16 +18,42 @@ public:
     inline unsigned long getheight() { return height; }
     inline bool getAlpha() { return alpha; }
     virtual void decode(unsigned char* surface, bool alpha = true) = 0;
+
+    // Row-by-row decoding: begin() sets up the output format, then every call
+    // to readRow() decodes the next row into `dst`. Passing NULL decodes and
+    // discards the row.
+    virtual void begin(bool alpha = true) = 0;
+    virtual void readRow(unsigned char* dst) = 0;
+
+    // Discards rows until `y` is the next row readRow() returns.
+    void skipTo(unsigned long y) {
+        while (row < y) readRow(NULL);
+    }
+
     ImageReader() : width(0), height(0), depth(0), color(-1), alpha(false),
-                    source(NULL), length(0), pos(0) {}
+                    uniform(false), uniformColor(0),
+                    row(0), error(NULL), source(NULL), length(0), pos(0) {}
+    virtual ~ImageReader() {}
 
-    static ImageReader* create(const char* surface, size_t len);
+    // Returns a reader for the PNG or JPEG in `surface`, or NULL for other
+    // formats. JPEGs are decoded at 1/`scale` of their size.
+    static ImageReader* create(const char* surface, size_t len, int scale = 1);
+    static bool isJPEG(const char* surface, size_t len);
 
     unsigned long width;
     unsigned long height;
     int depth;
     int color;
     bool alpha;
+    // Set when the header alone shows that every pixel has the same color,
+    // which is stored as a straight alpha ABGR word in `uniformColor`.
+    bool uniform;
+    unsigned int uniformColor;
+    // Index of the next row readRow() decodes.
+    unsigned long row;
+    // Set when the data turned out to be corrupt or truncated, possibly
+    // already by the constructor. The remaining rows are transparent black.
+    const char* error;
 protected:
     const char* source;
     size_t length;
@@ -34,14 +65,89 @@ public:
     PNGImageReader(const char* src, size_t len);
     ~PNGImageReader();
     void decode(unsigned char* surface, bool alpha);
+    void begin(bool alpha);
+    void readRow(unsigned char* dst);
 
 protected:
+    void setTransforms(bool alpha);
     static void readCallback(png_structp png, png_bytep data, png_size_t length);
     static void writeCallback(png_structp png, png_bytep data, png_size_t length);
 
 protected:
     png_structp png;
     png_infop info;
+    bool interlaced;
+
+    // Interlaced images can't be read one row at a time and are decoded in
+    // full by begin(); readRow() then copies from this surface.
+    unsigned char* surface;
+    unsigned long rowbytes;
+};
+
+// Decodes JPEGs with libjpeg. A `scale` of 2, 4 or 8 decodes the image at
+// that fraction of its size straight from the DCT coefficients, which is much
+// cheaper than decoding it in full and downsampling afterwards.
+class JPEGImageReader : public ImageReader {
+public:
+    JPEGImageReader(const char* src, size_t len, int scale = 1);
+    ~JPEGImageReader();
+    void decode(unsigned char* surface, bool alpha);
+    void begin(bool alpha);
+    void readRow(unsigned char* dst);
+
+protected:
+    // libjpeg calls exit() on errors by default; errorExit() jumps back to
+    // the setjmp() in the reader method that called into libjpeg instead.
+    struct ErrorManager {
+        struct jpeg_error_mgr base;
+        jmp_buf jump;
+    };
+    static void errorExit(j_common_ptr info);
+    static void outputMessage(j_common_ptr info);
+    void fail();
+
+    static void initSource(j_decompress_ptr info);
+    static boolean fillInputBuffer(j_decompress_ptr info);
+    static void skipInputData(j_decompress_ptr info, long count);
+    static void termSource(j_decompress_ptr info);
+
+protected:
+    struct jpeg_decompress_struct info;
+    ErrorManager errors;
+    struct jpeg_source_mgr manager;
+    bool outputAlpha;
+    // Adobe CMYK JPEGs store inverted values.
+    bool inverted;
+
+    // One row in the decoder's output color space.
+    unsigned char* scanline;
+};
+
+// Produces a single color without decoding anything. Used for images that
+// are known to be uniform.
+class UniformImageReader : public ImageReader {
+public:
+    UniformImageReader(unsigned long w, unsigned long h, unsigned int color);
+    void decode(unsigned char* surface, bool alpha);
+    void begin(bool alpha);
+    void readRow(unsigned char* dst);
+
+protected:
+    bool outputAlpha;
+};
+
+// Reads rows from an already decoded surface, e.g. from the layer cache.
+class SurfaceImageReader : public ImageReader {
+public:
+    SurfaceImageReader(Surface* surface);
+    ~SurfaceImageReader();
+    void decode(unsigned char* surface, bool alpha);
+    void begin(bool alpha);
+    void readRow(unsigned char* dst);
+
+protected:
+    Surface* surface;
+    bool outputAlpha;
 };
 
 #endif
@@ -0,0 +1,180 @@
+#include <cmath>
+#include <cstring>
+
+#include <vector>
+
+#include "resample.h"
+#include "pool.h"
+
+// One pixel as red, green, blue multiplied by alpha (0 to 65025), and alpha.
+typedef float Pixel __attribute__((vector_size(16)));
+
+static inline Pixel premultiply(unsigned int pixel) {
+    float a = pixel >> 24;
+    Pixel p = { (float)(pixel & 0xff), (float)((pixel >> 8) & 0xff),
+                (float)((pixel >> 16) & 0xff), 1.0f };
+    Pixel alpha = { a, a, a, a };
+    return p * alpha;
+}
+
+static inline unsigned int clampRound(float value) {
+    if (!(value > 0.0f)) return 0;
+    if (value >= 255.0f) return 255;
+    return (unsigned int)(value + 0.5f);
+}
+
+static inline unsigned int unpremultiply(Pixel p) {
+    unsigned int a = clampRound(p[3]);
+    if (a == 0) return 0;
+    // Colors are divided by the unrounded alpha; negative filter lobes can
+    // push them out of range, which the rounding clamps.
+    float scale = 1.0f / p[3];
+    return (a << 24) | (clampRound(p[2] * scale) << 16) |
+           (clampRound(p[1] * scale) << 8) | clampRound(p[0] * scale);
+}
+
+static inline Pixel splat(float value) {
+    Pixel p = { value, value, value, value };
+    return p;
+}
+
+static double sinc(double x) {
+    if (x == 0.0) return 1.0;
+    x *= M_PI;
+    return sin(x) / x;
+}
+
+static double kernel(ResampleFilter filter, double x) {
+    x = fabs(x);
+    switch (filter) {
+        case RESAMPLE_BOX: return x <= 0.5 ? 1.0 : 0.0;
+        case RESAMPLE_BILINEAR: return x < 1.0 ? 1.0 - x : 0.0;
+        case RESAMPLE_LANCZOS: return x < 3.0 ? sinc(x) * sinc(x / 3.0) : 0.0;
+    }
+    return 0.0;
+}
+
+static double support(ResampleFilter filter) {
+    switch (filter) {
+        case RESAMPLE_BOX: return 0.5;
+        case RESAMPLE_BILINEAR: return 1.0;
+        case RESAMPLE_LANCZOS: return 3.0;
+    }
+    return 1.0;
+}
+
+// The source pixels and normalized weights each output pixel along one axis
+// is made of.
+struct Weights {
+    std::vector<unsigned long> first;
+    std::vector<unsigned long> count;
+    // `stride` weights per output pixel.
+    std::vector<float> weights;
+    unsigned long stride;
+
+    Weights(unsigned long src, unsigned long dst, ResampleFilter filter) :
+        first(dst), count(dst) {
+        // When shrinking, the kernel is stretched over the covered pixels.
+        double scale = (double)src / dst;
+        double stretch = scale > 1.0 ? scale : 1.0;
+        double radius = support(filter) * stretch;
+        stride = (unsigned long)ceil(radius) * 2 + 1;
+        weights.resize(dst * stride);
+
+        for (unsigned long i = 0; i < dst; i++) {
+            double center = (i + 0.5) * scale;
+            long begin = (long)floor(center - radius);
+            long end = (long)ceil(center + radius);
+            if (begin < 0) begin = 0;
+            if (end > (long)src) end = src;
+
+            double total = 0.0;
+            unsigned long n = 0;
+            float* w = &weights[i * stride];
+            for (long j = begin; j < end && n < stride; j++, n++) {
+                w[n] = kernel(filter, (j + 0.5 - center) / stretch);
+                total += w[n];
+            }
+            // Trim zero weights at both ends.
+            unsigned long skip = 0;
+            while (skip < n && w[skip] == 0.0f) skip++;
+            while (n > skip && w[n - 1] == 0.0f) n--;
+            if (skip > 0) memmove(w, w + skip, (n - skip) * sizeof(float));
+
+            if (n == skip) {
+                // Scaling up with a box filter can fall between two pixels.
+                first[i] = (unsigned long)center < src ? (unsigned long)center : src - 1;
+                count[i] = 1;
+                w[0] = 1.0f;
+                continue;
+            }
+            first[i] = begin + skip;
+            count[i] = n - skip;
+            for (unsigned long k = 0; k < count[i]; k++) w[k] /= total;
+        }
+    }
+};
+
+bool resample(const unsigned int* src, unsigned long srcWidth, unsigned long srcHeight,
+              size_t stride, unsigned int* dst, unsigned long width, unsigned long height,
+              ResampleFilter filter) {
+    Weights columns(srcWidth, width, filter);
+    Weights rows(srcHeight, height, filter);
+
+    // Every source row, premultiplied and scaled horizontally.
+    Pixel* horizontal = (Pixel*)BufferPool::allocate(srcHeight * width * sizeof(Pixel));
+    Pixel* line = (Pixel*)BufferPool::allocate(srcWidth * sizeof(Pixel));
+    Pixel* sum = (Pixel*)BufferPool::allocate(width * sizeof(Pixel));
+    if (horizontal == NULL || line == NULL || sum == NULL) {
+        BufferPool::release(horizontal);
+        BufferPool::release(line);
+        BufferPool::release(sum);
+        return false;
+    }
+    for (unsigned long y = 0; y < srcHeight; y++) {
+        const unsigned int* row = (const unsigned int*)((const char*)src + y * stride);
+        for (unsigned long x = 0; x < srcWidth; x++) line[x] = premultiply(row[x]);
+
+        Pixel* out = horizontal + y * width;
+        for (unsigned long x = 0; x < width; x++) {
+            const Pixel* in = line + columns.first[x];
+            const float* w = &columns.weights[x * columns.stride];
+            Pixel sum = splat(0.0f);
+            for (unsigned long k = 0; k < columns.count[x]; k++) sum += in[k] * splat(w[k]);
+            out[x] = sum;
+        }
+    }
+    BufferPool::release(line);
+
+    for (unsigned long y = 0; y < height; y++) {
+        const float* w = &rows.weights[y * rows.stride];
+        const Pixel* in = horizontal + rows.first[y] * width;
+        for (unsigned long x = 0; x < width; x++) sum[x] = in[x] * splat(w[0]);
+        for (unsigned long k = 1; k < rows.count[y]; k++) {
+            in += width;
+            Pixel weight = splat(w[k]);
+            for (unsigned long x = 0; x < width; x++) sum[x] += in[x] * weight;
+        }
+
+        unsigned int* out = dst + y * width;
+        for (unsigned long x = 0; x < width; x++) out[x] = unpremultiply(sum[x]);
+    }
+    BufferPool::release(sum);
+    BufferPool::release(horizontal);
+    return true;
+}
+
+void downsampleRows(const unsigned int* top, const unsigned int* bottom,
+                    unsigned int* dst, unsigned long width) {
+    const Pixel quarter = splat(0.25f);
+    for (unsigned long x = 0; x + 1 < width; x += 2) {
+        unsigned int a = top[x], b = top[x + 1], c = bottom[x], d = bottom[x + 1];
+        if (a == b && a == c && a == d) {
+            // Flat areas, including fully transparent and opaque ones.
+            dst[x / 2] = a;
+            continue;
+        }
+        Pixel sum = premultiply(a) + premultiply(b) + premultiply(c) + premultiply(d);
+        dst[x / 2] = unpremultiply(sum * quarter);
+    }
+}
@@ -0,0 +1,29 @@
+#ifndef NODE_IMG_SRC_RESAMPLE_H
+#define NODE_IMG_SRC_RESAMPLE_H
+
+#include <cstddef>
+
+enum ResampleFilter {
+    // Averages the pixels each output pixel covers; best for halving.
+    RESAMPLE_BOX,
+    RESAMPLE_BILINEAR,
+    // Lanczos with three lobes; sharpest, at the cost of slight ringing.
+    RESAMPLE_LANCZOS
+};
+
+// Scales straight alpha RGBA pixels (little endian ABGR words, `stride`
+// bytes per row) to `width` x `height` with a separable filter. Pixels are
+// premultiplied while filtering, so transparent pixels don't bleed their
+// color into their neighbours. The arithmetic is done on four channels at a
+// time with GCC vector extensions, which map to SSE2 or NEON. Returns false,
+// leaving `dst` alone, when memory runs out.
+bool resample(const unsigned int* src, unsigned long srcWidth, unsigned long srcHeight,
+              size_t stride, unsigned int* dst, unsigned long width, unsigned long height,
+              ResampleFilter filter);
+
+// Averages every 2x2 block of the two rows `top` and `bottom`, `width`
+// pixels each, into `width` / 2 pixels of `dst`, weighted by alpha.
+void downsampleRows(const unsigned int* top, const unsigned int* bottom,
+                    unsigned int* dst, unsigned long width);
+
+#endif
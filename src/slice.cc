@@ -0,0 +1,118 @@
+#include <cstring>
+
+#include "slice.h"
+#include "pool.h"
+#include "metrics.h"
+#include "macros.h"
+
+TileBatch::TileBatch(Surface* source, unsigned long size, const EncodeOptions& opts,
+                     Handle<Function> cb, DoneCallback doneCallback, void* doneData)
+    : surface(source), options(opts), done(doneCallback), data(doneData), pending(0) {
+    ev_ref(EV_DEFAULT_UC);
+    surface->ref();
+    callback = Persistent<Function>::New(cb);
+
+    unsigned long columns = (surface->width + size - 1) / size;
+    unsigned long rows = (surface->height + size - 1) / size;
+    tiles.resize(columns * rows);
+    for (unsigned long i = 0; i < tiles.size(); i++) {
+        Tile& tile = tiles[i];
+        tile.batch = this;
+        tile.x = (i % columns) * size;
+        tile.y = (i / columns) * size;
+        tile.width = tile.x + size < surface->width ? size : surface->width - tile.x;
+        tile.height = tile.y + size < surface->height ? size : surface->height - tile.y;
+        tile.data = NULL;
+        tile.length = 0;
+        tile.max = 0;
+        tile.error = NULL;
+    }
+}
+
+TileBatch::~TileBatch() {
+    ev_unref(EV_DEFAULT_UC);
+    for (size_t i = 0; i < tiles.size(); i++) {
+        BufferPool::release(tiles[i].data);
+    }
+    surface->unref();
+    callback.Dispose();
+}
+
+void TileBatch::start(WorkerPool::Priority priority) {
+    pending = tiles.size();
+    Metrics::begin();
+    // The tiles belong to one request that was already accepted.
+    for (size_t i = 0; i < tiles.size(); i++) {
+        WorkerPool::submit(EIO_Encode, EIO_AfterEncode, &tiles[i], priority, false);
+    }
+}
+
+void TileBatch::Tile::reserve(size_t size) {
+    char* grown = (char*)BufferPool::grow(data, length, size);
+    if (grown == NULL) return;
+    data = grown;
+    max = BufferPool::capacity(data);
+}
+
+void TileBatch::Tile::write(const char* chunk, size_t size) {
+    if (failed) return;
+    if (max < length + size) {
+        reserve(length + size > 2 * max ? length + size : 2 * max);
+        if (max < length + size) reserve(length + size);
+        if (max < length + size) {
+            failed = true;
+            return;
+        }
+    }
+
+    memcpy(data + length, chunk, size);
+    length += size;
+}
+
+int TileBatch::EIO_Encode(eio_req *req) {
+    Tile* tile = static_cast<Tile*>(req->data);
+    const Surface* surface = tile->batch->surface;
+    uint64_t start = Metrics::now();
+
+    const unsigned int* pixels = surface->pixels + tile->y * surface->width + tile->x;
+    tile->error = encodeImage((const unsigned char*)pixels, tile->width, tile->height,
+                              surface->width * 4, surface->alpha, tile->batch->options, tile);
+
+    Metrics::time(Metrics::ENCODE, Metrics::now() - start);
+    Metrics::count(Metrics::ENCODES);
+    Metrics::count(Metrics::BYTES_OUT, tile->length);
+    return 0;
+}
+
+int TileBatch::EIO_AfterEncode(eio_req *req) {
+    HandleScope scope;
+    TileBatch* batch = static_cast<Tile*>(req->data)->batch;
+    if (--batch->pending > 0) return 0;
+
+    Metrics::end();
+    const char* error = NULL;
+    for (size_t i = 0; i < batch->tiles.size() && error == NULL; i++) {
+        error = batch->tiles[i].error;
+    }
+
+    Local<Array> result = Array::New(batch->tiles.size());
+    for (size_t i = 0; i < batch->tiles.size() && error == NULL; i++) {
+        Tile& tile = batch->tiles[i];
+        // The buffer takes over the encoded data.
+        Buffer* buffer = Buffer::New(tile.data, tile.length, BufferPool::releaseCallback, NULL);
+        tile.data = NULL;
+        result->Set(i, Local<Value>::New(buffer->handle_));
+    }
+
+    if (!batch->callback.IsEmpty() && error != NULL) {
+        Local<Value> argv[] = { Local<Value>::New(Exception::Error(String::New(error))) };
+        TRY_CATCH_CALL(Context::GetCurrent()->Global(), batch->callback, 1, argv);
+    } else if (!batch->callback.IsEmpty()) {
+        Local<Value> argv[] = { Local<Value>::New(Null()), result };
+        TRY_CATCH_CALL(Context::GetCurrent()->Global(), batch->callback, 2, argv);
+    }
+
+    if (batch->done != NULL) batch->done(batch->data);
+    delete batch;
+    return 0;
+}
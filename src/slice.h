@@ -0,0 +1,66 @@
+#ifndef NODE_IMG_SRC_SLICE_H
+#define NODE_IMG_SRC_SLICE_H
+
+#include <v8.h>
+#include <node.h>
+#include <node_buffer.h>
+
+#include <vector>
+
+#include "encoder.h"
+#include "surface.h"
+#include "workers.h"
+
+using namespace v8;
+using namespace node;
+
+// Cuts a surface into square tiles and encodes them on the thread pool, one
+// job per tile, straight from the surface's rows. Calls back once with an
+// array of the encoded tiles, row by row from the top left; tiles at the
+// right and bottom edges are smaller when the size doesn't divide the
+// surface. Created and started on the main thread; deletes itself when done.
+class TileBatch {
+public:
+    // Called on the main thread after the callback, e.g. to unlock an image.
+    typedef void (*DoneCallback)(void* data);
+
+    TileBatch(Surface* surface, unsigned long size, const EncodeOptions& options,
+              Handle<Function> callback, DoneCallback done = NULL, void* data = NULL);
+    ~TileBatch();
+
+    // Queues a job for every tile.
+    void start(WorkerPool::Priority priority = WorkerPool::INTERACTIVE);
+
+protected:
+    struct Tile : public EncodeOutput {
+        TileBatch* batch;
+        unsigned long x;
+        unsigned long y;
+        unsigned long width;
+        unsigned long height;
+        char* data;
+        size_t length;
+        size_t max;
+        // Set when the tile couldn't be encoded.
+        const char* error;
+
+        void write(const char* chunk, size_t size);
+        void reserve(size_t size);
+    };
+
+    static int EIO_Encode(eio_req *req);
+    static int EIO_AfterEncode(eio_req *req);
+
+    // Holds a reference for as long as tiles are being encoded.
+    Surface* surface;
+    EncodeOptions options;
+    Persistent<Function> callback;
+    DoneCallback done;
+    void* data;
+
+    std::vector<Tile> tiles;
+    // Tiles that haven't been encoded yet.
+    size_t pending;
+};
+
+#endif
@@ -0,0 +1,200 @@
+#include <cstring>
+
+#include "stream.h"
+#include "pool.h"
+#include "macros.h"
+
+Persistent<FunctionTemplate> ChunkStream::control_template;
+
+void ChunkStream::Init() {
+    HandleScope scope;
+
+    Local<FunctionTemplate> t = FunctionTemplate::New();
+    control_template = Persistent<FunctionTemplate>::New(t);
+    control_template->InstanceTemplate()->SetInternalFieldCount(1);
+    control_template->SetClassName(String::NewSymbol("ChunkStream"));
+
+    NODE_SET_PROTOTYPE_METHOD(control_template, "resume", Resume);
+    NODE_SET_PROTOTYPE_METHOD(control_template, "destroy", Destroy);
+}
+
+ChunkStream* ChunkStream::Create(Handle<Object> options, std::string& error) {
+    HandleScope scope;
+    Local<Value> ondata = options->Get(String::NewSymbol("ondata"));
+    if (ondata->IsUndefined()) return NULL;
+    if (!ondata->IsFunction()) {
+        error = "ondata must be a function";
+        return NULL;
+    }
+
+    size_t limit = MAX_BUFFERED;
+    Local<Value> max = options->Get(String::NewSymbol("maxBuffered"));
+    if (!max->IsUndefined()) {
+        if (!max->IsUint32() || max->Uint32Value() < CHUNK_SIZE) {
+            error = "maxBuffered must be an integer of at least 32768";
+            return NULL;
+        }
+        limit = max->Uint32Value();
+    }
+    return new ChunkStream(Local<Function>::Cast(ondata), limit);
+}
+
+ChunkStream::ChunkStream(Handle<Function> callback, size_t l)
+    : paused(false), closed(false), queued(0), limit(l), cancelled(false),
+      overflowed(false), chunk(NULL), used(0), total(0) {
+    ondata = Persistent<Function>::New(callback);
+    control = Persistent<Object>::New(control_template->GetFunction()->NewInstance());
+    control->SetPointerInInternalField(0, this);
+    pthread_mutex_init(&mutex, NULL);
+
+    ev_async_init(&notifier, Notify);
+    notifier.data = this;
+    ev_async_start(EV_DEFAULT_UC_ &notifier);
+    // The job that writes to the stream keeps the loop alive.
+    ev_unref(EV_DEFAULT_UC);
+}
+
+ChunkStream::~ChunkStream() {
+    ev_ref(EV_DEFAULT_UC);
+    ev_async_stop(EV_DEFAULT_UC_ &notifier);
+
+    for (size_t i = 0; i < ready.size(); i++) {
+        BufferPool::release(ready[i].first);
+    }
+    BufferPool::release(chunk);
+    pthread_mutex_destroy(&mutex);
+    control->SetPointerInInternalField(0, NULL);
+    control.Dispose();
+    ondata.Dispose();
+}
+
+void ChunkStream::write(const char* data, size_t length) {
+    if (failed) return;
+    total += length;
+    while (length > 0) {
+        if (chunk == NULL) {
+            chunk = (char*)BufferPool::allocate(CHUNK_SIZE);
+            used = 0;
+            if (chunk == NULL) {
+                failed = true;
+                return;
+            }
+        }
+
+        size_t size = length < CHUNK_SIZE - used ? length : CHUNK_SIZE - used;
+        memcpy(chunk + used, data, size);
+        used += size;
+        data += size;
+        length -= size;
+
+        if (used == CHUNK_SIZE) flush();
+    }
+}
+
+void ChunkStream::flush() {
+    if (chunk == NULL) return;
+
+    pthread_mutex_lock(&mutex);
+    if (!cancelled && queued + used > limit) {
+        // JavaScript doesn't take the chunks; give up rather than buffering
+        // without bound or waiting on a pool thread.
+        cancelled = true;
+        overflowed = true;
+        for (size_t i = 0; i < ready.size(); i++) {
+            BufferPool::release(ready[i].first);
+        }
+        ready.clear();
+        queued = 0;
+    }
+    if (cancelled) {
+        BufferPool::release(chunk);
+    } else {
+        ready.push_back(std::make_pair(chunk, used));
+        queued += used;
+    }
+    pthread_mutex_unlock(&mutex);
+    chunk = NULL;
+    used = 0;
+
+    ev_async_send(EV_DEFAULT_UC_ &notifier);
+}
+
+const char* ChunkStream::error() {
+    pthread_mutex_lock(&mutex);
+    bool behind = overflowed;
+    pthread_mutex_unlock(&mutex);
+    if (behind) return "Stream consumer fell too far behind";
+    return failed ? "Out of memory" : NULL;
+}
+
+void ChunkStream::Notify(EV_P_ ev_async* watcher, int revents) {
+    static_cast<ChunkStream*>(watcher->data)->drain();
+}
+
+void ChunkStream::drain() {
+    HandleScope scope;
+
+    // One chunk at a time, since `ondata` may pause the stream.
+    while (closed || !paused) {
+        pthread_mutex_lock(&mutex);
+        if (ready.empty()) {
+            pthread_mutex_unlock(&mutex);
+            break;
+        }
+        std::pair<char*, size_t> next = ready.front();
+        ready.pop_front();
+        queued -= next.second;
+        pthread_mutex_unlock(&mutex);
+
+        Buffer* buffer = Buffer::New(next.first, next.second,
+                                     BufferPool::releaseCallback, NULL);
+        emit(Local<Value>::New(buffer->handle_));
+    }
+}
+
+void ChunkStream::close() {
+    closed = true;
+    drain();
+}
+
+void ChunkStream::emit(Handle<Value> chunk) {
+    HandleScope scope;
+    if (cancelled) return;
+
+    Local<Value> argv[] = { Local<Value>::New(chunk), Local<Value>::New(control) };
+    TryCatch try_catch;
+    Local<Value> result = ondata->Call(Context::GetCurrent()->Global(), 2, argv);
+    if (try_catch.HasCaught()) {
+        FatalException(try_catch);
+    } else if (result->IsFalse()) {
+        paused = true;
+    }
+}
+
+Handle<Value> ChunkStream::Resume(const Arguments& args) {
+    HandleScope scope;
+    ChunkStream* stream = static_cast<ChunkStream*>(
+        args.This()->GetPointerFromInternalField(0));
+    if (stream != NULL && stream->paused) {
+        stream->paused = false;
+        stream->drain();
+    }
+    return scope.Close(Undefined());
+}
+
+Handle<Value> ChunkStream::Destroy(const Arguments& args) {
+    HandleScope scope;
+    ChunkStream* stream = static_cast<ChunkStream*>(
+        args.This()->GetPointerFromInternalField(0));
+    if (stream != NULL) {
+        pthread_mutex_lock(&stream->mutex);
+        stream->cancelled = true;
+        for (size_t i = 0; i < stream->ready.size(); i++) {
+            BufferPool::release(stream->ready[i].first);
+        }
+        stream->ready.clear();
+        stream->queued = 0;
+        pthread_mutex_unlock(&stream->mutex);
+    }
+    return scope.Close(Undefined());
+}
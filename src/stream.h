@@ -0,0 +1,98 @@
+#ifndef NODE_IMG_SRC_STREAM_H
+#define NODE_IMG_SRC_STREAM_H
+
+#include <v8.h>
+#include <node.h>
+#include <node_buffer.h>
+#include <pthread.h>
+
+#include <deque>
+#include <string>
+#include <utility>
+
+#include "encoder.h"
+
+using namespace v8;
+using namespace node;
+
+// Hands encoded data to JavaScript in chunks while the encoder is still
+// running, instead of collecting the whole image first. write() and flush()
+// are called on the worker thread; everything else, including the `ondata`
+// callback, runs on the main thread.
+//
+// `ondata` is called with a chunk and a control object. Returning false
+// pauses the stream until the control's resume() is called. The encoder
+// never waits for JavaScript, since that would hold on to a pool thread;
+// once more than `limit` bytes are waiting, the stream fails and drops the
+// remaining output. destroy() drops the remaining output as well.
+class ChunkStream : public EncodeOutput {
+public:
+    // Size of every chunk but the last. libpng emits IDAT chunks of about
+    // this size as the compression buffer fills up.
+    static const size_t CHUNK_SIZE = 32768;
+    // Default for the bytes waiting for JavaScript before the stream fails.
+    static const size_t MAX_BUFFERED = 256 * CHUNK_SIZE;
+
+    static void Init();
+
+    // Creates a stream from the `ondata` and `maxBuffered` options. Returns
+    // NULL when there is no `ondata`, or sets `error` when an option is
+    // invalid.
+    static ChunkStream* Create(Handle<Object> options, std::string& error);
+
+    ChunkStream(Handle<Function> ondata, size_t limit = MAX_BUFFERED);
+    ~ChunkStream();
+
+    void write(const char* data, size_t length);
+    // Passes on the partially filled chunk once the encoder is done.
+    void flush();
+    // Error message once the stream failed because JavaScript fell too far
+    // behind or memory ran out, otherwise NULL. Checked by the job after
+    // flush().
+    const char* error();
+
+    // Calls `ondata` for every chunk that is ready until the stream is
+    // paused. The chunks are handed over without copying.
+    void drain();
+    // Calls `ondata` for all remaining chunks, paused or not, once the
+    // encoder is done.
+    void close();
+    // Calls `ondata` with a chunk that didn't go through write().
+    void emit(Handle<Value> chunk);
+
+    // Bytes written so far.
+    inline size_t length() const { return total; }
+
+protected:
+    static void Notify(EV_P_ ev_async* watcher, int revents);
+    static Handle<Value> Resume(const Arguments& args);
+    static Handle<Value> Destroy(const Arguments& args);
+
+    static Persistent<FunctionTemplate> control_template;
+
+    Persistent<Function> ondata;
+    // Passed to `ondata`; it may outlive the stream, which detaches from it.
+    Persistent<Object> control;
+    ev_async notifier;
+    bool paused;
+    bool closed;
+
+    // Guards `ready`, which holds full chunks until drain() takes them, and
+    // the fields below.
+    pthread_mutex_t mutex;
+    std::deque<std::pair<char*, size_t> > ready;
+    // Bytes in `ready`.
+    size_t queued;
+    size_t limit;
+    // Set by destroy() or when `queued` exceeded `limit`; the encoder's
+    // output is dropped from then on.
+    bool cancelled;
+    bool overflowed;
+
+    // Chunk being filled by the worker thread.
+    char* chunk;
+    size_t used;
+    size_t total;
+};
+
+#endif
@@ -0,0 +1,72 @@
+#ifndef NODE_IMG_SRC_SURFACE_H
+#define NODE_IMG_SRC_SURFACE_H
+
+#include <cstddef>
+
+#include "pool.h"
+
+// Reference counted RGBA pixel buffer that can be shared between threads,
+// e.g. by the decoded layer cache and the readers using it. `pixels` is NULL
+// when memory ran out, which the creator has to check.
+class Surface {
+public:
+    Surface(unsigned long w, unsigned long h, bool a) :
+        width(w), height(h), alpha(a), refs(1) {
+        pixels = (unsigned int*)BufferPool::allocate(width * height * 4);
+    }
+
+    inline void ref() { __sync_add_and_fetch(&refs, 1); }
+    inline void unref() {
+        if (__sync_sub_and_fetch(&refs, 1) == 0) delete this;
+    }
+    inline size_t size() const { return width * height * 4; }
+
+    // Buffer::New() free callback for a view of the pixels; `hint` is the
+    // surface, which the view holds a reference to.
+    static void unrefCallback(char* data, void* hint) {
+        static_cast<Surface*>(hint)->unref();
+    }
+
+    unsigned long width;
+    unsigned long height;
+    // Whether the source image had an alpha channel.
+    bool alpha;
+    unsigned int* pixels;
+
+protected:
+    ~Surface() {
+        BufferPool::release(pixels);
+    }
+
+    int refs;
+};
+
+// Reference counted encoded image, e.g. a cached blend() result. Takes
+// ownership of `data`, which comes from the BufferPool.
+class EncodedImage {
+public:
+    EncodedImage(char* d, size_t l) : data(d), length(l), refs(1) {}
+
+    inline void ref() { __sync_add_and_fetch(&refs, 1); }
+    inline void unref() {
+        if (__sync_sub_and_fetch(&refs, 1) == 0) delete this;
+    }
+    inline size_t size() const { return length; }
+
+    // Buffer::New() free callback; `hint` is the referenced image.
+    static void unrefCallback(char* data, void* hint) {
+        static_cast<EncodedImage*>(hint)->unref();
+    }
+
+    char* data;
+    size_t length;
+
+protected:
+    ~EncodedImage() {
+        BufferPool::release(data);
+    }
+
+    int refs;
+};
+
+#endif
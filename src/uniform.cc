@@ -0,0 +1,164 @@
+#include <pthread.h>
+#include <png.h>
+#include <zlib.h>
+#include <cstdlib>
+#include <cstring>
+
+#include <map>
+#include <utility>
+
+#include "uniform.h"
+#include "reader.h"
+#include "header.h"
+#include "hash.h"
+
+typedef std::pair<size_t, uint64_t> UniformKey;
+
+// Registered images keep a copy of their bytes so that lookups can tell a
+// hash collision from a match.
+struct UniformImage {
+    std::string data;
+    unsigned int color;
+};
+typedef std::map<UniformKey, UniformImage> UniformColors;
+
+struct UniformPNGKey {
+    unsigned long width;
+    unsigned long height;
+    unsigned int color;
+    bool operator<(const UniformPNGKey& other) const {
+        if (width != other.width) return width < other.width;
+        if (height != other.height) return height < other.height;
+        return color < other.color;
+    }
+};
+typedef std::map<UniformPNGKey, std::string> UniformPNGs;
+
+// Upper bound for the number of cached encoded images.
+static const size_t maxUniformPNGs = 1024;
+
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static UniformColors colors;
+static UniformPNGs pngs;
+
+bool UniformRegistry::add(const char* data, size_t length) {
+    ImageReader* reader = ImageReader::create(data, length);
+    if (reader == NULL || reader->error != NULL) {
+        delete reader;
+        return false;
+    }
+
+    unsigned long width = reader->width;
+    unsigned long height = reader->height;
+    unsigned int color = 0;
+    bool uniform = reader->uniform;
+
+    if (uniform) {
+        color = reader->uniformColor;
+    } else if (!ImageHeader::allowed(width, height)) {
+        uniform = false;
+    } else if (width && height) {
+        unsigned int* surface = (unsigned int*)malloc(width * height * 4);
+        if (surface == NULL) {
+            delete reader;
+            return false;
+        }
+        reader->decode((unsigned char*)surface, true);
+
+        color = surface[0];
+        uniform = reader->error == NULL;
+        for (unsigned long i = 1; uniform && i < width * height; i++) {
+            uniform = surface[i] == color;
+        }
+        free(surface);
+    }
+    delete reader;
+
+    if (!uniform) return false;
+    if (color <= 0x00FFFFFF) color = 0;
+
+    UniformKey key(length, hash64(data, length));
+    pthread_mutex_lock(&mutex);
+    UniformImage& image = colors[key];
+    image.data.assign(data, length);
+    image.color = color;
+    pthread_mutex_unlock(&mutex);
+    return true;
+}
+
+bool UniformRegistry::lookup(const char* data, size_t length, unsigned int* color) {
+    bool found = false;
+
+    // Only hash the data when an image of the same length is registered, and
+    // not while holding the lock that every blend thread goes through.
+    pthread_mutex_lock(&mutex);
+    UniformColors::iterator it = colors.lower_bound(UniformKey(length, 0));
+    bool candidate = it != colors.end() && it->first.first == length;
+    pthread_mutex_unlock(&mutex);
+    if (!candidate) return false;
+
+    UniformKey key(length, hash64(data, length));
+    pthread_mutex_lock(&mutex);
+    it = colors.find(key);
+    if (it != colors.end() && memcmp(it->second.data.data(), data, length) == 0) {
+        *color = it->second.color;
+        found = true;
+    }
+    pthread_mutex_unlock(&mutex);
+
+    return found;
+}
+
+static void writeUniformPNG(png_structp png_ptr, png_bytep data, png_size_t length) {
+    std::string* png = static_cast<std::string*>(png_get_io_ptr(png_ptr));
+    png->append((const char*)data, length);
+}
+
+void UniformRegistry::encode(unsigned long width, unsigned long height,
+                             unsigned int color, std::string& png) {
+    UniformPNGKey key = { width, height, color };
+
+    pthread_mutex_lock(&mutex);
+    UniformPNGs::iterator it = pngs.find(key);
+    if (it != pngs.end()) png = it->second;
+    pthread_mutex_unlock(&mutex);
+    if (!png.empty()) return;
+
+    png_structp png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    png_infop info_ptr = png_create_info_struct(png_ptr);
+
+    png_set_compression_level(png_ptr, Z_BEST_COMPRESSION);
+    png_set_IHDR(png_ptr, info_ptr, width, height, 1,
+                 PNG_COLOR_TYPE_PALETTE, PNG_INTERLACE_NONE,
+                 PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+
+    png_color palette;
+    palette.red = color & 0xff;
+    palette.green = (color >> 8) & 0xff;
+    palette.blue = (color >> 16) & 0xff;
+    png_set_PLTE(png_ptr, info_ptr, &palette, 1);
+
+    png_byte alpha = color >> 24;
+    if (alpha != 0xff) {
+        png_set_tRNS(png_ptr, info_ptr, &alpha, 1, NULL);
+    }
+
+    png_set_write_fn(png_ptr, (png_voidp)&png, writeUniformPNG, NULL);
+    png_write_info(png_ptr, info_ptr);
+
+    // All pixels use palette index 0.
+    png_bytep row = (png_bytep)calloc((width + 7) / 8, 1);
+    assert(row);
+    for (unsigned long y = 0; y < height; y++) {
+        png_write_row(png_ptr, row);
+    }
+    free(row);
+
+    png_write_end(png_ptr, NULL);
+    png_destroy_write_struct(&png_ptr, &info_ptr);
+
+    pthread_mutex_lock(&mutex);
+    if (pngs.size() >= maxUniformPNGs) pngs.clear();
+    pngs[key] = png;
+    pthread_mutex_unlock(&mutex);
+}
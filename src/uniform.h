@@ -0,0 +1,28 @@
+#ifndef NODE_IMG_SRC_UNIFORM_H
+#define NODE_IMG_SRC_UNIFORM_H
+
+#include <stdint.h>
+#include <cstddef>
+
+#include <string>
+
+// Encoded images that are known to decode to a single color, e.g. empty
+// tiles. Lookups are keyed by length and content hash, only match images
+// with identical bytes and are safe to call from worker threads.
+class UniformRegistry {
+public:
+    // Decodes the image and remembers its color if all pixels are identical.
+    // Returns false when the image isn't uniform.
+    static bool add(const char* data, size_t length);
+
+    // Stores the color of a registered image in `color` (as a straight alpha
+    // ABGR word) and returns true if the image is registered.
+    static bool lookup(const char* data, size_t length, unsigned int* color);
+
+    // Fills `png` with a minimal paletted PNG of the given size and color.
+    // Results are cached since the same few colors and sizes recur.
+    static void encode(unsigned long width, unsigned long height,
+                       unsigned int color, std::string& png);
+};
+
+#endif
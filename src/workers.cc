@@ -0,0 +1,197 @@
+#include <pthread.h>
+#include <unistd.h>
+#include <cstdlib>
+#include <ev.h>
+
+#include <deque>
+#include <vector>
+
+#include "workers.h"
+#include "metrics.h"
+
+struct Job {
+    eio_cb work;
+    eio_cb after;
+    eio_req* req;
+    // When the job was queued, from Metrics::now().
+    uint64_t queued;
+};
+
+struct Worker {
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    // One queue per priority.
+    std::deque<Job> queues[2];
+};
+
+static std::vector<Worker*> workers;
+static int threadCount = 0;
+static size_t maxQueue = 0;
+// Round robin target for the next job.
+static volatile size_t next = 0;
+
+// Queued jobs over all workers; idle workers sleep while it is 0.
+static volatile size_t queued = 0;
+static volatile size_t running = 0;
+static pthread_mutex_t sleepMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wake = PTHREAD_COND_INITIALIZER;
+
+// Finished jobs whose `after` callback hasn't run yet.
+static std::vector<Job> done;
+static pthread_mutex_t doneMutex = PTHREAD_MUTEX_INITIALIZER;
+static ev_async notifier;
+
+static volatile uint64_t completed = 0;
+static volatile uint64_t rejected = 0;
+static volatile uint64_t stolen = 0;
+// Microseconds.
+static volatile uint64_t waited = 0;
+
+// Takes the next job for worker `self`: its own interactive jobs first, then
+// those of other workers, then background jobs in the same order.
+static bool take(size_t self, Job& job) {
+    size_t count = workers.size();
+    for (int priority = WorkerPool::INTERACTIVE; priority <= WorkerPool::BACKGROUND; priority++) {
+        for (size_t i = 0; i < count; i++) {
+            Worker* worker = workers[(self + i) % count];
+            pthread_mutex_lock(&worker->mutex);
+            std::deque<Job>& queue = worker->queues[priority];
+            bool found = !queue.empty();
+            if (found && i == 0) {
+                job = queue.front();
+                queue.pop_front();
+            } else if (found) {
+                // Steal from the other end to stay out of the owner's way.
+                job = queue.back();
+                queue.pop_back();
+                __sync_add_and_fetch(&stolen, 1);
+            }
+            pthread_mutex_unlock(&worker->mutex);
+
+            if (found) {
+                __sync_sub_and_fetch(&queued, 1);
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+static void* run(void* data) {
+    size_t self = (size_t)data;
+    for (;;) {
+        pthread_mutex_lock(&sleepMutex);
+        while (queued == 0) pthread_cond_wait(&wake, &sleepMutex);
+        pthread_mutex_unlock(&sleepMutex);
+
+        Job job;
+        if (!take(self, job)) continue;
+        uint64_t wait = Metrics::now() - job.queued;
+        __sync_add_and_fetch(&waited, wait / 1000);
+        Metrics::time(Metrics::QUEUE, wait);
+
+        __sync_add_and_fetch(&running, 1);
+        job.work(job.req);
+        __sync_sub_and_fetch(&running, 1);
+
+        pthread_mutex_lock(&doneMutex);
+        done.push_back(job);
+        pthread_mutex_unlock(&doneMutex);
+        ev_async_send(EV_DEFAULT_UC_ &notifier);
+    }
+    return NULL;
+}
+
+// Runs the `after` callbacks of finished jobs on the main thread.
+static void finish(EV_P_ ev_async* watcher, int revents) {
+    std::vector<Job> jobs;
+    pthread_mutex_lock(&doneMutex);
+    jobs.swap(done);
+    pthread_mutex_unlock(&doneMutex);
+
+    for (size_t i = 0; i < jobs.size(); i++) {
+        jobs[i].after(jobs[i].req);
+        free(jobs[i].req);
+        __sync_add_and_fetch(&completed, 1);
+    }
+}
+
+static int processorCount() {
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    return count < 1 ? 1 : count;
+}
+
+static void start() {
+    if (threadCount <= 0) threadCount = processorCount();
+
+    ev_async_init(&notifier, finish);
+    ev_async_start(EV_DEFAULT_UC_ &notifier);
+    // Pending jobs keep the loop alive through their batons, not the pool.
+    ev_unref(EV_DEFAULT_UC);
+
+    for (int i = 0; i < threadCount; i++) {
+        Worker* worker = new Worker();
+        pthread_mutex_init(&worker->mutex, NULL);
+        workers.push_back(worker);
+    }
+    for (int i = 0; i < threadCount; i++) {
+        pthread_create(&workers[i]->thread, NULL, run, (void*)(size_t)i);
+    }
+}
+
+bool WorkerPool::configure(int threads, size_t queue) {
+    if (workers.empty()) {
+        threadCount = threads;
+    } else if (threads != 0 && threads != threadCount) {
+        return false;
+    }
+    maxQueue = queue;
+    return true;
+}
+
+bool WorkerPool::accepts(size_t count) {
+    return maxQueue == 0 || queued + count <= maxQueue;
+}
+
+bool WorkerPool::submit(eio_cb work, eio_cb after, void* data,
+                        Priority priority, bool bounded) {
+    if (bounded && !accepts(1)) {
+        __sync_add_and_fetch(&rejected, 1);
+        return false;
+    }
+    if (workers.empty()) start();
+
+    Job job;
+    job.work = work;
+    job.after = after;
+    job.req = (eio_req*)calloc(1, sizeof(eio_req));
+    job.req->data = data;
+    job.queued = Metrics::now();
+
+    // Count the job first so that `queued` never drops below the number of
+    // jobs in the queues.
+    __sync_add_and_fetch(&queued, 1);
+
+    Worker* worker = workers[__sync_fetch_and_add(&next, 1) % workers.size()];
+    pthread_mutex_lock(&worker->mutex);
+    worker->queues[priority].push_back(job);
+    pthread_mutex_unlock(&worker->mutex);
+
+    pthread_mutex_lock(&sleepMutex);
+    pthread_cond_signal(&wake);
+    pthread_mutex_unlock(&sleepMutex);
+    return true;
+}
+
+WorkerPool::Stats WorkerPool::stats() {
+    Stats stats;
+    stats.threads = threadCount > 0 ? threadCount : processorCount();
+    stats.maxQueue = maxQueue;
+    stats.queued = queued;
+    stats.running = running;
+    stats.completed = completed;
+    stats.rejected = rejected;
+    stats.stolen = stolen;
+    stats.waited = waited;
+    return stats;
+}
@@ -0,0 +1,55 @@
+#ifndef NODE_IMG_SRC_WORKERS_H
+#define NODE_IMG_SRC_WORKERS_H
+
+#include <eio.h>
+#include <stdint.h>
+
+#include <cstddef>
+
+// Thread pool for image work, separate from node's eio pool so that it
+// doesn't compete with file system I/O. Jobs take the eio_custom()
+// callbacks: `work` runs on a worker thread and `after` on the main thread,
+// both with a request whose `data` is the job's data.
+//
+// Every thread has its own queue per priority; idle threads steal from the
+// others, and interactive jobs always run before background jobs. The pool
+// is started from the main thread; after that, jobs can also be submitted
+// from worker threads.
+class WorkerPool {
+public:
+    enum Priority {
+        INTERACTIVE,
+        BACKGROUND
+    };
+
+    struct Stats {
+        int threads;
+        // Upper bound for queued jobs; 0 when unbounded.
+        size_t maxQueue;
+        size_t queued;
+        size_t running;
+        uint64_t completed;
+        uint64_t rejected;
+        uint64_t stolen;
+        // Total time jobs spent in the queue before a thread picked them up,
+        // in microseconds.
+        uint64_t waited;
+    };
+
+    // Sets the number of threads (0 for one per core), which is only
+    // possible before the first job, and the queue bound. Returns false if
+    // the threads are already running.
+    static bool configure(int threads, size_t maxQueue);
+
+    // Whether `count` more jobs can be queued right now.
+    static bool accepts(size_t count);
+
+    // Queues a job. Returns false, without queueing it, when `bounded` and
+    // the queue is full.
+    static bool submit(eio_cb work, eio_cb after, void* data,
+                       Priority priority = INTERACTIVE, bool bounded = true);
+
+    static Stats stats();
+};
+
+#endif
@@ -36,6 +36,11 @@ exports['test blend function with topmost image having no alpha'] = function(bef
         completed = true;
         if (err) throw err;
         assert.deepEqual(images[0], data);
+        // A copy; writing to the result leaves the input alone.
+        assert.notStrictEqual(images[0], data);
+        var original = data[0];
+        data[0] = original ^ 0xFF;
+        assert.equal(images[0][0], original);
     });
 
     beforeExit(function() { assert.ok(completed); });
@@ -55,3 +60,684 @@ exports['test blend function'] = function(beforeExit) {
         assert.ok(completed);
     });
 };
+
+exports['test compositing implementation is reported'] = function() {
+    assert.ok(/^(scalar|sse2|ssse3|avx2)$/.test(img.simd));
+};
+
+exports['test SIMD blend is identical to scalar blend'] = function(beforeExit) {
+    var completed = false;
+    var exec = require('child_process').exec;
+    var script = "require('./lib').blend([" + [0, 1, 2, 3, 4].map(function(i) {
+        return "require('fs').readFileSync('test/fixture/" + (i + 1) + ".png')";
+    }).join(',') + "], function(err, data) { process.stdout.write(data.toString('base64')); });";
+
+    img.blend(images, function(err, data) {
+        if (err) throw err;
+        exec(process.execPath + ' -e "' + script + '"', {
+            env: { NODE_IMG_SIMD: 'scalar' }
+        }, function(err, stdout) {
+            completed = true;
+            if (err) throw err;
+            assert.equal(stdout, data.toString('base64'));
+        });
+    });
+
+    beforeExit(function() { assert.ok(completed); });
+};
+
+exports['test blend with unknown image format'] = function(beforeExit) {
+    var completed = false;
+    img.blend([ images[1], new Buffer('not an image') ], function(err, data) {
+        completed = true;
+        assert.ok(err);
+        assert.equal(err.message, 'Unknown image format');
+    });
+
+    beforeExit(function() { assert.ok(completed); });
+};
+
+exports['test registering non-uniform image'] = function() {
+    assert.throws(function() {
+        img.registerUniform('foo');
+    }, /Buffer required as first argument/);
+    assert.equal(img.registerUniform(images[2]), false);
+};
+
+exports['test decoded layer cache'] = function(beforeExit) {
+    var completed = false;
+    img.setLayerCacheSize(16 * 1024 * 1024);
+
+    img.blend(images, function(err, uncached) {
+        if (err) throw err;
+        var before = img.layerCacheStats();
+        assert.ok(before.entries > 0);
+        assert.ok(before.bytes <= before.size);
+        // Entries keep the encoded layer to compare it on hits.
+        assert.ok(before.bytes > before.entries * 256 * 256 * 4);
+
+        img.blend(images, function(err, data) {
+            completed = true;
+            if (err) throw err;
+            assert.ok(img.layerCacheStats().hits > before.hits);
+            assert.deepEqual(uncached, data);
+            img.setLayerCacheSize(0);
+            assert.equal(img.layerCacheStats().entries, 0);
+        });
+    });
+
+    beforeExit(function() { assert.ok(completed); });
+};
+
+exports['test encoded result cache'] = function(beforeExit) {
+    var completed = false;
+    img.setResultCacheSize(4 * 1024 * 1024);
+    var stack = [ images[0], images[2], images[3] ];
+
+    img.blend(stack, function(err, first) {
+        if (err) throw err;
+        var before = img.resultCacheStats();
+        assert.ok(before.entries > 0);
+
+        img.blend(stack, function(err, data) {
+            if (err) throw err;
+            assert.ok(img.resultCacheStats().hits > before.hits);
+            assert.deepEqual(first, data);
+
+            // Results don't share memory with the cache, so writing to one
+            // doesn't corrupt later hits.
+            var expected = new Buffer(data.length);
+            data.copy(expected);
+            data[data.length - 1] ^= 0xFF;
+            first[first.length - 1] ^= 0xFF;
+
+            // Only identical layers and options are hits.
+            var hits = img.resultCacheStats().hits;
+            img.blend(stack, { palette: true }, function(err, paletted) {
+                if (err) throw err;
+                assert.equal(img.resultCacheStats().hits, hits);
+                assert.notDeepEqual(expected, paletted);
+
+                img.blend(stack, function(err, data) {
+                    if (err) throw err;
+                    assert.ok(img.resultCacheStats().hits > hits);
+                    assert.deepEqual(expected, data);
+
+                    img.blend(stack, { cache: false }, function(err, data) {
+                        completed = true;
+                        if (err) throw err;
+                        assert.deepEqual(expected, data);
+                        img.setResultCacheSize(0);
+                    });
+                });
+            });
+        });
+    });
+
+    beforeExit(function() { assert.ok(completed); });
+};
+
+exports['test blend with paletted output'] = function(beforeExit) {
+    var completed = false;
+    img.blend(images, { palette: true, colors: 64, cache: false }, function(err, data) {
+        completed = true;
+        if (err) throw err;
+        // IHDR color type
+        assert.equal(data[25], 3);
+    });
+
+    assert.throws(function() {
+        img.blend(images, { palette: true, colors: 1000 });
+    }, /colors must be an integer between 2 and 256/);
+
+    beforeExit(function() { assert.ok(completed); });
+};
+
+exports['test blend encode options'] = function(beforeExit) {
+    var completed = 0;
+    var images = [
+        fs.readFileSync('test/fixture/1.png'),
+        fs.readFileSync('test/fixture/2.png')
+    ];
+
+    img.blend(images, { level: 0 }, function(err, stored) {
+        if (err) throw err;
+        img.blend(images, { level: 9, filter: 'paeth', strategy: 'rle' }, function(err, data) {
+            completed++;
+            if (err) throw err;
+            assert.ok(data.length < stored.length);
+        });
+    });
+
+    img.blend(images, { color: 'gray' }, function(err, data) {
+        completed++;
+        if (err) throw err;
+        // IHDR color type
+        assert.equal(data[25], 0);
+    });
+
+    assert.throws(function() {
+        img.blend(images, { strategy: 'fastest' });
+    }, /strategy must be one of/);
+
+    beforeExit(function() { assert.equal(completed, 2); });
+};
+
+exports['test buffer pool'] = function(beforeExit) {
+    var completed = false;
+    var images = [
+        fs.readFileSync('test/fixture/1.png'),
+        fs.readFileSync('test/fixture/2.png')
+    ];
+
+    assert.throws(function() {
+        img.setBufferPoolSize(-1);
+    }, /Pool size in bytes required/);
+
+    var before = img.bufferPoolStats();
+    img.blend(images, { cache: false }, function(err, data) {
+        if (err) throw err;
+        img.blend(images, { cache: false }, function(err, data) {
+            completed = true;
+            if (err) throw err;
+            var stats = img.bufferPoolStats();
+            assert.ok(stats.allocations > before.allocations);
+            assert.ok(stats.reuses > before.reuses);
+            assert.ok(stats.bytes <= stats.size);
+        });
+    });
+
+    beforeExit(function() { assert.ok(completed); });
+};
+
+exports['test blendMany'] = function(beforeExit) {
+    var completed = false;
+    var jobs = [
+        [ images[0], images[1] ],
+        [ images[1], images[0] ],
+        [ images[1] ]
+    ];
+
+    img.blend(jobs[0], { cache: false }, function(err, single) {
+        if (err) throw err;
+        img.blendMany(jobs, { cache: false }, function(err, results) {
+            completed = true;
+            if (err) throw err;
+            assert.equal(results.length, 3);
+            assert.deepEqual(results[0], single);
+            assert.strictEqual(results[1], images[0]);
+            assert.ok(Buffer.isBuffer(results[2]));
+        });
+    });
+
+    beforeExit(function() { assert.ok(completed); });
+};
+
+exports['test blendMany errors'] = function(beforeExit) {
+    var completed = false;
+
+    assert.throws(function() {
+        img.blendMany([ [ images[0] ], [ 1, 2 ] ]);
+    }, /All elements must be Buffers/);
+    assert.throws(function() {
+        img.blendMany([]);
+    }, /at least one array of Buffers/);
+
+    img.blendMany([ [ images[0] ], [ new Buffer('not an image') ] ], function(err, results) {
+        completed = true;
+        assert.ok(err);
+        assert.equal(err.message, 'Unknown image format');
+        assert.equal(err.index, 1);
+        assert.ok(Buffer.isBuffer(results[0]));
+    });
+
+    beforeExit(function() { assert.ok(completed); });
+};
+
+exports['test worker pool'] = function(beforeExit) {
+    var completed = false;
+
+    assert.throws(function() {
+        img.configureWorkers({ threads: 0 });
+    }, /threads must be a positive integer/);
+    assert.throws(function() {
+        img.blend([ images[0] ], { priority: 'urgent' });
+    }, /priority must be 'interactive' or 'background'/);
+
+    img.blend([ images[0], images[1] ], { priority: 'background', cache: false }, function(err, data) {
+        completed = true;
+        if (err) throw err;
+        var stats = img.workerStats();
+        assert.ok(stats.threads > 0);
+        assert.ok(stats.completed > 0);
+        assert.ok(stats.queueTime >= 0);
+        assert.throws(function() {
+            img.configureWorkers({ threads: stats.threads + 1 });
+        }, /already running/);
+    });
+
+    beforeExit(function() { assert.ok(completed); });
+};
+
+exports['test blend with many alpha layers'] = function(beforeExit) {
+    var completed = 0;
+    var stack = [ images[2], images[3], images[4], images[2], images[3] ];
+    var results = [];
+
+    // Deep stacks decode their layers in parallel; concurrent blends of the
+    // same stack have to agree.
+    for (var i = 0; i < 4; i++) {
+        img.blend(stack, { cache: false }, function(err, data) {
+            completed++;
+            if (err) throw err;
+            assert.equal(data.toString('binary', 1, 4), 'PNG');
+            results.push(data);
+            if (results.length == 4) {
+                for (var j = 1; j < 4; j++) assert.deepEqual(results[0], results[j]);
+            }
+        });
+    }
+
+    beforeExit(function() { assert.equal(completed, 4); });
+};
+
+exports['test blend with JPEG layers'] = function(beforeExit) {
+    var completed = 0;
+    // 512x512, twice the size of the PNG fixtures.
+    var photo = fs.readFileSync('test/fixture/1.jpg');
+
+    img.blend([ { buffer: photo, scale: 2 }, images[2] ], { cache: false }, function(err, data) {
+        completed++;
+        if (err) throw err;
+        assert.equal(data.toString('binary', 1, 4), 'PNG');
+        // IHDR width
+        assert.equal(data[18] * 256 + data[19], 256);
+    });
+
+    // Opaque JPEGs aren't passed through, since the output is PNG.
+    img.blend([ photo ], function(err, data) {
+        completed++;
+        if (err) throw err;
+        assert.equal(data.toString('binary', 1, 4), 'PNG');
+        assert.equal(data[18] * 256 + data[19], 512);
+    });
+
+    img.blend([ photo ], { format: 'jpeg', quality: 60 }, function(err, data) {
+        completed++;
+        if (err) throw err;
+        assert.equal(data[0], 0xFF);
+        assert.equal(data[1], 0xD8);
+        assert.ok(data.length < photo.length);
+    });
+
+    img.blend([ { buffer: images[2], scale: 2 } ], function(err, data) {
+        completed++;
+        assert.ok(err);
+        assert.ok(/Only JPEG layers can be scaled/.test(err.message));
+    });
+
+    // The header is intact, so the truncation only shows while decoding.
+    img.blend([ photo.slice(0, photo.length / 2) ], { cache: false }, function(err, data) {
+        completed++;
+        assert.ok(err);
+        assert.ok(/Invalid JPEG/.test(err.message));
+    });
+
+    assert.throws(function() {
+        img.blend([ { buffer: photo, scale: 3 } ]);
+    }, /scale must be 1, 2, 4 or 8/);
+    assert.throws(function() {
+        img.blend([ photo ], { quality: 0 });
+    }, /quality must be an integer between 1 and 100/);
+
+    beforeExit(function() { assert.equal(completed, 5); });
+};
+
+exports['test info'] = function() {
+    var info = img.info(images[0]);
+    assert.equal(info.format, 'png');
+    assert.equal(info.width, 256);
+    assert.equal(info.height, 256);
+    assert.equal(info.color, 'palette');
+    assert.equal(info.colors, 64);
+    assert.equal(info.alpha, false);
+
+    assert.equal(img.info(images[2]).color, 'rgba');
+    assert.equal(img.info(images[2]).alpha, true);
+
+    var jpeg = img.info(fs.readFileSync('test/fixture/1.jpg'));
+    assert.equal(jpeg.format, 'jpeg');
+    assert.equal(jpeg.width, 512);
+    assert.equal(jpeg.color, 'rgb');
+
+    assert.throws(function() {
+        img.info(new Buffer('not an image'));
+    }, /Unknown image format/);
+    assert.throws(function() {
+        img.info('foo');
+    }, /Buffer required as first argument/);
+};
+
+exports['test blend validates headers up front'] = function() {
+    var large = fs.readFileSync('test/fixture/large.png');
+    assert.throws(function() {
+        img.blend([ images[2], large ]);
+    }, /Image dimensions don't match/);
+    // Hidden layers are checked too.
+    assert.throws(function() {
+        img.blend([ large, images[2], images[0] ]);
+    }, /Image dimensions don't match/);
+    assert.throws(function() {
+        img.blend([ images[2], new Buffer('not an image') ]);
+    }, /Unknown image format/);
+
+    // A header claiming 100000x100000 pixels is rejected without decoding.
+    var huge = new Buffer(images[2].length);
+    images[2].copy(huge);
+    // Width and height are big-endian words at offsets 16 and 20 (IHDR).
+    [ 16, 20 ].forEach(function(offset) {
+        huge[offset] = 0x00;
+        huge[offset + 1] = 0x01;
+        huge[offset + 2] = 0x86;
+        huge[offset + 3] = 0xa0;
+    });
+    assert.throws(function() {
+        img.blend([ huge ]);
+    }, /Image is too large/);
+    assert.throws(function() {
+        img.quad([ huge, null, null, null ]);
+    }, /Image is too large/);
+
+    img.setMaxPixels(256 * 255);
+    try {
+        assert.throws(function() {
+            img.blend([ images[2] ]);
+        }, /Image is too large/);
+    } finally {
+        img.setMaxPixels(1 << 28);
+    }
+    assert.throws(function() {
+        img.setMaxPixels(0);
+    }, /Pixel count required as first argument/);
+};
+
+exports['test stats'] = function(beforeExit) {
+    var completed = false;
+    img.blend([ images[2], images[3] ], { cache: false }, function(err, data) {
+        completed = true;
+        if (err) throw err;
+        var stats = img.stats({ reset: true });
+        assert.ok(stats.blends > 0);
+        assert.ok(stats.bytesIn > 0);
+        assert.ok(stats.bytesOut >= data.length);
+        assert.ok(stats.pixels >= 256 * 256);
+        assert.ok(stats.decode.count > 0);
+        assert.ok(stats.encode.time > 0);
+        assert.ok(stats.queue.count > 0);
+
+        stats = img.stats();
+        assert.equal(stats.blends, 0);
+        assert.equal(stats.decode.count, 0);
+    });
+
+    beforeExit(function() { assert.ok(completed); });
+};
+
+exports['test opaque rows hide lower layers'] = function(beforeExit) {
+    var completed = 0;
+    // Decoding fails halfway, but only if the layer is read at all.
+    var photo = fs.readFileSync('test/fixture/1.jpg');
+    var layer = { buffer: photo, scale: 2 };
+    var truncated = { buffer: photo.slice(0, photo.length / 2), scale: 2 };
+
+    function pixels(data, callback) {
+        new img.Image().load(data, function(err, image) {
+            if (err) throw err;
+            callback(image.data);
+        });
+    }
+
+    // Opaque, but with an alpha channel, so only the rows can tell.
+    img.blend([ images[0] ], { color: 'rgba', cache: false }, function(err, top) {
+        if (err) throw err;
+        img.blend([ truncated, top ], { cache: false }, function(err, data) {
+            if (err) throw err;
+            pixels(data, function(blended) {
+                pixels(top, function(expected) {
+                    completed++;
+                    assert.deepEqual(blended, expected);
+                });
+            });
+        });
+    });
+
+    // Opaque upper half, transparent lower half.
+    img.quad([ images[0], images[0], null, null ], function(err, half) {
+        if (err) throw err;
+        img.blend([ truncated, half ], { cache: false }, function(err) {
+            completed++;
+            assert.ok(/Invalid JPEG/.test(err.message));
+        });
+
+        img.blend([ layer, half ], { cache: false }, function(err, data) {
+            if (err) throw err;
+            img.blend([ layer ], { color: 'rgba', cache: false }, function(err, below) {
+                if (err) throw err;
+                pixels(data, function(blended) {
+                    pixels(half, function(above) {
+                        pixels(below, function(lower) {
+                            completed++;
+                            var split = 128 * 256 * 4;
+                            assert.deepEqual(blended.slice(0, split), above.slice(0, split));
+                            assert.deepEqual(blended.slice(split), lower.slice(split));
+                        });
+                    });
+                });
+            });
+        });
+    });
+
+    beforeExit(function() { assert.equal(completed, 3); });
+};
+
+exports['test blend stream'] = function(beforeExit) {
+    var large = fs.readFileSync('test/fixture/large.png');
+    var completed = false;
+    img.blend([ large, large ], { cache: false }, function(err, expected) {
+        if (err) throw err;
+
+        var chunks = [];
+        var length = 0;
+        var stream = img.createBlendStream([ large, large ], { cache: false });
+        stream.on('data', function(chunk) {
+            chunks.push(chunk);
+            length += chunk.length;
+        });
+        stream.on('end', function() {
+            completed = true;
+            var data = new Buffer(length);
+            var offset = 0;
+            chunks.forEach(function(chunk) {
+                chunk.copy(data, offset);
+                offset += chunk.length;
+            });
+            assert.deepEqual(data, expected);
+        });
+    });
+
+    var failed = false;
+    img.createBlendStream([ images[2], new Buffer('not an image') ]).on('error', function(err) {
+        failed = true;
+        assert.ok(/Unknown image format/.test(err.message));
+    });
+
+    beforeExit(function() {
+        assert.ok(completed);
+        assert.ok(failed);
+    });
+};
+
+exports['test paused blend stream'] = function(beforeExit) {
+    // 4 MB of uncompressed output, far more than the stream buffers.
+    var large = fs.readFileSync('test/fixture/large.png');
+    var options = { cache: false, level: 0 };
+    var completed = false;
+    img.blend([ large, large ], options, function(err, expected) {
+        if (err) throw err;
+
+        var chunks = [];
+        var stream = img.createBlendStream([ large, large ], options);
+        stream.on('data', function(chunk) {
+            chunks.push(chunk);
+            if (chunks.length > 1) return;
+            stream.pause();
+            setTimeout(function() {
+                // The encoder doesn't wait for the stream, which buffers
+                // the output in the meantime.
+                assert.equal(chunks.length, 1);
+                stream.resume();
+            }, 100);
+        });
+        stream.on('end', function() {
+            completed = true;
+            var length = 0;
+            chunks.forEach(function(chunk) { length += chunk.length; });
+            var data = new Buffer(length);
+            var offset = 0;
+            chunks.forEach(function(chunk) {
+                chunk.copy(data, offset);
+                offset += chunk.length;
+            });
+            assert.deepEqual(data, expected);
+        });
+    });
+
+    // A consumer that stays paused fails the stream instead of tying up a
+    // worker thread or buffering without bound.
+    var failed = false;
+    var stalled = img.createBlendStream([ large, large ],
+                                        { cache: false, level: 0, maxBuffered: 65536 });
+    stalled.on('data', function() { stalled.pause(); });
+    stalled.on('end', function() { assert.fail('stalled stream ended'); });
+    stalled.on('error', function(err) {
+        failed = true;
+        assert.ok(/Stream consumer fell too far behind/.test(err.message));
+    });
+
+    assert.throws(function() {
+        img.blend([ large ], { ondata: function() {}, maxBuffered: 100 });
+    }, /maxBuffered must be an integer of at least 32768/);
+
+    beforeExit(function() {
+        assert.ok(completed);
+        assert.ok(failed);
+    });
+};
+
+exports['test blend slice'] = function(beforeExit) {
+    var completed = false;
+    var large = fs.readFileSync('test/fixture/large.png');
+    img.blend([ large, large ], { slice: 256 }, function(err, tiles) {
+        completed = true;
+        if (err) throw err;
+        assert.equal(tiles.length, 16);
+        tiles.forEach(function(tile) {
+            assert.equal(img.info(tile).width, 256);
+            assert.equal(img.info(tile).height, 256);
+        });
+    });
+
+    assert.throws(function() {
+        img.blend([ large ], { slice: -1 });
+    }, /slice must be a positive integer/);
+
+    beforeExit(function() { assert.ok(completed); });
+};
+
+exports['test quad'] = function(beforeExit) {
+    var completed = false;
+    img.quad([ images[1], images[2], null, images[3] ], function(err, data) {
+        completed = true;
+        if (err) throw err;
+        var info = img.info(data);
+        assert.equal(info.width, 256);
+        assert.equal(info.height, 256);
+        // The missing child leaves a transparent quarter.
+        assert.equal(info.alpha, true);
+    });
+
+    assert.throws(function() {
+        img.quad([ images[1], fs.readFileSync('test/fixture/large.png'), null, null ]);
+    }, /Image dimensions don't match/);
+    assert.throws(function() {
+        img.quad([ null, null, null, null ]);
+    }, /At least one child tile is required/);
+    assert.throws(function() {
+        img.quad([ images[1] ]);
+    }, /First argument must be an array of four Buffers or nulls/);
+
+    beforeExit(function() { assert.ok(completed); });
+};
+
+exports['test blend positioned layers'] = function(beforeExit) {
+    var completed = false;
+    var large = fs.readFileSync('test/fixture/large.png');
+    img.blend([
+        large,
+        { buffer: images[1], x: 100, y: 200 },
+        { buffer: images[2], x: -50, y: 900 }
+    ], function(err, data) {
+        completed = true;
+        if (err) throw err;
+        // The unpositioned layer sets the size of the result.
+        assert.equal(img.info(data).width, 1024);
+        assert.equal(img.info(data).height, 1024);
+    });
+
+    assert.throws(function() {
+        img.blend([ large, { buffer: images[1], x: 'a', y: 0 } ]);
+    }, /x and y must be integers/);
+    assert.throws(function() {
+        img.blend([ { buffer: images[1], x: 0, y: 0 } ]);
+    }, /At least one layer must not be positioned/);
+
+    beforeExit(function() { assert.ok(completed); });
+};
+
+exports['test premultiplied blend stays close to overlay'] = function(beforeExit) {
+    var completed = false;
+    var stack = [ images[2], images[3], images[4] ];
+
+    // blend() composites premultiplied pixels, Image#overlay straight ones;
+    // the difference is bounded as documented in composite.h.
+    var overlaid = img.fromBuffer(stack[0]).overlay(stack[1]).overlay(stack[2]);
+    overlaid.asPNG({}, function(err) {
+        if (err) throw err;
+        img.blend(stack, { cache: false }, function(err, data) {
+            if (err) throw err;
+            var blended = new img.Image();
+            blended.load(data, function(err) {
+                completed = true;
+                if (err) throw err;
+                var expected = overlaid.data;
+                var actual = blended.data;
+                assert.equal(actual.length, expected.length);
+                var layers = stack.length;
+                for (var i = 0; i < actual.length; i += 4) {
+                    var alpha = actual[i + 3];
+                    assert.ok(Math.abs(alpha - expected[i + 3]) <= layers - 1);
+                    for (var c = 0; c < 3; c++) {
+                        if (alpha === 0) {
+                            assert.equal(actual[i + c], 0);
+                        } else {
+                            assert.ok(Math.abs(actual[i + c] - expected[i + c]) <=
+                                      3 * (layers - 1) * 255 / alpha);
+                        }
+                    }
+                }
+            });
+        });
+    });
+
+    beforeExit(function() { assert.ok(completed); });
+};
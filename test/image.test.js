@@ -71,3 +71,245 @@ exports['test delayed asPNG'] = function(beforeExit) {
         assert.ok(completed);
     });
 };
+
+exports['test paletted asPNG'] = function(beforeExit) {
+    var completed = false;
+    var image = new img.Image();
+    image.load(fs.readFileSync('test/fixture/2.png'));
+    image.asPNG({}, function(err, rgba) {
+        if (err) throw err;
+        image.asPNG({ palette: true }, function(err, data) {
+            completed = true;
+            if (err) throw err;
+            assert.equal(data[25], 3);
+            assert.ok(data.length < rgba.length);
+        });
+    });
+
+    beforeExit(function() { assert.ok(completed); });
+};
+
+exports['test large asPNG roundtrip'] = function(beforeExit) {
+    // Big enough to be compressed on several threads.
+    var completed = false;
+    var image = new img.Image();
+    image.load(fs.readFileSync('test/fixture/large.png'));
+    image.asPNG({}, function(err, data) {
+        if (err) throw err;
+        var copy = new img.Image();
+        copy.load(data, function(err) {
+            completed = true;
+            if (err) throw err;
+            assert.equal('' + copy, '[Image 1024x1024]');
+            assert.equal(copy.data.length, image.data.length);
+            for (var i = 0; i < image.data.length; i++) {
+                if (copy.data[i] !== image.data[i]) assert.fail(copy.data[i], image.data[i], 'byte ' + i, '==');
+            }
+        });
+    });
+
+    beforeExit(function() { assert.ok(completed); });
+};
+
+exports['test asPNG encode options'] = function(beforeExit) {
+    var completed = 0;
+    var image = new img.Image();
+    image.load(fs.readFileSync('test/fixture/3.png'));
+    image.asPNG({ level: 0, filter: 'none' }, function(err, stored) {
+        if (err) throw err;
+        image.asPNG({ level: 9 }, function(err, data) {
+            completed++;
+            if (err) throw err;
+            assert.ok(data.length < stored.length);
+        });
+        image.asPNG({ preset: 'auto' }, function(err, data) {
+            completed++;
+            if (err) throw err;
+            assert.ok(data.length < stored.length);
+        });
+    });
+
+    assert.throws(function() {
+        image.asPNG({ filter: 'diagonal' });
+    }, /filter must be one of/);
+    assert.throws(function() {
+        image.asPNG({ level: 10 });
+    }, /level must be an integer between 0 and 9/);
+
+    beforeExit(function() { assert.equal(completed, 2); });
+};
+
+exports['test JPEG load and output'] = function(beforeExit) {
+    var completed = 0;
+    var image = new img.Image();
+    image.load(fs.readFileSync('test/fixture/1.jpg'), function(err) {
+        completed++;
+        if (err) throw err;
+        assert.equal(image.width, 512);
+        assert.equal(image.height, 512);
+    });
+    image.asPNG({ format: 'jpeg', quality: 80 }, function(err, data) {
+        completed++;
+        if (err) throw err;
+        assert.equal(data[0], 0xFF);
+        assert.equal(data[1], 0xD8);
+    });
+
+    // Images with transparent pixels can't be JPEGs.
+    var transparent = new img.Image();
+    transparent.load(fs.readFileSync('test/fixture/3.png'));
+    transparent.asPNG({ format: 'jpeg' }, function(err, data) {
+        completed++;
+        if (err) throw err;
+        assert.equal(data.toString('binary', 1, 4), 'PNG');
+    });
+
+    var photo = fs.readFileSync('test/fixture/1.jpg');
+    var truncated = new img.Image();
+    truncated.load(photo.slice(0, photo.length / 2), function(err) {
+        completed++;
+        assert.ok(/Invalid JPEG/.test(err.message));
+        assert.equal(truncated.data, undefined);
+    });
+
+    var corrupt = new img.Image();
+    corrupt.on('load', function() {
+        assert.fail('corrupt JPEG loaded');
+    });
+    corrupt.on('error', function(err) {
+        completed++;
+        assert.ok(/Invalid JPEG/.test(err.message));
+    });
+    corrupt.load(photo.slice(0, photo.length / 2));
+
+    beforeExit(function() { assert.equal(completed, 5); });
+};
+
+exports['test data is a view of the pixels'] = function(beforeExit) {
+    var completed = false;
+    var image = new img.Image();
+    image.load(fs.readFileSync('test/fixture/3.png'), function(err) {
+        completed = true;
+        if (err) throw err;
+        var data = image.data;
+        data[0] = (data[0] + 1) % 256;
+        assert.equal(image.data[0], data[0]);
+    });
+
+    beforeExit(function() { assert.ok(completed); });
+};
+
+exports['test streaming load'] = function(beforeExit) {
+    var completed = false;
+    var file = fs.readFileSync('test/fixture/large.png');
+    img.fromBuffer(file, function(err, expected) {
+        if (err) throw err;
+
+        var image = new img.Image();
+        image.on('load', function() {
+            completed = true;
+            assert.equal(image.width, 1024);
+            assert.equal(image.height, 1024);
+            assert.deepEqual(image.data, expected.data);
+        });
+        fs.createReadStream('test/fixture/large.png', { bufferSize: 1000 }).pipe(image);
+    });
+
+    var jpeg = false;
+    var data = fs.readFileSync('test/fixture/1.jpg');
+    var image = new img.Image();
+    image.write(data.slice(0, 5));
+    image.end(data.slice(5), function(err) {
+        jpeg = true;
+        if (err) throw err;
+        assert.equal(image.width, 512);
+    });
+
+    var truncated = false;
+    var partial = new img.Image();
+    partial.end(data.slice(0, data.length / 2), function(err) {
+        truncated = true;
+        assert.ok(/Invalid JPEG/.test(err.message));
+    });
+
+    var failed = false;
+    var broken = new img.Image();
+    broken.write(file.slice(0, 10000));
+    broken.end(function(err) {
+        failed = true;
+        assert.ok(/Unexpected end of PNG data/.test(err.message));
+    });
+
+    beforeExit(function() {
+        assert.ok(completed);
+        assert.ok(jpeg);
+        assert.ok(truncated);
+        assert.ok(failed);
+    });
+};
+
+exports['test slice'] = function(beforeExit) {
+    var completed = false;
+    var image = img.fromBuffer(fs.readFileSync('test/fixture/large.png'));
+    image.slice(300, {}, function(err, tiles) {
+        completed = true;
+        if (err) throw err;
+        assert.equal(tiles.length, 16);
+        // IHDR width and height of the first and the bottom right tile.
+        assert.equal(tiles[0][18] * 256 + tiles[0][19], 300);
+        assert.equal(tiles[0][22] * 256 + tiles[0][23], 300);
+        assert.equal(tiles[15][18] * 256 + tiles[15][19], 124);
+        assert.equal(tiles[15][22] * 256 + tiles[15][23], 124);
+    });
+
+    assert.throws(function() {
+        image.slice(0, function() {});
+    }, /Tile size must be a positive integer/);
+
+    beforeExit(function() { assert.ok(completed); });
+};
+
+exports['test resize'] = function(beforeExit) {
+    var completed = false;
+    var image = img.fromBuffer(fs.readFileSync('test/fixture/3.png'));
+    image.resize(128, 64, 'lanczos').resize(100, 100, 'box', function(err) {
+        if (err) throw err;
+        assert.equal('' + image, '[Image 100x100]');
+        assert.equal(image.data.length, 4 * 100 * 100);
+        image.asPNG({}, function(err, data) {
+            completed = true;
+            if (err) throw err;
+            assert.equal(img.info(data).width, 100);
+        });
+    });
+
+    assert.throws(function() {
+        image.resize(0, 10);
+    }, /Width and height must be positive integers/);
+    assert.throws(function() {
+        image.resize(10, 10, 'cubic');
+    }, /filter must be 'box', 'bilinear' or 'lanczos'/);
+
+    beforeExit(function() { assert.ok(completed); });
+};
+
+exports['test positioned overlay'] = function(beforeExit) {
+    var completed = false;
+    // 256x256 over 1024x1024; the overlay sticks out past the left edge.
+    var image = img.fromBuffer(fs.readFileSync('test/fixture/large.png'));
+    image
+        .overlay(fs.readFileSync('test/fixture/2.png'), { x: 100, y: 100 })
+        .overlay(fs.readFileSync('test/fixture/3.png'), { x: -128, y: 900 })
+        .asPNG({}, function(err, data) {
+            completed = true;
+            if (err) throw err;
+            assert.equal(img.info(data).width, 1024);
+            assert.equal(img.info(data).height, 1024);
+        });
+
+    assert.throws(function() {
+        image.overlay(fs.readFileSync('test/fixture/2.png'), { x: 1.5 });
+    }, /x and y must be integers/);
+
+    beforeExit(function() { assert.ok(completed); });
+};